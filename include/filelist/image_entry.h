@@ -4,6 +4,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct image_entry_t {
 	struct image_entry_t *next;
@@ -41,6 +42,20 @@ void image_entry_free_list(image_entry_t *list);
 
 image_entry_t *image_entry_sort(image_entry_t *list);
 
+/*
+  Returns an array of pointers to all regular files in a list, sorted by
+  file ID, so the entry for a file ID can be looked up in logarithmic time
+  using image_entry_find_file.
+ */
+image_entry_t **image_entry_file_index(image_entry_t *list, size_t *count);
+
+/*
+  Returns the first index entry with a file ID or NULL if there is none.
+  Files that share the ID with it, if any, directly follow it.
+ */
+image_entry_t **image_entry_find_file(image_entry_t **index, size_t count,
+				      uint32_t id);
+
 int dump_toc(image_entry_t *list, const char *root, TOC_FORMAT format);
 
 #endif /* IMAGE_ENTRY_H */
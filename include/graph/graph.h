@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: ISC */
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+  A directed graph in compressed sparse row form. Nodes are identified by
+  integers from 0 to num_nodes - 1. An edge from A to B means that A depends
+  on B.
+
+  The targets of the edges leaving node N are stored in
+  edges[offsets[N] .. offsets[N + 1] - 1], in the order the edges were added.
+  The reverse edges (i.e. the nodes depending on N) are stored the same way
+  in rev_edges and rev_offsets.
+ */
+typedef struct {
+	size_t num_nodes;
+	size_t num_edges;
+
+	size_t *offsets;
+	size_t *edges;
+
+	size_t *rev_offsets;
+	size_t *rev_edges;
+} graph_t;
+
+/* Collects edges in arbitrary order until the graph is built. */
+typedef struct {
+	size_t *from;
+	size_t *to;
+
+	size_t num_edges;
+	size_t max_edges;
+} graph_builder_t;
+
+enum {
+	GRAPH_FORWARD = 0,
+	GRAPH_REVERSE = 1,
+};
+
+void graph_builder_init(graph_builder_t *builder);
+
+void graph_builder_cleanup(graph_builder_t *builder);
+
+int graph_builder_add_edge(graph_builder_t *builder, size_t from, size_t to);
+
+/*
+  Turn the edges collected so far into a graph with num_nodes nodes. All
+  edges must refer to nodes below num_nodes. An existing graph is replaced.
+ */
+int graph_build(graph_t *graph, const graph_builder_t *builder,
+		size_t num_nodes);
+
+void graph_cleanup(graph_t *graph);
+
+/*
+  Mark every node reachable from the given roots, including the roots. In
+  GRAPH_FORWARD direction this is the set of all (indirect) dependencies, in
+  GRAPH_REVERSE direction the set of all nodes that (indirectly) depend on
+  the roots. The marked array must have room for num_nodes entries and is
+  not cleared first.
+ */
+int graph_closure(const graph_t *graph, const size_t *roots, size_t num_roots,
+		  int direction, bool *marked);
+
+/*
+  Order the nodes such that every node comes after its dependencies. If mask
+  is not NULL, only nodes with a mask entry set are considered.
+
+  The order is written to order and the number of nodes written to count. If
+  levels is not NULL, it receives the dependency level of every node, i.e. 0
+  for nodes without dependencies and one more than the highest level of the
+  dependencies otherwise. The output is grouped by level, nodes on the same
+  level are sorted by ID.
+
+  Returns -1 and prints an error if the graph contains a cycle.
+ */
+int graph_topo_sort(const graph_t *graph, const bool *mask, size_t *order,
+		    size_t *count, size_t *levels);
+
+#endif /* GRAPH_H */
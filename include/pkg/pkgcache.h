@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: ISC */
+#ifndef PKGCACHE_H
+#define PKGCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pkgreader.h"
+
+/* size of a buffer large enough to hold a name from pkg_cache_file_name */
+#define PKG_CACHE_FILE_NAME_MAX 9
+
+/* default upper bound for the cache size if none is specified */
+#define PKG_CACHE_DEFAULT_SIZE (1024UL * 1024UL * 1024UL)
+
+typedef struct pkg_cache_t pkg_cache_t;
+
+/*
+  Open (and create if required) a directory that holds the extracted files
+  of previously unpacked packages. Each package gets a sub directory named
+  after a fingerprint of the package file, holding its regular files named
+  after their file IDs.
+
+  If max_size is not 0, the least recently used entries are evicted once
+  the cache is closed, until the cache fits into max_size bytes.
+ */
+pkg_cache_t *pkg_cache_open(const char *path, uint64_t max_size);
+
+void pkg_cache_close(pkg_cache_t *cache);
+
+/*
+  Look up a package in the cache. Returns 1 if the package is cached, 0 if
+  the package is not cached and a new entry has been started that the
+  caller is supposed to fill, or -1 on failure.
+ */
+int pkg_cache_begin(pkg_cache_t *cache, pkg_reader_t *rd);
+
+/*
+  Get a directory file descriptor for the entry started by pkg_cache_begin.
+ */
+int pkg_cache_entry_fd(pkg_cache_t *cache);
+
+/*
+  Finish the current package. A newly populated entry is only made visible
+  if commit is true, otherwise it is thrown away.
+ */
+int pkg_cache_end(pkg_cache_t *cache, bool commit);
+
+/* Get the name of the file with a given ID within a cache entry. */
+void pkg_cache_file_name(uint32_t id, char *buffer);
+
+#endif /* PKGCACHE_H */
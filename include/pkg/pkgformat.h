@@ -9,6 +9,12 @@
 
 typedef enum {
 	PKG_MAGIC_HEADER = 0x21676B70,
+
+	/*
+	  same as PKG_MAGIC_HEADER, but files in the TOC may share an ID and
+	  data records may contain padding entries
+	 */
+	PKG_MAGIC_HEADER_V2 = 0x32676B70,
 	PKG_MAGIC_TOC = 0x21636F74,
 	PKG_MAGIC_DATA = 0x21746164,
 } PKG_MAGIC;
@@ -62,6 +68,15 @@ typedef struct {
 	/* uint8_t data[]; */
 } file_data_t;
 
+/* file ID of a padding entry in a data record, needs PKG_MAGIC_HEADER_V2 */
+#define PKG_FILE_ID_PADDING 0xFFFFFFFF
+
+typedef struct {
+	uint32_t id;
+	uint32_t size;
+	/* uint8_t zero[]; */
+} file_padding_t;
+
 typedef struct {
 	uint16_t num_depends;
 	/* pkg_dependency_t depends[]; */
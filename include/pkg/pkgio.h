@@ -3,16 +3,72 @@
 #define PKGIO_H
 
 #include "pkgreader.h"
+#include "pkgcache.h"
+#include "comp/compressor.h"
 #include "filelist/image_entry.h"
+#include "sqfs/sqfs.h"
 
 enum {
 	UNPACK_NO_CHOWN = 0x01,
 	UNPACK_NO_CHMOD = 0x02,
 	UNPACK_NO_SYMLINKS = 0x04,
 	UNPACK_NO_DEVICES = 0x08,
+
+	/* start writeback per file, syncfs once the package is unpacked */
+	UNPACK_SYNC_PACKAGE = 0x10,
+
+	/*
+	  additionally fsync every single file before closing it and every
+	  directory the package touched once it is unpacked
+	 */
+	UNPACK_SYNC_STRICT = 0x20,
+
+	/*
+	  hard link files between multiple roots and the package cache,
+	  instead of reflinking or copying them
+	 */
+	UNPACK_HARDLINK = 0x40,
 };
 
-int pkg_unpack(int rootfd, int flags, pkg_reader_t *rd);
+typedef struct {
+	/* nano seconds spent waiting for data to reach the disk */
+	uint64_t sync_time;
+
+	/* packages restored from the cache vs. actually decompressed */
+	size_t cache_hits;
+	size_t cache_misses;
+} pkg_unpack_stats_t;
+
+/*
+  If a cache is given, the files of a package are restored from there if
+  possible, otherwise the package is decompressed and the cache populated.
+ */
+int pkg_unpack(int rootfd, int flags, pkg_reader_t *rd, pkg_cache_t *cache,
+	       pkg_unpack_stats_t *stats);
+
+/*
+  Unpack a package to several root directories at once, decoding it only
+  a single time. Files are written to the first root and then replicated
+  to the others via hard links (if UNPACK_HARDLINK is set), reflinks, or by
+  copying the freshly written data.
+ */
+int pkg_unpack_multi(const int *rootfds, size_t count, int flags,
+		     pkg_reader_t *rd, pkg_cache_t *cache,
+		     pkg_unpack_stats_t *stats);
+
+int pkg_unpack_parse_sync_mode(const char *str, int *flags);
+
+typedef struct pkg_cpio_t pkg_cpio_t;
+
+pkg_cpio_t *pkg_cpio_open(const char *path, compressor_t *cmp);
+
+int pkg_cpio_add(pkg_cpio_t *cpio, int flags, pkg_reader_t *rd);
+
+int pkg_cpio_finish(pkg_cpio_t *cpio);
+
+void pkg_cpio_close(pkg_cpio_t *cpio);
+
+int pkg_sqfs_add(sqfs_writer_t *sqfs, int flags, pkg_reader_t *rd);
 
 int image_entry_list_from_package(pkg_reader_t *pkg, image_entry_t ** list);
 
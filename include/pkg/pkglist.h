@@ -2,22 +2,43 @@
 #ifndef PKGLIST_H
 #define PKGLIST_H
 
-struct pkg_dep_node {
-	char *name;
-
-	/* num dependencies == number of outgoing edges */
-	size_t num_deps;
+#include "util/hashtable.h"
+#include "graph/graph.h"
 
-	/* direct dependencies == array of outgoing edges */
-	struct pkg_dep_node **deps;
+struct pkg_dep_node {
+	/* interned, owned by the index of the list the node belongs to */
+	const char *name;
 
 	/* linked list pointer */
 	struct pkg_dep_node *next;
+
+	/* node ID in the dependency graph, assigned on append */
+	size_t id;
+
+	/*
+	  Set by sort_by_dependencies: the dependency level, i.e. 0 for
+	  packages without dependencies and one more than the highest level
+	  of the dependencies otherwise.
+	 */
+	size_t level;
 };
 
 struct pkg_dep_list {
 	struct pkg_dep_node *head;
 	struct pkg_dep_node *tail;
+
+	/* maps package names to nodes, created on the first append */
+	hash_table_t index;
+
+	/* number of nodes appended so far, i.e. the next node ID */
+	size_t count;
+
+	/* dependency edges by node ID, recorded by collect_dependencies */
+	graph_builder_t edges;
+
+	/* set up by pkg_list_build_graph */
+	graph_t graph;
+	struct pkg_dep_node **nodes;
 };
 
 struct pkg_dep_node *append_pkg(struct pkg_dep_list *list, const char *name);
@@ -26,8 +47,19 @@ struct pkg_dep_node *find_pkg(struct pkg_dep_list *list, const char *name);
 
 void pkg_list_cleanup(struct pkg_dep_list *list);
 
+/*
+  (Re)build the dependency graph from the recorded edges, covering every
+  node of the list, and the map from node IDs back to nodes.
+ */
+int pkg_list_build_graph(struct pkg_dep_list *list);
+
 int collect_dependencies(int repofd, struct pkg_dep_list *list);
 
+/*
+  Sort the list such that every package comes after its dependencies,
+  grouped by dependency level. The dependency graph is rebuilt as needed
+  and left intact.
+ */
 int sort_by_dependencies(struct pkg_dep_list *list);
 
 #endif /* PKGLIST_H */
@@ -19,8 +19,28 @@ record_t *pkg_reader_current_record_header(pkg_reader_t *reader);
 ssize_t pkg_reader_read_payload(pkg_reader_t *reader, void *buffer,
 				size_t size);
 
+/*
+  Read the ID of the next file in a data record, skipping any padding in
+  front of it. Returns 1 if there is a file, 0 at the end of the record and
+  -1 on failure.
+ */
+int pkg_reader_next_file(pkg_reader_t *reader, uint32_t *id);
+
+/*
+  Copy up to size bytes of payload to the current position of a file
+  without reading them into memory. This only works for uncompressed
+  records. Where the payload is block aligned in the package, the file
+  system is asked to share the data instead of copying it. Returns the
+  number of bytes copied, the caller reads the rest, if any, with
+  pkg_reader_read_payload. Returns -1 with errno set if writing to the
+  file failed.
+ */
+ssize_t pkg_reader_copy_payload(pkg_reader_t *reader, int fd, size_t size);
+
 int pkg_reader_rewind(pkg_reader_t *reader);
 
 const char *pkg_reader_get_filename(pkg_reader_t *reader);
 
+int pkg_reader_get_fd(pkg_reader_t *reader);
+
 #endif /* PKGREADER_H */
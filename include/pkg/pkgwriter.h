@@ -9,15 +9,56 @@
 
 typedef struct pkg_writer_t pkg_writer_t;
 
+typedef struct {
+	/* uncompressed payload and compressed data written to the file */
+	uint64_t bytes_in;
+	uint64_t bytes_written;
+
+	/* nano seconds spent compressing and writing */
+	uint64_t compress_ns;
+	uint64_t write_ns;
+
+	/* nano seconds the compressor waited for a free output buffer */
+	uint64_t output_wait_ns;
+} pkg_writer_stats_t;
+
 pkg_writer_t *pkg_writer_open(const char *path, bool force);
 
+/*
+  Write a package to an already open file descriptor that need not be
+  seekable, e.g. a pipe. The descriptor is not closed by the writer.
+ */
+pkg_writer_t *pkg_writer_open_stream(int fd, const char *name);
+
 void pkg_writer_close(pkg_writer_t *writer);
 
+void pkg_writer_get_stats(pkg_writer_t *writer, pkg_writer_stats_t *stats);
+
 int pkg_writer_start_record(pkg_writer_t *writer, uint32_t magic,
 			    compressor_t *cmp);
 
+/*
+  For an uncompressed record, the position in the package file at which the
+  next byte of payload will end up.
+ */
+uint64_t pkg_writer_payload_offset(pkg_writer_t *wr);
+
 int pkg_writer_write_payload(pkg_writer_t *wr, void *data, size_t size);
 
+/*
+  Append up to size bytes of payload from the current position of a file
+  without reading them into memory. This only works for uncompressed
+  records written to a seekable file. Returns the number of bytes copied,
+  the caller writes the rest, if any, with pkg_writer_write_payload.
+ */
+ssize_t pkg_writer_copy_payload(pkg_writer_t *wr, int fd, size_t size);
+
+/*
+  Change the magic number of the record currently being written, e.g. to
+  mark the package header as using a newer format revision.
+ */
+void pkg_writer_set_magic(pkg_writer_t *wr, uint32_t magic);
+
 int pkg_writer_end_record(pkg_writer_t *wr);
 
 #endif /* PKGWRITER_H */
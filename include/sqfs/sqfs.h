@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: ISC */
+#ifndef SQFS_H
+#define SQFS_H
+
+#include <stddef.h>
+
+#include "filelist/image_entry.h"
+#include "comp/compressor.h"
+#include "sqfs/squashfs.h"
+
+typedef struct sqfs_node_t sqfs_node_t;
+
+typedef struct sqfs_writer_t sqfs_writer_t;
+
+/*
+  Create a SquashFS image. The data blocks are compressed in parallel on
+  num_workers threads. If num_workers is 0, one thread per online CPU
+  is used.
+ */
+sqfs_writer_t *sqfs_writer_open(const char *path, compressor_t *cmp,
+				size_t block_size, unsigned int num_workers);
+
+void sqfs_writer_close(sqfs_writer_t *sqfs);
+
+/*
+  Add a file system entry to the image. Missing parent directories are
+  created implicitly. If a directory is added more than once, the meta
+  data of the last one added is used.
+
+  For regular files, the content must subsequently be supplied in order
+  through sqfs_writer_append_data, terminated by sqfs_writer_end_file.
+ */
+sqfs_node_t *sqfs_writer_add_entry(sqfs_writer_t *sqfs, image_entry_t *ent);
+
+int sqfs_writer_append_data(sqfs_writer_t *sqfs, sqfs_node_t *node,
+			    const void *data, size_t size);
+
+int sqfs_writer_end_file(sqfs_writer_t *sqfs, sqfs_node_t *node);
+
+/*
+  Instead of supplying the content of a regular file, let it refer to the
+  data blocks and fragment of another file of the same size.
+ */
+int sqfs_writer_share_data(sqfs_writer_t *sqfs, sqfs_node_t *node,
+			   sqfs_node_t *src);
+
+/* write the inode, directory, fragment and ID tables and the super block */
+int sqfs_writer_finish(sqfs_writer_t *sqfs);
+
+#endif /* SQFS_H */
@@ -2,26 +2,61 @@
 #ifndef HASH_TABLE_H
 #define HASH_TABLE_H
 
-typedef struct hash_bucket_t {
-	struct hash_bucket_t *next;
+#include <stdint.h>
+#include <stddef.h>
+
+enum {
+	/*
+	  Do not copy keys on insert. The caller guarantees that every key
+	  outlives its entry in the table.
+	 */
+	HASH_TABLE_BORROW_KEYS = 0x01,
+};
+
+typedef struct {
+	/* cached hash of the key, the home slot is derived from it */
+	uint64_t hash;
 	char *key;
 	void *value;
-} hash_bucket_t;
-
+} hash_entry_t;
+
+/*
+  Open addressing with linear probing and Robin Hood insertion: an entry
+  that is further away from its home slot takes over the slot of one that
+  is closer to home. This keeps probe sequences short, so a lookup mostly
+  touches a single cache line and compares hashes before strings. The table
+  grows automatically, the capacity is always a power of two.
+ */
 typedef struct {
-	hash_bucket_t **buckets;
-	size_t num_buckets;
+	hash_entry_t *entries;
+	size_t capacity;
 	size_t count;
+	int flags;
 } hash_table_t;
 
+/* size is a hint for the number of entries the table is going to hold */
 int hash_table_init(hash_table_t *table, size_t size);
 
+int hash_table_init_flags(hash_table_t *table, size_t size, int flags);
+
 void hash_table_cleanup(hash_table_t *table);
 
 void *hash_table_lookup(hash_table_t *table, const char *key);
 
 int hash_table_set(hash_table_t *table, const char *key, void *value);
 
+/*
+  Same as hash_table_set, but returns the copy of the key owned by the table
+  (or NULL on failure). The string stays valid until the entry is removed,
+  so it can be shared instead of duplicating the key once more.
+ */
+const char *hash_table_intern(hash_table_t *table, const char *key,
+			      void *value);
+
+/*
+  Call fun on every entry. If it returns non-zero, the entry is removed from
+  the table. Adding entries from within the callback is not allowed.
+ */
 void hash_table_foreach(hash_table_t *table, void *usr,
 			int(*fun)(void *usr, const char *key, void *value));
 
@@ -10,6 +10,17 @@ ssize_t write_retry(int fd, void *data, size_t size);
 
 ssize_t read_retry(int fd, void *buffer, size_t size);
 
+/*
+  Copy up to size bytes from the current position of one file to the
+  current position of another inside the kernel, with copy_file_range or
+  through a pipe with splice. Returns the number of bytes copied, which may
+  fall short if the kernel cannot copy between the two files, the input
+  ends or an error occurs; the caller continues with read and write from
+  there and reports the error if there is one. Returns -1 only if data was
+  taken from the input and could not be written.
+ */
+ssize_t copy_range(int infd, int outfd, size_t size);
+
 int mkdir_p(const char *path);
 
 typedef int (*linecb_t)(void *usr, const char *filename,
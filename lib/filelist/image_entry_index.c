@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "filelist/image_entry.h"
+
+static int compare_id(const void *lhs, const void *rhs)
+{
+	const image_entry_t *a = *((const image_entry_t **)lhs);
+	const image_entry_t *b = *((const image_entry_t **)rhs);
+
+	if (a->data.file.id < b->data.file.id)
+		return -1;
+
+	return a->data.file.id > b->data.file.id ? 1 : 0;
+}
+
+/* files that share an ID are kept in a predictable order */
+static int compare_id_name(const void *lhs, const void *rhs)
+{
+	const image_entry_t *a = *((const image_entry_t **)lhs);
+	const image_entry_t *b = *((const image_entry_t **)rhs);
+	int ret = compare_id(lhs, rhs);
+
+	return ret != 0 ? ret : strcmp(a->name, b->name);
+}
+
+image_entry_t **image_entry_file_index(image_entry_t *list, size_t *count)
+{
+	image_entry_t **index, *ent;
+	size_t i = 0;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		if (S_ISREG(ent->mode))
+			++i;
+	}
+
+	index = calloc(i ? i : 1, sizeof(index[0]));
+	if (index == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	*count = i;
+
+	for (i = 0, ent = list; ent != NULL; ent = ent->next) {
+		if (S_ISREG(ent->mode))
+			index[i++] = ent;
+	}
+
+	qsort(index, *count, sizeof(index[0]), compare_id_name);
+	return index;
+}
+
+image_entry_t **image_entry_find_file(image_entry_t **index, size_t count,
+				      uint32_t id)
+{
+	image_entry_t key, *keyptr = &key;
+	image_entry_t **found;
+
+	key.data.file.id = id;
+
+	found = bsearch(&keyptr, index, count, sizeof(index[0]), compare_id);
+
+	while (found != NULL && found > index && found[-1]->data.file.id == id)
+		--found;
+
+	return found;
+}
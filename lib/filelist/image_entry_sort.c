@@ -43,29 +43,47 @@ out_fsize:
 	return 0;
 }
 
-static image_entry_t *insert_sorted(image_entry_t *list, image_entry_t *ent)
+/*
+  Stable merge sort, entries that compare equal (e.g. files of the same
+  size) keep the order in which they were added.
+ */
+static image_entry_t *merge(image_entry_t *a, image_entry_t *b)
 {
-	image_entry_t *it, *prev;
+	image_entry_t *head = NULL, **tail = &head;
 
-	if (list == NULL || compare_ent(list, ent) > 0) {
-		ent->next = list;
-		return ent;
+	while (a != NULL && b != NULL) {
+		if (compare_ent(a, b) <= 0) {
+			*tail = a;
+			a = a->next;
+		} else {
+			*tail = b;
+			b = b->next;
+		}
+
+		tail = &(*tail)->next;
 	}
 
-	it = list->next;
-	prev = list;
+	*tail = (a != NULL) ? a : b;
+	return head;
+}
+
+static image_entry_t *merge_sort(image_entry_t *list, size_t count)
+{
+	image_entry_t *second, *it;
+	size_t i, half;
+
+	if (count < 2)
+		return list;
 
-	while (it != NULL) {
-		if (compare_ent(it, ent) > 0)
-			break;
+	half = count / 2;
 
-		prev = it;
+	for (it = list, i = 1; i < half; ++i)
 		it = it->next;
-	}
 
-	prev->next = ent;
-	ent->next = it;
-	return list;
+	second = it->next;
+	it->next = NULL;
+
+	return merge(merge_sort(list, half), merge_sort(second, count - half));
 }
 
 static void remove_duplicates(image_entry_t *list)
@@ -98,16 +116,15 @@ static void remove_duplicates(image_entry_t *list)
 
 image_entry_t *image_entry_sort(image_entry_t *list)
 {
-	image_entry_t *sorted = NULL, *ent;
+	image_entry_t *ent;
+	size_t count = 0;
 
-	while (list != NULL) {
-		ent = list;
-		list = list->next;
+	for (ent = list; ent != NULL; ent = ent->next)
+		count += 1;
 
-		sorted = insert_sorted(sorted, ent);
-	}
+	list = merge_sort(list, count);
 
-	remove_duplicates(sorted);
+	remove_duplicates(list);
 
-	return sorted;
+	return list;
 }
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "graph/graph.h"
+
+int graph_closure(const graph_t *graph, const size_t *roots, size_t num_roots,
+		  int direction, bool *marked)
+{
+	const size_t *offsets, *edges;
+	size_t i, node, top = 0;
+	size_t *stack;
+
+	if (direction == GRAPH_REVERSE) {
+		offsets = graph->rev_offsets;
+		edges = graph->rev_edges;
+	} else {
+		offsets = graph->offsets;
+		edges = graph->edges;
+	}
+
+	/* every node is pushed at most once */
+	stack = calloc(graph->num_nodes ? graph->num_nodes : 1,
+		       sizeof(stack[0]));
+	if (stack == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	for (i = 0; i < num_roots; ++i) {
+		if (!marked[roots[i]]) {
+			marked[roots[i]] = true;
+			stack[top++] = roots[i];
+		}
+	}
+
+	while (top > 0) {
+		node = stack[--top];
+
+		for (i = offsets[node]; i < offsets[node + 1]; ++i) {
+			if (!marked[edges[i]]) {
+				marked[edges[i]] = true;
+				stack[top++] = edges[i];
+			}
+		}
+	}
+
+	free(stack);
+	return 0;
+}
@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "graph/graph.h"
+
+void graph_builder_init(graph_builder_t *builder)
+{
+	memset(builder, 0, sizeof(*builder));
+}
+
+void graph_builder_cleanup(graph_builder_t *builder)
+{
+	free(builder->from);
+	free(builder->to);
+	memset(builder, 0, sizeof(*builder));
+}
+
+int graph_builder_add_edge(graph_builder_t *builder, size_t from, size_t to)
+{
+	size_t new_max;
+	void *new;
+
+	if (builder->num_edges == builder->max_edges) {
+		new_max = builder->max_edges ? builder->max_edges * 2 : 64;
+
+		new = realloc(builder->from, new_max * sizeof(size_t));
+		if (new == NULL)
+			goto fail_oom;
+		builder->from = new;
+
+		new = realloc(builder->to, new_max * sizeof(size_t));
+		if (new == NULL)
+			goto fail_oom;
+		builder->to = new;
+
+		builder->max_edges = new_max;
+	}
+
+	builder->from[builder->num_edges] = from;
+	builder->to[builder->num_edges] = to;
+	builder->num_edges += 1;
+	return 0;
+fail_oom:
+	fputs("out of memory\n", stderr);
+	return -1;
+}
+
+/* counting sort of the edge list by source node, keeping insertion order */
+static void fill_csr(size_t num_nodes, size_t num_edges, const size_t *src,
+		     const size_t *dst, size_t *offsets, size_t *edges)
+{
+	size_t i;
+
+	for (i = 0; i < num_edges; ++i)
+		offsets[src[i] + 1] += 1;
+
+	for (i = 0; i < num_nodes; ++i)
+		offsets[i + 1] += offsets[i];
+
+	for (i = 0; i < num_edges; ++i)
+		edges[offsets[src[i]]++] = dst[i];
+
+	/* the fill loop shifted every offset by one slot, shift it back */
+	memmove(offsets + 1, offsets, num_nodes * sizeof(offsets[0]));
+	offsets[0] = 0;
+}
+
+int graph_build(graph_t *graph, const graph_builder_t *builder,
+		size_t num_nodes)
+{
+	size_t count = builder->num_edges;
+	graph_t new;
+
+	memset(&new, 0, sizeof(new));
+	new.num_nodes = num_nodes;
+	new.num_edges = count;
+
+	new.offsets = calloc(num_nodes + 1, sizeof(size_t));
+	new.rev_offsets = calloc(num_nodes + 1, sizeof(size_t));
+	new.edges = calloc(count ? count : 1, sizeof(size_t));
+	new.rev_edges = calloc(count ? count : 1, sizeof(size_t));
+
+	if (new.offsets == NULL || new.rev_offsets == NULL ||
+	    new.edges == NULL || new.rev_edges == NULL) {
+		fputs("out of memory\n", stderr);
+		graph_cleanup(&new);
+		return -1;
+	}
+
+	fill_csr(num_nodes, count, builder->from, builder->to,
+		 new.offsets, new.edges);
+	fill_csr(num_nodes, count, builder->to, builder->from,
+		 new.rev_offsets, new.rev_edges);
+
+	graph_cleanup(graph);
+	*graph = new;
+	return 0;
+}
+
+void graph_cleanup(graph_t *graph)
+{
+	free(graph->offsets);
+	free(graph->edges);
+	free(graph->rev_offsets);
+	free(graph->rev_edges);
+	memset(graph, 0, sizeof(*graph));
+}
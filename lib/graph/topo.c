@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "graph/graph.h"
+
+/*
+  Kahn's algorithm: every node has a counter of dependencies that have not
+  been placed yet. Placing a node decrements the counters of its dependents
+  (the reverse edges) and queues the ones that drop to zero, so every edge
+  is only looked at twice.
+ */
+int graph_topo_sort(const graph_t *graph, const bool *mask, size_t *order,
+		    size_t *count, size_t *levels)
+{
+	size_t i, j, node, dep, total = 0, head = 0, tail = 0, max_level = 0;
+	size_t *pending = NULL, *queue = NULL, *level = NULL, *bins = NULL;
+	size_t n = graph->num_nodes;
+	int ret = -1;
+
+	*count = 0;
+	if (n == 0)
+		return 0;
+
+	pending = calloc(n, sizeof(pending[0]));
+	queue = calloc(n, sizeof(queue[0]));
+	level = calloc(n, sizeof(level[0]));
+
+	if (pending == NULL || queue == NULL || level == NULL)
+		goto fail_oom;
+
+	for (i = 0; i < n; ++i) {
+		if (mask != NULL && !mask[i])
+			continue;
+
+		total += 1;
+
+		for (j = graph->offsets[i]; j < graph->offsets[i + 1]; ++j) {
+			if (mask == NULL || mask[graph->edges[j]])
+				pending[i] += 1;
+		}
+
+		if (pending[i] == 0)
+			queue[tail++] = i;
+	}
+
+	while (head < tail) {
+		node = queue[head++];
+
+		for (j = graph->rev_offsets[node];
+		     j < graph->rev_offsets[node + 1]; ++j) {
+			dep = graph->rev_edges[j];
+
+			if (mask != NULL && !mask[dep])
+				continue;
+
+			if (level[dep] < level[node] + 1)
+				level[dep] = level[node] + 1;
+
+			if (--pending[dep] == 0)
+				queue[tail++] = dep;
+		}
+
+		if (level[node] > max_level)
+			max_level = level[node];
+	}
+
+	if (tail < total) {
+		fputs("cycle detected in dependency graph\n", stderr);
+		goto out;
+	}
+
+	/* stable counting sort by level, walking the nodes in ID order */
+	bins = calloc(max_level + 2, sizeof(bins[0]));
+	if (bins == NULL)
+		goto fail_oom;
+
+	for (i = 0; i < tail; ++i)
+		bins[level[queue[i]] + 1] += 1;
+
+	for (i = 0; i <= max_level; ++i)
+		bins[i + 1] += bins[i];
+
+	for (i = 0; i < n; ++i) {
+		if (mask == NULL || mask[i])
+			order[bins[level[i]]++] = i;
+	}
+
+	if (levels != NULL) {
+		for (i = 0; i < n; ++i)
+			levels[i] = level[i];
+	}
+
+	*count = total;
+	ret = 0;
+out:
+	free(bins);
+	free(level);
+	free(queue);
+	free(pending);
+	return ret;
+fail_oom:
+	fputs("out of memory\n", stderr);
+	goto out;
+}
@@ -1,4 +1,6 @@
 /* SPDX-License-Identifier: ISC */
+#include <stdbool.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -6,66 +8,95 @@
 #include "pkg/pkgreader.h"
 #include "pkg/pkglist.h"
 
-int collect_dependencies(int repofd, struct pkg_dep_list *list)
+#define MAX_FETCH_WORKERS 8
+
+/*
+  Fetching a header only needs the package name, so the workers can read
+  ahead on every package discovered so far, while the main thread merges
+  the results into the graph in the order the packages were discovered.
+  This gives exactly the same list as walking it serially.
+ */
+typedef struct fetch_job_t {
+	struct fetch_job_t *next;
+	struct pkg_dep_node *node;
+
+	char **names;
+	size_t num_names;
+
+	bool done;
+	int status;
+} fetch_job_t;
+
+typedef struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t queue_cond;
+	pthread_cond_t done_cond;
+
+	fetch_job_t *head;
+	fetch_job_t *tail;
+	fetch_job_t *todo;
+	bool terminate;
+
+	int repofd;
+} fetch_queue_t;
+
+static void free_job(fetch_job_t *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->num_names; ++i)
+		free(job->names[i]);
+
+	free(job->names);
+	free(job);
+}
+
+static int fetch_header(int repofd, fetch_job_t *job)
 {
-	struct pkg_dep_node *it;
 	pkg_dependency_t dep;
 	uint8_t buffer[257];
 	pkg_reader_t *rd;
 	pkg_header_t hdr;
+	ssize_t ret;
 	size_t i;
-	int ret;
 
-	for (it = list->head; it != NULL; it = it->next) {
-		rd = pkg_reader_open_repo(repofd, it->name);
-		if (rd == NULL)
-			return -1;
+	rd = pkg_reader_open_repo(repofd, job->node->name);
+	if (rd == NULL)
+		return -1;
+
+	ret = pkg_reader_read_payload(rd, &hdr, sizeof(hdr));
+	if (ret < 0)
+		goto fail;
+	if ((size_t)ret < sizeof(hdr))
+		goto fail_trunc;
 
-		ret = pkg_reader_read_payload(rd, &hdr, sizeof(hdr));
+	job->names = calloc(sizeof(job->names[0]), le16toh(hdr.num_depends));
+	if (job->names == NULL)
+		goto fail_oom;
+
+	for (i = 0; i < le16toh(hdr.num_depends); ++i) {
+		ret = pkg_reader_read_payload(rd, &dep, sizeof(dep));
 		if (ret < 0)
 			goto fail;
-		if ((size_t)ret < sizeof(hdr))
+		if ((size_t)ret < sizeof(dep))
 			goto fail_trunc;
 
-		it->num_deps = le16toh(hdr.num_depends);
-		it->deps = calloc(sizeof(it->deps[0]), it->num_deps);
-		if (it->deps == NULL)
-			goto fail_oom;
+		ret = pkg_reader_read_payload(rd, buffer, dep.name_length);
+		if (ret < 0)
+			goto fail;
+		if ((size_t)ret < dep.name_length)
+			goto fail_trunc;
 
-		for (i = 0; i < it->num_deps; ++i) {
-			ret = pkg_reader_read_payload(rd, &dep, sizeof(dep));
-			if (ret < 0)
-				goto fail;
-			if ((size_t)ret < sizeof(hdr))
-				goto fail_trunc;
-
-			ret = pkg_reader_read_payload(rd, buffer,
-						      dep.name_length);
-			if (ret < 0)
-				goto fail;
-			if ((size_t)ret < dep.name_length)
-				goto fail_trunc;
-
-			buffer[dep.name_length] = '\0';
-
-			if (strcmp((char *)buffer, it->name) == 0) {
-				fprintf(stderr,
-					"%s: package depends on itself\n",
-					it->name);
-				goto fail;
-			}
-
-			it->deps[i] = find_pkg(list, (char *)buffer);
-			if (it->deps[i] == NULL) {
-				it->deps[i] = append_pkg(list, (char *)buffer);
-				if (it->deps[i] == NULL)
-					goto fail;
-			}
-		}
+		buffer[dep.name_length] = '\0';
 
-		pkg_reader_close(rd);
+		job->names[i] = strdup((char *)buffer);
+		if (job->names[i] == NULL)
+			goto fail_oom;
+
+		job->num_names += 1;
 	}
 
+	pkg_reader_close(rd);
 	return 0;
 fail_trunc:
 	fprintf(stderr, "%s: truncated header record\n",
@@ -78,3 +109,179 @@ fail:
 	pkg_reader_close(rd);
 	return -1;
 }
+
+static void *fetch_worker(void *arg)
+{
+	fetch_queue_t *queue = arg;
+	fetch_job_t *job;
+	int status;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->mtx);
+		while (queue->todo == NULL && !queue->terminate)
+			pthread_cond_wait(&queue->queue_cond, &queue->mtx);
+
+		if (queue->terminate) {
+			pthread_mutex_unlock(&queue->mtx);
+			break;
+		}
+
+		job = queue->todo;
+		queue->todo = job->next;
+		pthread_mutex_unlock(&queue->mtx);
+
+		status = fetch_header(queue->repofd, job);
+
+		pthread_mutex_lock(&queue->mtx);
+		job->status = status;
+		job->done = true;
+		pthread_cond_broadcast(&queue->done_cond);
+		pthread_mutex_unlock(&queue->mtx);
+	}
+
+	return NULL;
+}
+
+static int enqueue(fetch_queue_t *queue, struct pkg_dep_node *node)
+{
+	fetch_job_t *job = calloc(1, sizeof(*job));
+
+	if (job == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	job->node = node;
+
+	pthread_mutex_lock(&queue->mtx);
+	if (queue->tail == NULL) {
+		queue->head = queue->tail = job;
+	} else {
+		queue->tail->next = job;
+		queue->tail = job;
+	}
+
+	if (queue->todo == NULL)
+		queue->todo = job;
+
+	pthread_cond_signal(&queue->queue_cond);
+	pthread_mutex_unlock(&queue->mtx);
+	return 0;
+}
+
+static fetch_job_t *wait_for_head(fetch_queue_t *queue)
+{
+	fetch_job_t *job;
+
+	pthread_mutex_lock(&queue->mtx);
+	job = queue->head;
+
+	while (!job->done)
+		pthread_cond_wait(&queue->done_cond, &queue->mtx);
+
+	queue->head = job->next;
+	if (queue->head == NULL)
+		queue->tail = NULL;
+	pthread_mutex_unlock(&queue->mtx);
+
+	return job;
+}
+
+static int merge_job(fetch_queue_t *queue, struct pkg_dep_list *list,
+		     fetch_job_t *job)
+{
+	struct pkg_dep_node *it = job->node, *dep;
+	size_t i;
+
+	for (i = 0; i < job->num_names; ++i) {
+		if (strcmp(job->names[i], it->name) == 0) {
+			fprintf(stderr, "%s: package depends on itself\n",
+				it->name);
+			return -1;
+		}
+
+		dep = find_pkg(list, job->names[i]);
+		if (dep == NULL) {
+			dep = append_pkg(list, job->names[i]);
+			if (dep == NULL)
+				return -1;
+
+			if (enqueue(queue, dep))
+				return -1;
+		}
+
+		if (graph_builder_add_edge(&list->edges, it->id, dep->id))
+			return -1;
+	}
+
+	return 0;
+}
+
+int collect_dependencies(int repofd, struct pkg_dep_list *list)
+{
+	pthread_t workers[MAX_FETCH_WORKERS];
+	size_t i, num_workers = 0;
+	struct pkg_dep_node *it;
+	fetch_queue_t queue;
+	fetch_job_t *job;
+	int ret = -1;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.repofd = repofd;
+	pthread_mutex_init(&queue.mtx, NULL);
+	pthread_cond_init(&queue.queue_cond, NULL);
+	pthread_cond_init(&queue.done_cond, NULL);
+
+	/* every node is fetched again, so start over with the edges */
+	list->edges.num_edges = 0;
+
+	for (it = list->head; it != NULL; it = it->next) {
+		if (enqueue(&queue, it))
+			goto out;
+	}
+
+	for (i = 0; i < MAX_FETCH_WORKERS; ++i) {
+		if (pthread_create(workers + i, NULL, fetch_worker, &queue)) {
+			if (num_workers > 0)
+				break;
+
+			fputs("failed to create header fetching thread\n",
+			      stderr);
+			goto out;
+		}
+
+		num_workers += 1;
+	}
+
+	while (queue.head != NULL) {
+		job = wait_for_head(&queue);
+
+		if (job->status != 0 || merge_job(&queue, list, job)) {
+			free_job(job);
+			goto out;
+		}
+
+		free_job(job);
+	}
+
+	ret = 0;
+out:
+	pthread_mutex_lock(&queue.mtx);
+	queue.terminate = true;
+	pthread_cond_broadcast(&queue.queue_cond);
+	pthread_mutex_unlock(&queue.mtx);
+
+	for (i = 0; i < num_workers; ++i)
+		pthread_join(workers[i], NULL);
+
+	while (queue.head != NULL) {
+		job = queue.head;
+		queue.head = job->next;
+		free_job(job);
+	}
+
+	pthread_cond_destroy(&queue.done_cond);
+	pthread_cond_destroy(&queue.queue_cond);
+	pthread_mutex_destroy(&queue.mtx);
+	return ret;
+}
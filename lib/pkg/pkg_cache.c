@@ -0,0 +1,368 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "pkg/pkgcache.h"
+#include "util/util.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325UL
+#define FNV_PRIME 0x100000001B3UL
+
+struct pkg_cache_t {
+	char *path;
+	int dirfd;
+	uint64_t max_size;
+	bool modified;
+
+	/* the package currently being processed */
+	char name[40];
+	char tmpname[64];
+	bool populating;
+	int entfd;
+};
+
+typedef struct {
+	char name[40];
+	uint64_t size;
+	struct timespec stamp;
+} cache_entry_t;
+
+static int fingerprint(pkg_cache_t *cache, pkg_reader_t *rd)
+{
+	uint64_t hash = FNV_OFFSET_BASIS, offset = 0;
+	int fd = pkg_reader_get_fd(rd);
+	uint8_t buffer[65536];
+	ssize_t i, ret;
+
+	for (;;) {
+		ret = pread(fd, buffer, sizeof(buffer), offset);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(pkg_reader_get_filename(rd));
+			return -1;
+		}
+
+		for (i = 0; i < ret; ++i) {
+			hash ^= buffer[i];
+			hash *= FNV_PRIME;
+		}
+
+		offset += ret;
+	}
+
+	snprintf(cache->name, sizeof(cache->name), "%016llx-%016llx",
+		 (unsigned long long)offset, (unsigned long long)hash);
+	return 0;
+}
+
+static int remove_entry(int dirfd, const char *name)
+{
+	struct dirent *ent;
+	int fd, ret = 0;
+	DIR *dir;
+
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		goto fail;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		goto fail;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		if (unlinkat(fd, ent->d_name, 0)) {
+			fprintf(stderr, "%s/%s: %s\n", name, ent->d_name,
+				strerror(errno));
+			ret = -1;
+		}
+	}
+
+	closedir(dir);
+
+	if (ret == 0 && unlinkat(dirfd, name, AT_REMOVEDIR))
+		goto fail;
+
+	return ret;
+fail:
+	perror(name);
+	return -1;
+}
+
+static int get_entry_size(int dirfd, cache_entry_t *ent)
+{
+	struct dirent *dent;
+	struct stat sb;
+	int fd;
+	DIR *dir;
+
+	fd = openat(dirfd, ent->name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		goto fail;
+
+	if (fstat(fd, &sb)) {
+		close(fd);
+		goto fail;
+	}
+
+	ent->stamp = sb.st_mtim;
+	ent->size = 0;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		goto fail;
+	}
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+
+		if (fstatat(fd, dent->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
+			closedir(dir);
+			goto fail;
+		}
+
+		ent->size += (uint64_t)sb.st_blocks * 512;
+	}
+
+	closedir(dir);
+	return 0;
+fail:
+	perror(ent->name);
+	return -1;
+}
+
+static int compare_stamp(const void *lhs, const void *rhs)
+{
+	const cache_entry_t *a = lhs, *b = rhs;
+
+	if (a->stamp.tv_sec != b->stamp.tv_sec)
+		return a->stamp.tv_sec < b->stamp.tv_sec ? -1 : 1;
+
+	if (a->stamp.tv_nsec != b->stamp.tv_nsec)
+		return a->stamp.tv_nsec < b->stamp.tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+/*
+  The modification time of an entry directory is refreshed every time it is
+  used, so removing the oldest entries first evicts the least recently used.
+  Temporary entries that are still being populated start with a '.' and are
+  skipped.
+ */
+static int evict(pkg_cache_t *cache)
+{
+	size_t i, count = 0, max = 0;
+	cache_entry_t *list = NULL;
+	uint64_t total = 0;
+	struct dirent *ent;
+	int fd, ret = -1;
+	void *new;
+	DIR *dir;
+
+	fd = dup(cache->dirfd);
+	if (fd < 0) {
+		perror(cache->path);
+		return -1;
+	}
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		perror(cache->path);
+		close(fd);
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.' ||
+		    strlen(ent->d_name) >= sizeof(list[0].name)) {
+			continue;
+		}
+
+		if (count == max) {
+			max = max ? max * 2 : 16;
+			new = realloc(list, max * sizeof(list[0]));
+
+			if (new == NULL) {
+				fputs("out of memory\n", stderr);
+				goto out;
+			}
+
+			list = new;
+		}
+
+		strcpy(list[count].name, ent->d_name);
+
+		if (get_entry_size(cache->dirfd, list + count))
+			goto out;
+
+		total += list[count++].size;
+	}
+
+	if (count > 0)
+		qsort(list, count, sizeof(list[0]), compare_stamp);
+
+	for (i = 0; i < count && total > cache->max_size; ++i) {
+		if (remove_entry(cache->dirfd, list[i].name))
+			goto out;
+
+		total -= list[i].size;
+	}
+
+	ret = 0;
+out:
+	closedir(dir);
+	free(list);
+	return ret;
+}
+
+pkg_cache_t *pkg_cache_open(const char *path, uint64_t max_size)
+{
+	pkg_cache_t *cache = calloc(1, sizeof(*cache));
+
+	if (cache == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	cache->entfd = -1;
+	cache->max_size = max_size;
+
+	cache->path = strdup(path);
+	if (cache->path == NULL) {
+		fputs("out of memory\n", stderr);
+		free(cache);
+		return NULL;
+	}
+
+	if (mkdir_p(path))
+		goto fail;
+
+	cache->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (cache->dirfd < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	return cache;
+fail:
+	free(cache->path);
+	free(cache);
+	return NULL;
+}
+
+void pkg_cache_close(pkg_cache_t *cache)
+{
+	pkg_cache_end(cache, false);
+
+	if (cache->modified && cache->max_size > 0)
+		evict(cache);
+
+	close(cache->dirfd);
+	free(cache->path);
+	free(cache);
+}
+
+int pkg_cache_begin(pkg_cache_t *cache, pkg_reader_t *rd)
+{
+	if (fingerprint(cache, rd))
+		return -1;
+
+	cache->entfd = openat(cache->dirfd, cache->name,
+			      O_RDONLY | O_DIRECTORY);
+
+	if (cache->entfd >= 0) {
+		/* mark as recently used, a read-only cache is fine though */
+		utimensat(cache->dirfd, cache->name, NULL, 0);
+		cache->populating = false;
+		return 1;
+	}
+
+	if (errno != ENOENT)
+		goto fail_errno;
+
+	snprintf(cache->tmpname, sizeof(cache->tmpname), ".%s.%d",
+		 cache->name, (int)getpid());
+
+	if (mkdirat(cache->dirfd, cache->tmpname, 0755))
+		goto fail_errno;
+
+	cache->entfd = openat(cache->dirfd, cache->tmpname,
+			      O_RDONLY | O_DIRECTORY);
+	if (cache->entfd < 0) {
+		fprintf(stderr, "%s/%s: %s\n", cache->path,
+			cache->tmpname, strerror(errno));
+		unlinkat(cache->dirfd, cache->tmpname, AT_REMOVEDIR);
+		return -1;
+	}
+
+	cache->populating = true;
+	return 0;
+fail_errno:
+	fprintf(stderr, "%s/%s: %s\n", cache->path, cache->name,
+		strerror(errno));
+	return -1;
+}
+
+int pkg_cache_entry_fd(pkg_cache_t *cache)
+{
+	return cache->entfd;
+}
+
+int pkg_cache_end(pkg_cache_t *cache, bool commit)
+{
+	int ret = 0;
+
+	if (cache->entfd < 0)
+		return 0;
+
+	close(cache->entfd);
+	cache->entfd = -1;
+
+	if (!cache->populating)
+		return 0;
+
+	cache->populating = false;
+
+	if (commit) {
+		if (renameat(cache->dirfd, cache->tmpname,
+			     cache->dirfd, cache->name) == 0) {
+			cache->modified = true;
+			return 0;
+		}
+
+		/* somebody else populated the entry in the mean time */
+		if (errno != EEXIST && errno != ENOTEMPTY) {
+			fprintf(stderr, "%s/%s: %s\n", cache->path,
+				cache->name, strerror(errno));
+			ret = -1;
+		}
+	}
+
+	if (remove_entry(cache->dirfd, cache->tmpname))
+		ret = -1;
+
+	return ret;
+}
+
+void pkg_cache_file_name(uint32_t id, char *buffer)
+{
+	sprintf(buffer, "%08x", (unsigned int)id);
+}
@@ -0,0 +1,424 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "util/hashtable.h"
+#include "pkg/pkgio.h"
+#include "util/util.h"
+
+/* value stored in the name table for directories that we already wrote */
+#define NAME_IS_DIR ((void *)0x01)
+#define NAME_IS_OTHER ((void *)0x02)
+
+struct pkg_cpio_t {
+	const char *path;
+	int fd;
+
+	compressor_stream_t *stream;
+	uint64_t offset;
+	uint32_t inode;
+
+	hash_table_t names;
+};
+
+static int flush_to_file(pkg_cpio_t *cpio)
+{
+	uint8_t buffer[16384];
+	ssize_t count, ret;
+
+	for (;;) {
+		count = cpio->stream->read(cpio->stream, buffer,
+					   sizeof(buffer));
+		if (count == 0)
+			break;
+		if (count < 0) {
+			fprintf(stderr, "%s: error compressing data\n",
+				cpio->path);
+			return -1;
+		}
+
+		ret = write_retry(cpio->fd, buffer, count);
+
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", cpio->path,
+				strerror(errno));
+			return -1;
+		}
+
+		if (ret < count) {
+			fprintf(stderr, "%s: truncated write\n", cpio->path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int cpio_write(pkg_cpio_t *cpio, const void *data, size_t size)
+{
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = cpio->stream->write(cpio->stream, data, size);
+		if (ret < 0)
+			return -1;
+
+		if ((size_t)ret < size) {
+			if (flush_to_file(cpio))
+				return -1;
+		}
+
+		data = (const char *)data + ret;
+		size -= ret;
+		cpio->offset += ret;
+	}
+
+	return 0;
+}
+
+static int cpio_pad(pkg_cpio_t *cpio, unsigned int alignment)
+{
+	static const uint8_t zero[512];
+	size_t diff = cpio->offset % alignment;
+
+	if (diff == 0)
+		return 0;
+
+	return cpio_write(cpio, zero, alignment - diff);
+}
+
+static int cpio_header(pkg_cpio_t *cpio, const char *name, mode_t mode,
+		       uid_t uid, gid_t gid, uint64_t size, dev_t devno)
+{
+	char buffer[128];
+	size_t namesize;
+
+	if (size > 0xFFFFFFFFUL) {
+		fprintf(stderr, "%s: %s: file too big for cpio archive\n",
+			cpio->path, name);
+		return -1;
+	}
+
+	namesize = strlen(name) + 1;
+
+	sprintf(buffer, "070701%08X%08X%08X%08X%08X%08X%08X"
+		"%08X%08X%08X%08X%08X%08X",
+		(unsigned int)cpio->inode++, (unsigned int)mode,
+		(unsigned int)uid, (unsigned int)gid,
+		S_ISDIR(mode) ? 2U : 1U, 0U, (unsigned int)size,
+		0U, 0U, major(devno), minor(devno),
+		(unsigned int)namesize, 0U);
+
+	if (cpio_write(cpio, buffer, strlen(buffer)))
+		return -1;
+
+	if (cpio_write(cpio, name, namesize))
+		return -1;
+
+	return cpio_pad(cpio, 4);
+}
+
+static int add_name(pkg_cpio_t *cpio, image_entry_t *ent)
+{
+	void *old = hash_table_lookup(&cpio->names, ent->name);
+
+	if (old == NULL) {
+		return hash_table_set(&cpio->names, ent->name,
+				      S_ISDIR(ent->mode) ?
+				      NAME_IS_DIR : NAME_IS_OTHER);
+	}
+
+	if (old == NAME_IS_DIR && S_ISDIR(ent->mode))
+		return 1;
+
+	fprintf(stderr, "%s: %s: File exists\n", cpio->path, ent->name);
+	return -1;
+}
+
+static int write_hierarchy(pkg_cpio_t *cpio, image_entry_t *list, int flags)
+{
+	image_entry_t *ent;
+	size_t len;
+	int ret;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		switch (ent->mode & S_IFMT) {
+		case S_IFDIR:
+			break;
+		case S_IFLNK:
+			if (flags & UNPACK_NO_SYMLINKS)
+				continue;
+			break;
+		case S_IFBLK:
+		case S_IFCHR:
+			if (flags & UNPACK_NO_DEVICES)
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		ret = add_name(cpio, ent);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			continue;
+
+		if (S_ISLNK(ent->mode)) {
+			len = strlen(ent->data.symlink.target);
+
+			if (cpio_header(cpio, ent->name, S_IFLNK | 0777,
+					ent->uid, ent->gid, len, 0)) {
+				return -1;
+			}
+
+			if (cpio_write(cpio, ent->data.symlink.target, len))
+				return -1;
+
+			if (cpio_pad(cpio, 4))
+				return -1;
+		} else if (S_ISDIR(ent->mode)) {
+			if (cpio_header(cpio, ent->name, ent->mode,
+					ent->uid, ent->gid, 0, 0)) {
+				return -1;
+			}
+		} else {
+			if (cpio_header(cpio, ent->name, ent->mode, ent->uid,
+					ent->gid, 0, ent->data.device.devno)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int write_file_header(pkg_cpio_t *cpio, image_entry_t *meta)
+{
+	if (add_name(cpio, meta))
+		return -1;
+
+	return cpio_header(cpio, meta->name, meta->mode, meta->uid,
+			   meta->gid, meta->data.file.size, 0);
+}
+
+/*
+  The content of files that share it is only stored once in the package,
+  but every copy needs it in the archive, so it is kept in memory.
+ */
+static int write_shared(pkg_cpio_t *cpio, image_entry_t **found,
+			image_entry_t **last, pkg_reader_t *rd)
+{
+	uint64_t size = (*found)->data.file.size;
+	uint8_t *data = NULL;
+	ssize_t ret;
+
+	if (size > 0) {
+		data = malloc(size);
+		if (data == NULL) {
+			fputs("out of memory\n", stderr);
+			return -1;
+		}
+
+		ret = pkg_reader_read_payload(rd, data, size);
+		if (ret < 0)
+			goto fail;
+
+		if ((uint64_t)ret < size) {
+			fprintf(stderr, "%s: truncated file data record\n",
+				pkg_reader_get_filename(rd));
+			goto fail;
+		}
+	}
+
+	for (; found < last; ++found) {
+		if (write_file_header(cpio, *found))
+			goto fail;
+
+		if (size > 0 && cpio_write(cpio, data, size))
+			goto fail;
+
+		if (cpio_pad(cpio, 4))
+			goto fail;
+	}
+
+	free(data);
+	return 0;
+fail:
+	free(data);
+	return -1;
+}
+
+static int write_files(pkg_cpio_t *cpio, image_entry_t **index, size_t count,
+		       pkg_reader_t *rd)
+{
+	image_entry_t **found, **last, *meta;
+	uint8_t buffer[16384];
+	ssize_t ret;
+	size_t diff;
+	uint32_t id;
+	uint64_t i;
+
+	for (;;) {
+		ret = pkg_reader_next_file(rd, &id);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+			return -1;
+
+		found = image_entry_find_file(index, count, id);
+		if (found == NULL) {
+			fprintf(stderr, "%s: missing meta information for "
+				"file %u\n", pkg_reader_get_filename(rd),
+				(unsigned int)id);
+			return -1;
+		}
+
+		last = found + 1;
+		while (last < index + count && (*last)->data.file.id == id)
+			++last;
+
+		if (last - found > 1) {
+			if (write_shared(cpio, found, last, rd))
+				return -1;
+			continue;
+		}
+
+		meta = *found;
+
+		if (write_file_header(cpio, meta))
+			return -1;
+
+		for (i = 0; i < meta->data.file.size; i += diff) {
+			diff = sizeof(buffer);
+			if ((meta->data.file.size - i) < (uint64_t)diff)
+				diff = meta->data.file.size - i;
+
+			ret = pkg_reader_read_payload(rd, buffer, diff);
+			if (ret < 0)
+				return -1;
+			if ((size_t)ret < diff)
+				goto fail_trunc;
+
+			if (cpio_write(cpio, buffer, diff))
+				return -1;
+		}
+
+		if (cpio_pad(cpio, 4))
+			return -1;
+	}
+
+	return 0;
+fail_trunc:
+	fprintf(stderr, "%s: truncated file data record\n",
+		pkg_reader_get_filename(rd));
+	return -1;
+}
+
+pkg_cpio_t *pkg_cpio_open(const char *path, compressor_t *cmp)
+{
+	pkg_cpio_t *cpio = calloc(1, sizeof(*cpio));
+
+	if (cpio == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	if (hash_table_init(&cpio->names, 1024))
+		goto fail;
+
+	cpio->stream = cmp->compression_stream(cmp, NULL);
+	if (cpio->stream == NULL)
+		goto fail_tbl;
+
+	cpio->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cpio->fd < 0) {
+		perror(path);
+		goto fail_stream;
+	}
+
+	cpio->path = path;
+	cpio->inode = 1;
+	return cpio;
+fail_stream:
+	cpio->stream->destroy(cpio->stream);
+fail_tbl:
+	hash_table_cleanup(&cpio->names);
+fail:
+	free(cpio);
+	return NULL;
+}
+
+int pkg_cpio_add(pkg_cpio_t *cpio, int flags, pkg_reader_t *rd)
+{
+	image_entry_t *list = NULL, **index = NULL;
+	size_t count;
+	record_t *hdr;
+	int ret;
+
+	if (image_entry_list_from_package(rd, &list))
+		return -1;
+
+	if (pkg_reader_rewind(rd))
+		goto fail;
+
+	if (list == NULL)
+		return 0;
+
+	if (write_hierarchy(cpio, list, flags))
+		goto fail;
+
+	index = image_entry_file_index(list, &count);
+	if (index == NULL)
+		goto fail;
+
+	for (;;) {
+		ret = pkg_reader_get_next_record(rd);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+			goto fail;
+
+		hdr = pkg_reader_current_record_header(rd);
+
+		if (hdr->magic == PKG_MAGIC_DATA) {
+			if (write_files(cpio, index, count, rd))
+				goto fail;
+		}
+	}
+
+	free(index);
+	image_entry_free_list(list);
+	return 0;
+fail:
+	free(index);
+	image_entry_free_list(list);
+	return -1;
+}
+
+int pkg_cpio_finish(pkg_cpio_t *cpio)
+{
+	if (cpio_header(cpio, "TRAILER!!!", 0, 0, 0, 0, 0))
+		return -1;
+
+	if (cpio_pad(cpio, 512))
+		return -1;
+
+	cpio->stream->flush(cpio->stream);
+	return flush_to_file(cpio);
+}
+
+void pkg_cpio_close(pkg_cpio_t *cpio)
+{
+	cpio->stream->destroy(cpio->stream);
+	hash_table_cleanup(&cpio->names);
+	close(cpio->fd);
+	free(cpio);
+}
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pkg/pkgio.h"
+#include "sqfs/sqfs.h"
+
+static int add_hierarchy(sqfs_writer_t *sqfs, image_entry_t *list, int flags)
+{
+	image_entry_t *ent;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		switch (ent->mode & S_IFMT) {
+		case S_IFREG:
+			continue;
+		case S_IFLNK:
+			if (flags & UNPACK_NO_SYMLINKS)
+				continue;
+			break;
+		case S_IFBLK:
+		case S_IFCHR:
+			if (flags & UNPACK_NO_DEVICES)
+				continue;
+			break;
+		default:
+			break;
+		}
+
+		if (sqfs_writer_add_entry(sqfs, ent) == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int add_files(sqfs_writer_t *sqfs, image_entry_t **index,
+		     sqfs_node_t **nodes, size_t count, pkg_reader_t *rd)
+{
+	uint8_t buffer[16384];
+	image_entry_t **found, **dup;
+	sqfs_node_t *node;
+	uint64_t i, size;
+	uint32_t id;
+	ssize_t ret;
+	size_t diff;
+
+	for (;;) {
+		ret = pkg_reader_next_file(rd, &id);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+			return -1;
+
+		found = image_entry_find_file(index, count, id);
+		if (found == NULL) {
+			fprintf(stderr, "%s: missing meta information for "
+				"file %u\n", pkg_reader_get_filename(rd),
+				(unsigned int)id);
+			return -1;
+		}
+
+		node = nodes[found - index];
+		size = (*found)->data.file.size;
+
+		for (i = 0; i < size; i += diff) {
+			diff = sizeof(buffer);
+			if ((size - i) < (uint64_t)diff)
+				diff = size - i;
+
+			ret = pkg_reader_read_payload(rd, buffer, diff);
+			if (ret < 0)
+				return -1;
+			if ((size_t)ret < diff)
+				goto fail_trunc;
+
+			if (sqfs_writer_append_data(sqfs, node, buffer, diff))
+				return -1;
+		}
+
+		if (sqfs_writer_end_file(sqfs, node))
+			return -1;
+
+		/* files with the same content only store it once */
+		for (dup = found + 1; dup < index + count &&
+		     (*dup)->data.file.id == id; ++dup) {
+			if (sqfs_writer_share_data(sqfs, nodes[dup - index],
+						   node)) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+fail_trunc:
+	fprintf(stderr, "%s: truncated file data record\n",
+		pkg_reader_get_filename(rd));
+	return -1;
+}
+
+int pkg_sqfs_add(sqfs_writer_t *sqfs, int flags, pkg_reader_t *rd)
+{
+	image_entry_t *list = NULL, **index = NULL;
+	sqfs_node_t **nodes = NULL;
+	size_t i, count;
+	record_t *hdr;
+	int ret;
+
+	if (image_entry_list_from_package(rd, &list))
+		return -1;
+
+	if (pkg_reader_rewind(rd))
+		goto fail;
+
+	if (list == NULL)
+		return 0;
+
+	if (add_hierarchy(sqfs, list, flags))
+		goto fail;
+
+	index = image_entry_file_index(list, &count);
+	if (index == NULL)
+		goto fail;
+
+	nodes = calloc(count ? count : 1, sizeof(nodes[0]));
+	if (nodes == NULL) {
+		fputs("out of memory\n", stderr);
+		goto fail;
+	}
+
+	for (i = 0; i < count; ++i) {
+		nodes[i] = sqfs_writer_add_entry(sqfs, index[i]);
+		if (nodes[i] == NULL)
+			goto fail;
+	}
+
+	for (;;) {
+		ret = pkg_reader_get_next_record(rd);
+		if (ret == 0)
+			break;
+		if (ret < 0)
+			goto fail;
+
+		hdr = pkg_reader_current_record_header(rd);
+
+		if (hdr->magic == PKG_MAGIC_DATA) {
+			if (add_files(sqfs, index, nodes, count, rd))
+				goto fail;
+		}
+	}
+
+	free(nodes);
+	free(index);
+	image_entry_free_list(list);
+	return 0;
+fail:
+	free(nodes);
+	free(index);
+	image_entry_free_list(list);
+	return -1;
+}
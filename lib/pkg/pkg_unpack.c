@@ -1,16 +1,173 @@
 /* SPDX-License-Identifier: ISC */
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "pkg/pkgio.h"
+#include "util/hashtable.h"
 #include "util/util.h"
 
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int sync_file(int fd, const char *name, int flags,
+		     pkg_unpack_stats_t *stats)
+{
+	uint64_t start = time_ns();
+	int ret = 0;
+
+	/*
+	  In strict mode, wait for the data and inode of each file to hit the
+	  disk. Otherwise, merely kick off asynchronous write back, so the
+	  disk is kept busy while we decompress and the syncfs at the end
+	  of the package has little left to wait for.
+	 */
+	if (flags & UNPACK_SYNC_STRICT) {
+		ret = fsync(fd);
+	} else if (flags & UNPACK_SYNC_PACKAGE) {
+		ret = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+
+	if (stats != NULL)
+		stats->sync_time += time_ns() - start;
+
+	if (ret) {
+		fprintf(stderr, "%s: sync: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct {
+	int rootfd;
+	int ret;
+} dir_sync_t;
+
+static int sync_dir(void *usr, const char *name, void *value)
+{
+	dir_sync_t *state = usr;
+	int fd;
+	(void)value;
+
+	if (state->ret != 0)
+		return 1;
+
+	fd = openat(state->rootfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd) != 0) {
+		fprintf(stderr, "%s: sync: %s\n", name, strerror(errno));
+		state->ret = -1;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return 1;
+}
+
+/*
+  The fsync of a file does not cover the directory entry that points to
+  it, so in strict mode, every directory of the package and every parent
+  directory of one of its entries is synced as well, once per package.
+ */
+static int sync_dirs(int rootfd, image_entry_t *list)
+{
+	dir_sync_t state = { rootfd, 0 };
+	image_entry_t *ent;
+	hash_table_t dirs;
+	char *parent, *sep;
+
+	if (hash_table_init(&dirs, 64))
+		return -1;
+
+	if (hash_table_set(&dirs, ".", NULL))
+		goto fail;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		if (S_ISDIR(ent->mode) &&
+		    hash_table_set(&dirs, ent->name, NULL)) {
+			goto fail;
+		}
+
+		sep = strrchr(ent->name, '/');
+		if (sep == NULL)
+			continue;
+
+		parent = strndup(ent->name, sep - ent->name);
+		if (parent == NULL) {
+			fputs("out of memory\n", stderr);
+			goto fail;
+		}
+
+		if (hash_table_set(&dirs, parent, NULL)) {
+			free(parent);
+			goto fail;
+		}
+
+		free(parent);
+	}
+
+	hash_table_foreach(&dirs, &state, sync_dir);
+	hash_table_cleanup(&dirs);
+	return state.ret;
+fail:
+	hash_table_cleanup(&dirs);
+	return -1;
+}
+
+static int sync_root(int rootfd, image_entry_t *list, int flags,
+		     pkg_unpack_stats_t *stats)
+{
+	int ret, fd = rootfd;
+	uint64_t start;
+
+	if (!(flags & (UNPACK_SYNC_PACKAGE | UNPACK_SYNC_STRICT)))
+		return 0;
+
+	start = time_ns();
+
+	if ((flags & UNPACK_SYNC_STRICT) && sync_dirs(rootfd, list))
+		return -1;
+
+	if (rootfd == AT_FDCWD) {
+		fd = open(".", O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			fprintf(stderr, "opening working directory: %s\n",
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	ret = syncfs(fd);
+
+	if (fd != rootfd)
+		close(fd);
+
+	if (stats != NULL)
+		stats->sync_time += time_ns() - start;
+
+	if (ret) {
+		perror("syncfs");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int create_hierarchy(int dirfd, image_entry_t *list, int flags)
 {
 	image_entry_t *ent;
@@ -59,55 +216,247 @@ static int create_hierarchy(int dirfd, image_entry_t *list, int flags)
 	return 0;
 }
 
-static image_entry_t *get_file_entry(image_entry_t *list, uint32_t id)
+static int copy_file_data(int srcfd, int dstfd, const char *name,
+			  uint64_t size)
+{
+	uint8_t buffer[16384];
+	ssize_t ret;
+	uint64_t i;
+	size_t diff;
+
+	for (i = 0; i < size; i += diff) {
+		diff = sizeof(buffer);
+		if ((size - i) < (uint64_t)diff)
+			diff = size - i;
+
+		ret = pread(srcfd, buffer, diff, i);
+		if (ret < 0)
+			goto fail_errno;
+		if ((size_t)ret < diff)
+			goto fail_trunc;
+
+		ret = write_retry(dstfd, buffer, diff);
+		if (ret < 0)
+			goto fail_errno;
+		if ((size_t)ret < diff)
+			goto fail_trunc;
+	}
+
+	return 0;
+fail_errno:
+	perror(name);
+	return -1;
+fail_trunc:
+	fprintf(stderr, "%s: truncated copy\n", name);
+	return -1;
+}
+
+/*
+  Replicate a file that has already been unpacked once, e.g. to the primary
+  root or to the package cache, without touching the package again. Hard
+  links are only used if explicitly requested, since the copies then share
+  the same inode. After that, try to share the extents via a reflink and if
+  the file system cannot do that, copy the data back out of the page cache.
+ */
+static int replicate_file(int srcdir, const char *srcname, int srcfd,
+			  int dstdir, const char *dstname, uint64_t size,
+			  int flags, pkg_unpack_stats_t *stats)
 {
-	while (list != NULL) {
-		if (S_ISREG(list->mode) && list->data.file.id == id)
-			return list;
+	int fd;
+
+	if (flags & UNPACK_HARDLINK) {
+		if (linkat(srcdir, srcname, dstdir, dstname, 0) == 0)
+			return 0;
+
+		if (errno != EXDEV) {
+			fprintf(stderr, "link %s: %s\n", dstname,
+				strerror(errno));
+			return -1;
+		}
+	}
 
-		list = list->next;
+	fd = openat(dstdir, dstname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror(dstname);
+		return -1;
 	}
 
-	return NULL;
+	if (size > 0 && ioctl(fd, FICLONE, srcfd) != 0) {
+		if (copy_file_data(srcfd, fd, dstname, size))
+			goto fail;
+	}
+
+	if (sync_file(fd, dstname, flags, stats))
+		goto fail;
+
+	close(fd);
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+/*
+  Hard links share the permissions and ownership of an inode, so files with
+  the same content can only be linked together if those match as well.
+ */
+static bool same_metadata(const image_entry_t *a, const image_entry_t *b)
+{
+	return a->mode == b->mode && a->uid == b->uid && a->gid == b->gid;
 }
 
-static int unpack_files(int dirfd, image_entry_t *list, pkg_reader_t *rd)
+/*
+  Files that share their content with another one in the package are
+  created from the first one once it is unpacked. They are only hard
+  linked to it if that is what the caller asked for and neither the
+  permissions nor the ownership differ. The copies in the other roots are
+  then made from the one in the primary root, like for any other file.
+ */
+static int replicate_shared(const int *rootfds, size_t count,
+			    const image_entry_t *meta, int fd,
+			    const image_entry_t *dup, int flags,
+			    pkg_unpack_stats_t *stats)
 {
+	int dupflags = flags, dupfd;
+	size_t i;
+
+	if (!same_metadata(dup, meta))
+		dupflags &= ~UNPACK_HARDLINK;
+
+	if (replicate_file(rootfds[0], meta->name, fd, rootfds[0], dup->name,
+			   dup->data.file.size, dupflags, stats)) {
+		return -1;
+	}
+
+	if (count < 2)
+		return 0;
+
+	dupfd = openat(rootfds[0], dup->name, O_RDONLY);
+	if (dupfd < 0) {
+		perror(dup->name);
+		return -1;
+	}
+
+	for (i = 1; i < count; ++i) {
+		if (replicate_file(rootfds[0], dup->name, dupfd, rootfds[i],
+				   dup->name, dup->data.file.size, flags,
+				   stats)) {
+			close(dupfd);
+			return -1;
+		}
+	}
+
+	close(dupfd);
+	return 0;
+}
+
+static int restore_files(const int *rootfds, size_t count, image_entry_t *list,
+			 pkg_cache_t *cache, int flags,
+			 pkg_unpack_stats_t *stats)
+{
+	char name[PKG_CACHE_FILE_NAME_MAX];
+	image_entry_t **index, *meta;
+	size_t i, j, num_files;
+	int fd, entfd, entflags;
+
+	entfd = pkg_cache_entry_fd(cache);
+
+	index = image_entry_file_index(list, &num_files);
+	if (index == NULL)
+		return -1;
+
+	for (i = 0; i < num_files; ++i) {
+		/* the cached file has the metadata of the first with its ID */
+		if (i == 0 || index[i - 1]->data.file.id !=
+		    index[i]->data.file.id) {
+			meta = index[i];
+		}
+
+		pkg_cache_file_name(index[i]->data.file.id, name);
+
+		fd = openat(entfd, name, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "%s: cached copy: %s\n",
+				index[i]->name, strerror(errno));
+			goto fail;
+		}
+
+		entflags = flags;
+		if (!same_metadata(index[i], meta))
+			entflags &= ~UNPACK_HARDLINK;
+
+		for (j = 0; j < count; ++j) {
+			if (replicate_file(entfd, name, fd, rootfds[j],
+					   index[i]->name,
+					   index[i]->data.file.size,
+					   entflags, stats)) {
+				close(fd);
+				goto fail;
+			}
+		}
+
+		close(fd);
+	}
+
+	free(index);
+	return 0;
+fail:
+	free(index);
+	return -1;
+}
+
+static int unpack_files(const int *rootfds, size_t count,
+			image_entry_t **index, size_t num_files,
+			pkg_reader_t *rd, int cachefd, int flags,
+			pkg_unpack_stats_t *stats)
+{
+	char name[PKG_CACHE_FILE_NAME_MAX];
+	image_entry_t *meta, **found, **last;
 	uint8_t buffer[2048];
-	image_entry_t *meta;
-	file_data_t frec;
 	ssize_t ret;
 	size_t diff;
+	uint32_t id;
 	uint64_t i;
+	size_t j;
 	int fd;
 
 	for (;;) {
-		ret = pkg_reader_read_payload(rd, &frec, sizeof(frec));
+		ret = pkg_reader_next_file(rd, &id);
 		if (ret == 0)
 			break;
 		if (ret < 0)
 			return -1;
-		if ((size_t)ret < sizeof(frec))
-			goto fail_trunc;
 
-		frec.id = le32toh(frec.id);
-
-		meta = get_file_entry(list, frec.id);
-		if (meta == NULL) {
+		found = image_entry_find_file(index, num_files, id);
+		if (found == NULL) {
 			fprintf(stderr, "%s: missing meta information for "
 				"file %u\n", pkg_reader_get_filename(rd),
-				(unsigned int)frec.id);
+				(unsigned int)id);
 			return -1;
 		}
 
-		fd = openat(dirfd, meta->name, O_WRONLY | O_CREAT | O_EXCL,
-			    0644);
+		meta = *found;
+
+		last = found + 1;
+		while (last < index + num_files && (*last)->data.file.id == id)
+			++last;
+
+		fd = openat(rootfds[0], meta->name,
+			    (count > 1 || cachefd >= 0 || last - found > 1 ?
+			     O_RDWR : O_WRONLY) | O_CREAT | O_EXCL, 0644);
 		if (fd < 0) {
 			perror(meta->name);
 			return -1;
 		}
 
-		for (i = 0; i < meta->data.file.size; i += ret) {
+		/* uncompressed records are copied over by the kernel */
+		ret = pkg_reader_copy_payload(rd, fd, meta->data.file.size);
+		if (ret < 0) {
+			perror(meta->name);
+			goto fail_fd;
+		}
+
+		for (i = ret; i < meta->data.file.size; i += ret) {
 			if ((meta->data.file.size - i) <
 			    (uint64_t)sizeof(buffer)) {
 				diff = meta->data.file.size - i;
@@ -119,7 +468,7 @@ static int unpack_files(int dirfd, image_entry_t *list, pkg_reader_t *rd)
 			if (ret < 0)
 				goto fail_fd;
 			if ((size_t)ret < diff)
-				goto fail_trunc;
+				goto fail_trunc_fd;
 
 			ret = write_retry(fd, buffer, diff);
 			if (ret < 0) {
@@ -134,17 +483,46 @@ static int unpack_files(int dirfd, image_entry_t *list, pkg_reader_t *rd)
 			}
 		}
 
+		for (j = 1; j < count; ++j) {
+			if (replicate_file(rootfds[0], meta->name, fd,
+					   rootfds[j], meta->name,
+					   meta->data.file.size, flags, stats)) {
+				goto fail_fd;
+			}
+		}
+
+		while (++found < last) {
+			if (replicate_shared(rootfds, count, meta, fd, *found,
+					     flags, stats)) {
+				goto fail_fd;
+			}
+		}
+
+		if (cachefd >= 0) {
+			pkg_cache_file_name(meta->data.file.id, name);
+
+			if (replicate_file(rootfds[0], meta->name, fd,
+					   cachefd, name, meta->data.file.size,
+					   flags & UNPACK_HARDLINK, NULL)) {
+				goto fail_fd;
+			}
+		}
+
+		if (sync_file(fd, meta->name, flags, stats))
+			goto fail_fd;
+
 		close(fd);
 	}
 
 	return 0;
-fail_fd:
+fail_trunc_fd:
 	close(fd);
-	return -1;
-fail_trunc:
 	fprintf(stderr, "%s: truncated file data record\n",
 		pkg_reader_get_filename(rd));
 	return -1;
+fail_fd:
+	close(fd);
+	return -1;
 }
 
 static int change_permissions(int dirfd, image_entry_t *list, int flags)
@@ -193,24 +571,19 @@ static int change_permissions(int dirfd, image_entry_t *list, int flags)
 	return 0;
 }
 
-int pkg_unpack(int rootfd, int flags, pkg_reader_t *rd)
+static int unpack_data(const int *rootfds, size_t count, image_entry_t *list,
+		       pkg_reader_t *rd, int cachefd, int flags,
+		       pkg_unpack_stats_t *stats)
 {
-	image_entry_t *list = NULL;
+	image_entry_t **index;
+	size_t num_files;
 	record_t *hdr;
 	int ret;
 
-	if (image_entry_list_from_package(rd, &list))
+	index = image_entry_file_index(list, &num_files);
+	if (index == NULL)
 		return -1;
 
-	if (pkg_reader_rewind(rd))
-		goto fail;
-
-	if (list == NULL)
-		return 0;
-
-	if (create_hierarchy(rootfd, list, flags))
-		goto fail;
-
 	for (;;) {
 		ret = pkg_reader_get_next_record(rd);
 		if (ret == 0)
@@ -221,17 +594,108 @@ int pkg_unpack(int rootfd, int flags, pkg_reader_t *rd)
 		hdr = pkg_reader_current_record_header(rd);
 
 		if (hdr->magic == PKG_MAGIC_DATA) {
-			if (unpack_files(rootfd, list, rd))
+			if (unpack_files(rootfds, count, index, num_files,
+					 rd, cachefd, flags, stats)) {
 				goto fail;
+			}
+		}
+	}
+
+	free(index);
+	return 0;
+fail:
+	free(index);
+	return -1;
+}
+
+int pkg_unpack_multi(const int *rootfds, size_t count, int flags,
+		     pkg_reader_t *rd, pkg_cache_t *cache,
+		     pkg_unpack_stats_t *stats)
+{
+	image_entry_t *list = NULL;
+	int hit = 0;
+	size_t i;
+
+	if (count == 0)
+		return 0;
+
+	if (image_entry_list_from_package(rd, &list))
+		return -1;
+
+	if (pkg_reader_rewind(rd))
+		goto fail;
+
+	if (list == NULL)
+		return 0;
+
+	for (i = 0; i < count; ++i) {
+		if (create_hierarchy(rootfds[i], list, flags))
+			goto fail;
+	}
+
+	if (cache != NULL) {
+		hit = pkg_cache_begin(cache, rd);
+		if (hit < 0)
+			goto fail;
+
+		if (stats != NULL) {
+			if (hit) {
+				stats->cache_hits += 1;
+			} else {
+				stats->cache_misses += 1;
+			}
+		}
+	}
+
+	if (hit) {
+		if (restore_files(rootfds, count, list, cache, flags, stats))
+			goto fail;
+	} else {
+		if (unpack_data(rootfds, count, list, rd,
+				cache == NULL ? -1 : pkg_cache_entry_fd(cache),
+				flags, stats)) {
+			goto fail;
 		}
 	}
 
-	if (change_permissions(rootfd, list, flags))
+	for (i = 0; i < count; ++i) {
+		if (change_permissions(rootfds[i], list, flags))
+			goto fail;
+
+		if (sync_root(rootfds[i], list, flags, stats))
+			goto fail;
+	}
+
+	if (cache != NULL && pkg_cache_end(cache, true))
 		goto fail;
 
 	image_entry_free_list(list);
 	return 0;
 fail:
+	if (cache != NULL)
+		pkg_cache_end(cache, false);
 	image_entry_free_list(list);
 	return -1;
 }
+
+int pkg_unpack(int rootfd, int flags, pkg_reader_t *rd, pkg_cache_t *cache,
+	       pkg_unpack_stats_t *stats)
+{
+	return pkg_unpack_multi(&rootfd, 1, flags, rd, cache, stats);
+}
+
+int pkg_unpack_parse_sync_mode(const char *str, int *flags)
+{
+	*flags &= ~(UNPACK_SYNC_PACKAGE | UNPACK_SYNC_STRICT);
+
+	if (strcmp(str, "package") == 0) {
+		*flags |= UNPACK_SYNC_PACKAGE;
+	} else if (strcmp(str, "strict") == 0) {
+		*flags |= UNPACK_SYNC_STRICT;
+	} else if (strcmp(str, "none") != 0) {
+		fprintf(stderr, "unknown sync mode '%s'\n", str);
+		return -1;
+	}
+
+	return 0;
+}
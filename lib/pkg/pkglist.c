@@ -7,14 +7,32 @@
 
 struct pkg_dep_node *append_pkg(struct pkg_dep_list *list, const char *name)
 {
-	struct pkg_dep_node *new = calloc(1, sizeof(*new));
+	struct pkg_dep_node *new, *old;
 
-	if (new == NULL)
-		goto fail_oom;
+	if (list->index.entries == NULL) {
+		if (hash_table_init(&list->index, 64))
+			return NULL;
+	}
+
+	new = calloc(1, sizeof(*new));
+	if (new == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	old = hash_table_lookup(&list->index, name);
+
+	if (old != NULL) {
+		new->name = old->name;
+	} else {
+		new->name = hash_table_intern(&list->index, name, new);
+		if (new->name == NULL) {
+			free(new);
+			return NULL;
+		}
+	}
 
-	new->name = strdup(name);
-	if (new->name == NULL)
-		goto fail_oom;
+	new->id = list->count++;
 
 	if (list->tail == NULL) {
 		list->head = list->tail = new;
@@ -23,20 +41,14 @@ struct pkg_dep_node *append_pkg(struct pkg_dep_list *list, const char *name)
 		list->tail = new;
 	}
 	return new;
-fail_oom:
-	fputs("out of memory\n", stderr);
-	free(new);
-	return NULL;
 }
 
 struct pkg_dep_node *find_pkg(struct pkg_dep_list *list, const char *name)
 {
-	struct pkg_dep_node *it = list->head;
-
-	while (it != NULL && strcmp(it->name, name) != 0)
-		it = it->next;
+	if (list->index.entries == NULL)
+		return NULL;
 
-	return it;
+	return hash_table_lookup(&list->index, name);
 }
 
 void pkg_list_cleanup(struct pkg_dep_list *list)
@@ -47,10 +59,40 @@ void pkg_list_cleanup(struct pkg_dep_list *list)
 		node = list->head;
 		list->head = node->next;
 
-		free(node->deps);
-		free(node->name);
 		free(node);
 	}
 
 	list->tail = NULL;
+	list->count = 0;
+
+	graph_builder_cleanup(&list->edges);
+	graph_cleanup(&list->graph);
+	free(list->nodes);
+	list->nodes = NULL;
+
+	if (list->index.entries != NULL)
+		hash_table_cleanup(&list->index);
+}
+
+int pkg_list_build_graph(struct pkg_dep_list *list)
+{
+	struct pkg_dep_node *it, **nodes;
+
+	nodes = calloc(list->count ? list->count : 1, sizeof(nodes[0]));
+	if (nodes == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	if (graph_build(&list->graph, &list->edges, list->count)) {
+		free(nodes);
+		return -1;
+	}
+
+	for (it = list->head; it != NULL; it = it->next)
+		nodes[it->id] = it;
+
+	free(list->nodes);
+	list->nodes = nodes;
+	return 0;
 }
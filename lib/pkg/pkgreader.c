@@ -1,4 +1,8 @@
 /* SPDX-License-Identifier: ISC */
+#include <sys/ioctl.h>
+#include <sys/statfs.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -16,14 +20,23 @@ struct pkg_reader_t {
 	int fd;
 	bool have_eof;
 	bool have_error;
+	bool no_clone;
+	uint64_t block_size;
+	uint64_t file_size;
 	uint64_t offset_compressed;
 	uint64_t offset_raw;
 	compressor_stream_t *stream;
-	const char *path;
+	char *path;
 
 	record_t current;
 };
 
+static bool is_header(const record_t *hdr)
+{
+	return hdr->magic == PKG_MAGIC_HEADER ||
+		hdr->magic == PKG_MAGIC_HEADER_V2;
+}
+
 static int read_header(pkg_reader_t *rd)
 {
 	ssize_t diff = read_retry(rd->fd, &rd->current, sizeof(rd->current));
@@ -123,6 +136,8 @@ fail_comp:
 static pkg_reader_t *pkg_reader_openat(int dirfd, const char *path)
 {
 	pkg_reader_t *rd = calloc(1, sizeof(*rd));
+	struct statfs fsb;
+	struct stat sb;
 	int ret;
 
 	if (rd == NULL) {
@@ -130,18 +145,33 @@ static pkg_reader_t *pkg_reader_openat(int dirfd, const char *path)
 		return NULL;
 	}
 
-	rd->path = path;
+	rd->path = strdup(path);
+	if (rd->path == NULL) {
+		fputs("out of memory\n", stderr);
+		free(rd);
+		return NULL;
+	}
+
 	rd->fd = openat(dirfd, path, O_RDONLY);
 	if (rd->fd < 0) {
 		perror(path);
+		free(rd->path);
 		free(rd);
 		return NULL;
 	}
 
+	if (fstat(rd->fd, &sb) != 0 || fstatfs(rd->fd, &fsb) != 0) {
+		perror(path);
+		goto fail;
+	}
+
+	rd->block_size = fsb.f_bsize > 0 ? fsb.f_bsize : 4096;
+	rd->file_size = sb.st_size;
+
 	ret = read_header(rd);
 	if (ret < 0)
 		goto fail;
-	if (ret == 0 || rd->current.magic != PKG_MAGIC_HEADER)
+	if (ret == 0 || !is_header(&rd->current))
 		goto fail_header;
 
 	return rd;
@@ -184,6 +214,7 @@ void pkg_reader_close(pkg_reader_t *rd)
 		rd->stream->destroy(rd->stream);
 
 	close(rd->fd);
+	free(rd->path);
 	free(rd);
 }
 
@@ -212,7 +243,7 @@ int pkg_reader_get_next_record(pkg_reader_t *rd)
 	if (ret <= 0)
 		return ret;
 
-	if (rd->current.magic == PKG_MAGIC_HEADER)
+	if (is_header(&rd->current))
 		goto fail_second_hdr;
 
 	return 1;
@@ -260,6 +291,190 @@ ssize_t pkg_reader_read_payload(pkg_reader_t *rd, void *out, size_t size)
 	return total;
 }
 
+/* drop data the stream has already taken from the file */
+static size_t skip_buffered(pkg_reader_t *rd, size_t size)
+{
+	uint8_t buffer[1024];
+	size_t diff, total = 0;
+	ssize_t ret;
+
+	while (size > 0 && rd->offset_raw < rd->offset_compressed) {
+		diff = rd->offset_compressed - rd->offset_raw;
+		if (diff > sizeof(buffer))
+			diff = sizeof(buffer);
+		if (diff > size)
+			diff = size;
+
+		ret = rd->stream->read(rd->stream, buffer, diff);
+		if (ret <= 0)
+			break;
+
+		rd->offset_raw += ret;
+		size -= ret;
+		total += ret;
+	}
+
+	return total;
+}
+
+/*
+  If the payload is at a block boundary in the package, which is what the
+  aligned data layout is for, let the file system share the extents with
+  the target instead of copying. The last block is shared in full and the
+  target truncated afterwards. Returns 1 if the data was cloned, 0 if the
+  caller has to copy it.
+ */
+static int clone_payload(pkg_reader_t *rd, int fd, size_t size)
+{
+	struct file_clone_range range;
+	off_t pos, dst;
+	size_t skipped;
+
+	if (rd->no_clone || size == 0)
+		return 0;
+
+	pos = lseek(rd->fd, 0, SEEK_CUR);
+	dst = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0 || dst < 0)
+		return 0;
+
+	memset(&range, 0, sizeof(range));
+	range.src_fd = rd->fd;
+	range.src_offset = pos - (rd->offset_compressed - rd->offset_raw);
+	range.dest_offset = dst;
+
+	if (range.src_offset % rd->block_size != 0 ||
+	    range.dest_offset % rd->block_size != 0) {
+		return 0;
+	}
+
+	range.src_length = size + rd->block_size - 1;
+	range.src_length -= range.src_length % rd->block_size;
+
+	if (range.src_offset + range.src_length > rd->file_size)
+		range.src_length = rd->file_size - range.src_offset;
+
+	if (ioctl(fd, FICLONERANGE, &range) != 0) {
+		if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY)
+			rd->no_clone = true;
+		return 0;
+	}
+
+	if (ftruncate(fd, dst + size) != 0 ||
+	    lseek(fd, dst + size, SEEK_SET) < 0) {
+		return -1;
+	}
+
+	skipped = skip_buffered(rd, size);
+
+	if (lseek(rd->fd, size - skipped, SEEK_CUR) < 0)
+		return -1;
+
+	rd->offset_compressed += size - skipped;
+	rd->offset_raw += size - skipped;
+	return 1;
+}
+
+ssize_t pkg_reader_copy_payload(pkg_reader_t *rd, int fd, size_t size)
+{
+	uint8_t buffer[1024];
+	ssize_t ret, total = 0;
+	size_t diff;
+
+	if (rd->have_error || rd->have_eof ||
+	    rd->current.compression != PKG_COMPRESSION_NONE) {
+		return 0;
+	}
+
+	if (size > rd->current.raw_size - rd->offset_raw)
+		size = rd->current.raw_size - rd->offset_raw;
+
+	ret = clone_payload(rd, fd, size);
+	if (ret != 0)
+		return ret < 0 ? -1 : (ssize_t)size;
+
+	/* hand out what the stream has already taken from the file */
+	while (size > 0 && rd->offset_raw < rd->offset_compressed) {
+		diff = rd->offset_compressed - rd->offset_raw;
+		if (diff > sizeof(buffer))
+			diff = sizeof(buffer);
+		if (diff > size)
+			diff = size;
+
+		ret = rd->stream->read(rd->stream, buffer, diff);
+		if (ret <= 0)
+			return total;
+
+		rd->offset_raw += ret;
+		size -= ret;
+		diff = ret;
+
+		ret = write_retry(fd, buffer, diff);
+		if (ret < 0)
+			return -1;
+
+		if ((size_t)ret < diff) {
+			errno = EIO;
+			return -1;
+		}
+
+		total += ret;
+	}
+
+	ret = copy_range(rd->fd, fd, size);
+	if (ret < 0)
+		return -1;
+
+	rd->offset_compressed += ret;
+	rd->offset_raw += ret;
+	return total + ret;
+}
+
+int pkg_reader_next_file(pkg_reader_t *rd, uint32_t *id)
+{
+	uint8_t buffer[1024];
+	file_padding_t pad;
+	ssize_t ret;
+	size_t diff;
+
+	for (;;) {
+		ret = pkg_reader_read_payload(rd, &pad.id, sizeof(pad.id));
+		if (ret == 0)
+			return 0;
+		if (ret < 0)
+			return -1;
+		if ((size_t)ret < sizeof(pad.id))
+			goto fail_trunc;
+
+		if (le32toh(pad.id) != PKG_FILE_ID_PADDING) {
+			*id = le32toh(pad.id);
+			return 1;
+		}
+
+		ret = pkg_reader_read_payload(rd, &pad.size, sizeof(pad.size));
+		if (ret < 0)
+			return -1;
+		if ((size_t)ret < sizeof(pad.size))
+			goto fail_trunc;
+
+		for (pad.size = le32toh(pad.size); pad.size > 0;
+		     pad.size -= diff) {
+			diff = sizeof(buffer);
+			if (pad.size < diff)
+				diff = pad.size;
+
+			ret = pkg_reader_read_payload(rd, buffer, diff);
+			if (ret < 0)
+				return -1;
+			if ((size_t)ret < diff)
+				goto fail_trunc;
+		}
+	}
+fail_trunc:
+	fprintf(stderr, "%s: truncated file data record\n", rd->path);
+	return -1;
+}
+
 int pkg_reader_rewind(pkg_reader_t *rd)
 {
 	int ret;
@@ -281,7 +496,7 @@ int pkg_reader_rewind(pkg_reader_t *rd)
 	if (ret < 0)
 		goto fail;
 
-	if (ret == 0 || rd->current.magic != PKG_MAGIC_HEADER)
+	if (ret == 0 || !is_header(&rd->current))
 		goto fail_header;
 
 	return 0;
@@ -296,3 +511,8 @@ const char *pkg_reader_get_filename(pkg_reader_t *rd)
 {
 	return rd->path;
 }
+
+int pkg_reader_get_fd(pkg_reader_t *rd)
+{
+	return rd->fd;
+}
@@ -1,30 +1,363 @@
 /* SPDX-License-Identifier: ISC */
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "pkg/pkgwriter.h"
 #include "util/util.h"
 
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define SPOOL_MEMORY_MAX (32 * 1024 * 1024)
+
+/*
+  Compressed data is collected in one of two large buffers. Once a buffer
+  is full, it is handed to a background thread that writes it to the file,
+  while the compressor continues with the other one. Record headers are
+  only written after waiting for the background thread to become idle.
+
+  A streaming writer never seeks. The background thread appends the data
+  of a record to a spool in memory, or in an anonymous temporary file once
+  the record grows larger than SPOOL_MEMORY_MAX. When the record is done,
+  its header and the spooled data are written out in one go.
+ */
 struct pkg_writer_t {
 	const char *path;
 	int fd;
+	bool own_fd;
+	bool streaming;
 
+	uint8_t *spool;
+	size_t spool_used;
+	size_t spool_max;
+	int spool_fd;
+
+	/* position of the current record in the output */
 	off_t start;
 	record_t current;
 	compressor_stream_t *stream;
+
+	uint8_t *buffer[2];
+	size_t used;
+	int fill;
+
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	size_t pending;
+	bool terminate;
+	bool failed;
+
+	pkg_writer_stats_t stats;
 };
 
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int write_data(pkg_writer_t *wr, int fd, const void *data,
+		      size_t size)
+{
+	ssize_t ret = write_retry(fd, (void *)data, size);
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: writing to package file: %s\n",
+			wr->path, strerror(errno));
+		return -1;
+	}
+
+	if ((size_t)ret < size) {
+		fprintf(stderr, "%s: data written to file was truncated\n",
+			wr->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_spool_file(pkg_writer_t *wr)
+{
+	const char *dir = getenv("TMPDIR");
+	char *name;
+
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+
+	wr->spool_fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+	if (wr->spool_fd >= 0)
+		return 0;
+
+	name = alloca(strlen(dir) + 16);
+	sprintf(name, "%s/pkgXXXXXX", dir);
+
+	wr->spool_fd = mkstemp(name);
+	if (wr->spool_fd < 0) {
+		fprintf(stderr, "%s: creating temporary file in %s: %s\n",
+			wr->path, dir, strerror(errno));
+		return -1;
+	}
+
+	unlink(name);
+	return 0;
+}
+
+static int spool_append(pkg_writer_t *wr, const void *data, size_t size)
+{
+	size_t new_max;
+	void *new;
+
+	if (wr->spool_fd < 0 && wr->spool_used + size <= SPOOL_MEMORY_MAX) {
+		if (wr->spool_used + size > wr->spool_max) {
+			new_max = wr->spool_max ? wr->spool_max * 2 :
+				OUTPUT_BUFFER_SIZE;
+
+			while (new_max < wr->spool_used + size)
+				new_max *= 2;
+
+			new = realloc(wr->spool, new_max);
+			if (new == NULL) {
+				fputs("out of memory\n", stderr);
+				return -1;
+			}
+
+			wr->spool = new;
+			wr->spool_max = new_max;
+		}
+
+		memcpy(wr->spool + wr->spool_used, data, size);
+		wr->spool_used += size;
+		return 0;
+	}
+
+	if (wr->spool_fd < 0) {
+		if (open_spool_file(wr))
+			return -1;
+
+		if (write_data(wr, wr->spool_fd, wr->spool, wr->spool_used))
+			return -1;
+
+		wr->spool_used = 0;
+	}
+
+	return write_data(wr, wr->spool_fd, data, size);
+}
+
+static int writev_all(pkg_writer_t *wr, struct iovec *iov, int count)
+{
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = writev(wr->fd, iov, count);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "%s: writing to package file: %s\n",
+				wr->path, strerror(errno));
+			return -1;
+		}
+
+		while (count > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--count;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int copy_spool_file(pkg_writer_t *wr, off_t size)
+{
+	off_t offset = 0;
+	ssize_t ret;
+
+	while (offset < size) {
+		ret = sendfile(wr->fd, wr->spool_fd, &offset, size - offset);
+
+		if (ret > 0)
+			continue;
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && (errno == EINVAL || errno == ENOSYS))
+			break;
+
+		fprintf(stderr, "%s: writing to package file: %s\n",
+			wr->path, ret < 0 ? strerror(errno) :
+			"temporary file was truncated");
+		return -1;
+	}
+
+	/* no sendfile for this kind of output, copy the rest by hand */
+	while (offset < size) {
+		ret = pread(wr->spool_fd, wr->buffer[wr->fill],
+			    OUTPUT_BUFFER_SIZE, offset);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			fprintf(stderr, "%s: reading temporary file: %s\n",
+				wr->path, ret < 0 ? strerror(errno) :
+				"unexpected end of file");
+			return -1;
+		}
+
+		if (write_data(wr, wr->fd, wr->buffer[wr->fill], ret))
+			return -1;
+
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/*
+  Called once the output thread is idle. The output buffer of the
+  compressor is empty at that point and can be used for copying.
+ */
+static int emit_record(pkg_writer_t *wr, record_t *hdr)
+{
+	uint64_t start = time_ns();
+	struct iovec iov[2];
+	off_t size;
+	int ret;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = wr->spool;
+	iov[1].iov_len = wr->spool_used;
+
+	wr->start += sizeof(*hdr) + le64toh(hdr->compressed_size);
+
+	if (wr->spool_fd < 0) {
+		ret = writev_all(wr, iov, wr->spool_used > 0 ? 2 : 1);
+	} else {
+		size = lseek(wr->spool_fd, 0, SEEK_CUR);
+
+		ret = writev_all(wr, iov, 1);
+		if (ret == 0)
+			ret = copy_spool_file(wr, size);
+
+		close(wr->spool_fd);
+		wr->spool_fd = -1;
+	}
+
+	wr->spool_used = 0;
+	wr->stats.write_ns += time_ns() - start;
+	return ret;
+}
+
+static void *output_thread(void *arg)
+{
+	pkg_writer_t *wr = arg;
+	uint64_t start;
+	ssize_t ret;
+	size_t size;
+	void *data;
+
+	pthread_mutex_lock(&wr->mtx);
+
+	for (;;) {
+		while (wr->pending == 0 && !wr->terminate)
+			pthread_cond_wait(&wr->cond, &wr->mtx);
+
+		if (wr->pending == 0)
+			break;
+
+		size = wr->pending;
+		data = wr->buffer[wr->fill ^ 1];
+		pthread_mutex_unlock(&wr->mtx);
+
+		start = time_ns();
+		ret = wr->streaming ? spool_append(wr, data, size) :
+			write_data(wr, wr->fd, data, size);
+
+		pthread_mutex_lock(&wr->mtx);
+		wr->stats.write_ns += time_ns() - start;
+		wr->stats.bytes_written += size;
+
+		if (ret != 0)
+			wr->failed = true;
+
+		wr->pending = 0;
+		pthread_cond_broadcast(&wr->cond);
+	}
+
+	pthread_mutex_unlock(&wr->mtx);
+	return NULL;
+}
+
+static int submit_buffer(pkg_writer_t *wr)
+{
+	uint64_t start = time_ns();
+	int ret = 0;
+
+	pthread_mutex_lock(&wr->mtx);
+	while (wr->pending > 0)
+		pthread_cond_wait(&wr->cond, &wr->mtx);
+
+	wr->stats.output_wait_ns += time_ns() - start;
+
+	if (wr->failed) {
+		ret = -1;
+	} else if (wr->used > 0) {
+		wr->pending = wr->used;
+		wr->fill ^= 1;
+		wr->used = 0;
+		pthread_cond_broadcast(&wr->cond);
+	}
+
+	pthread_mutex_unlock(&wr->mtx);
+	return ret;
+}
+
+static int drain_output(pkg_writer_t *wr)
+{
+	int ret;
+
+	if (submit_buffer(wr))
+		return -1;
+
+	pthread_mutex_lock(&wr->mtx);
+	while (wr->pending > 0)
+		pthread_cond_wait(&wr->cond, &wr->mtx);
+	ret = wr->failed ? -1 : 0;
+	pthread_mutex_unlock(&wr->mtx);
+
+	return ret;
+}
+
+static void header_to_le(record_t *hdr)
+{
+	hdr->magic = htole32(hdr->magic);
+	hdr->compressed_size = htole64(hdr->compressed_size);
+	hdr->raw_size = htole64(hdr->raw_size);
+}
+
 static int write_header(pkg_writer_t *wr)
 {
 	ssize_t ret;
 
-	wr->current.magic = htole32(wr->current.magic);
-	wr->current.compressed_size = htole64(wr->current.compressed_size);
-	wr->current.raw_size = htole64(wr->current.raw_size);
+	header_to_le(&wr->current);
 
 	ret = write_retry(wr->fd, &wr->current, sizeof(wr->current));
 	if (ret < 0)
@@ -45,11 +378,19 @@ fail_fop:
 
 static int flush_to_file(pkg_writer_t *wr)
 {
-	uint8_t buffer[2048];
-	ssize_t count, ret;
+	uint64_t start;
+	ssize_t count;
 
 	for (;;) {
-		count = wr->stream->read(wr->stream, buffer, sizeof(buffer));
+		if (wr->used == OUTPUT_BUFFER_SIZE && submit_buffer(wr))
+			return -1;
+
+		start = time_ns();
+		count = wr->stream->read(wr->stream,
+					 wr->buffer[wr->fill] + wr->used,
+					 OUTPUT_BUFFER_SIZE - wr->used);
+		wr->stats.compress_ns += time_ns() - start;
+
 		if (count == 0)
 			break;
 		if (count < 0) {
@@ -58,42 +399,28 @@ static int flush_to_file(pkg_writer_t *wr)
 			return -1;
 		}
 
-		ret = write_retry(wr->fd, buffer, count);
-
-		if (ret < 0) {
-			fprintf(stderr, "%s: writing to package file: %s\n",
-				wr->path, strerror(errno));
-			return -1;
-		}
-
-		if (ret < count) {
-			fprintf(stderr,
-				"%s: data written to file was truncated\n",
-				wr->path);
-			return -1;
-		}
-
+		wr->used += count;
 		wr->current.compressed_size += count;
 	}
 
 	return 0;
 }
 
-pkg_writer_t *pkg_writer_open(const char *path, bool force)
+static pkg_writer_t *writer_create(const char *path, int fd, bool own_fd,
+				   bool streaming)
 {
 	pkg_writer_t *wr = calloc(1, sizeof(*wr));
 	compressor_t *cmp;
-	int flags;
+
+	if (wr == NULL) {
+		fputs("out of memory\n", stderr);
+		goto fail_fd;
+	}
 
 	cmp = compressor_by_id(PKG_COMPRESSION_NONE);
 	if (cmp == NULL) {
 		fputs("missing built in dummy compessor\n", stderr);
-		return NULL;
-	}
-
-	if (wr == NULL) {
-		fputs("out of memory\n", stderr);
-		return NULL;
+		goto fail;
 	}
 
 	wr->stream = cmp->compression_stream(cmp, NULL);
@@ -103,55 +430,124 @@ pkg_writer_t *pkg_writer_open(const char *path, bool force)
 		goto fail;
 	}
 
-	flags = O_WRONLY | O_CREAT;
-
-	if (force) {
-		flags |= O_TRUNC;
-	} else {
-		flags |= O_EXCL;
-	}
+	wr->path = path;
+	wr->fd = fd;
+	wr->own_fd = own_fd;
+	wr->streaming = streaming;
+	wr->spool_fd = -1;
 
-	wr->fd = open(path, flags, 0644);
-	if (wr->fd == -1) {
-		perror(path);
+	wr->current.magic = PKG_MAGIC_HEADER;
+	wr->current.compression = PKG_COMPRESSION_NONE;
+	if (!streaming && write_header(wr))
 		goto fail_stream;
+
+	wr->buffer[0] = malloc(OUTPUT_BUFFER_SIZE);
+	wr->buffer[1] = malloc(OUTPUT_BUFFER_SIZE);
+	if (wr->buffer[0] == NULL || wr->buffer[1] == NULL) {
+		fputs("out of memory\n", stderr);
+		goto fail_buffer;
 	}
 
-	wr->path = path;
+	pthread_mutex_init(&wr->mtx, NULL);
+	pthread_cond_init(&wr->cond, NULL);
 
-	wr->current.magic = PKG_MAGIC_HEADER;
-	wr->current.compression = PKG_COMPRESSION_NONE;
-	if (write_header(wr))
-		goto fail_close;
+	if (pthread_create(&wr->thread, NULL, output_thread, wr)) {
+		fprintf(stderr, "%s: failed to create output thread\n", path);
+		goto fail_thread;
+	}
 
 	return wr;
-fail_close:
-	close(wr->fd);
+fail_thread:
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->mtx);
+fail_buffer:
+	free(wr->buffer[1]);
+	free(wr->buffer[0]);
 fail_stream:
 	wr->stream->destroy(wr->stream);
 fail:
 	free(wr);
+fail_fd:
+	if (own_fd)
+		close(fd);
 	return NULL;
 }
 
+pkg_writer_t *pkg_writer_open(const char *path, bool force)
+{
+	int fd, flags;
+
+	flags = O_WRONLY | O_CREAT;
+
+	if (force) {
+		flags |= O_TRUNC;
+	} else {
+		flags |= O_EXCL;
+	}
+
+	fd = open(path, flags, 0644);
+	if (fd == -1) {
+		perror(path);
+		return NULL;
+	}
+
+	return writer_create(path, fd, true, false);
+}
+
+pkg_writer_t *pkg_writer_open_stream(int fd, const char *name)
+{
+	return writer_create(name, fd, false, true);
+}
+
 void pkg_writer_close(pkg_writer_t *wr)
 {
-	close(wr->fd);
+	pthread_mutex_lock(&wr->mtx);
+	wr->terminate = true;
+	pthread_cond_broadcast(&wr->cond);
+	pthread_mutex_unlock(&wr->mtx);
+
+	pthread_join(wr->thread, NULL);
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->mtx);
+
+	if (wr->stream != NULL)
+		wr->stream->destroy(wr->stream);
+
+	if (wr->spool_fd >= 0)
+		close(wr->spool_fd);
+
+	free(wr->spool);
+	free(wr->buffer[1]);
+	free(wr->buffer[0]);
+
+	if (wr->own_fd)
+		close(wr->fd);
+
 	free(wr);
 }
 
+void pkg_writer_get_stats(pkg_writer_t *wr, pkg_writer_stats_t *stats)
+{
+	pthread_mutex_lock(&wr->mtx);
+	*stats = wr->stats;
+	pthread_mutex_unlock(&wr->mtx);
+}
+
 int pkg_writer_start_record(pkg_writer_t *wr, uint32_t magic,
 			    compressor_t *cmp)
 {
-	wr->start = lseek(wr->fd, 0, SEEK_CUR);
-	if (wr->start == -1) {
-		perror(wr->path);
-		return -1;
-	}
-
 	memset(&wr->current, 0, sizeof(wr->current));
-	if (write_header(wr))
-		return -1;
+
+	if (!wr->streaming) {
+		wr->start = lseek(wr->fd, 0, SEEK_CUR);
+		if (wr->start == -1) {
+			perror(wr->path);
+			return -1;
+		}
+
+		if (write_header(wr))
+			return -1;
+	}
 
 	wr->stream = cmp->compression_stream(cmp, NULL);
 	if (wr->stream == NULL)
@@ -162,10 +558,17 @@ int pkg_writer_start_record(pkg_writer_t *wr, uint32_t magic,
 	return 0;
 }
 
+uint64_t pkg_writer_payload_offset(pkg_writer_t *wr)
+{
+	return wr->start + sizeof(wr->current) + wr->current.raw_size;
+}
+
 int pkg_writer_write_payload(pkg_writer_t *wr, void *data, size_t size)
 {
 	ssize_t ret;
 
+	wr->stats.bytes_in += size;
+
 	while (size > 0) {
 		ret = wr->stream->write(wr->stream, data, size);
 		if (ret < 0)
@@ -184,12 +587,54 @@ int pkg_writer_write_payload(pkg_writer_t *wr, void *data, size_t size)
 	return 0;
 }
 
+ssize_t pkg_writer_copy_payload(pkg_writer_t *wr, int fd, size_t size)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	if (wr->streaming || wr->current.compression != PKG_COMPRESSION_NONE)
+		return 0;
+
+	/* everything before the copied range has to be in the file first */
+	if (flush_to_file(wr) || drain_output(wr))
+		return -1;
+
+	start = time_ns();
+	ret = copy_range(fd, wr->fd, size);
+	if (ret < 0) {
+		fprintf(stderr, "%s: writing to package file: %s\n",
+			wr->path, strerror(errno));
+		return -1;
+	}
+
+	wr->stats.write_ns += time_ns() - start;
+	wr->stats.bytes_in += ret;
+	wr->stats.bytes_written += ret;
+	wr->current.raw_size += ret;
+	wr->current.compressed_size += ret;
+	return ret;
+}
+
+void pkg_writer_set_magic(pkg_writer_t *wr, uint32_t magic)
+{
+	wr->current.magic = magic;
+}
+
 int pkg_writer_end_record(pkg_writer_t *wr)
 {
 	wr->stream->flush(wr->stream);
-	if (flush_to_file(wr))
+	if (flush_to_file(wr) || drain_output(wr))
 		return -1;
 
+	if (wr->streaming) {
+		header_to_le(&wr->current);
+
+		if (emit_record(wr, &wr->current))
+			return -1;
+
+		goto out;
+	}
+
 	if (lseek(wr->fd, wr->start, SEEK_SET) == -1)
 		goto fail_seek;
 
@@ -198,7 +643,7 @@ int pkg_writer_end_record(pkg_writer_t *wr)
 
 	if (lseek(wr->fd, 0, SEEK_END) == -1)
 		goto fail_seek;
-
+out:
 	wr->stream->destroy(wr->stream);
 	wr->stream = NULL;
 	return 0;
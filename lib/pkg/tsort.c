@@ -4,79 +4,41 @@
 
 #include "pkg/pkglist.h"
 
-static void remove_dependency(struct pkg_dep_list *list,
-			      struct pkg_dep_node *pkg)
+int sort_by_dependencies(struct pkg_dep_list *list)
 {
+	size_t i, count, *order = NULL, *levels = NULL;
 	struct pkg_dep_node *it;
-	size_t i;
-
-	for (it = list->head; it != NULL; it = it->next) {
-		for (i = 0; i < it->num_deps; ++i) {
-			if (it->deps[i] == pkg) {
-				it->deps[i] = it->deps[it->num_deps - 1];
-				it->num_deps -= 1;
-				--i;
-			}
-		}
-
-		if (it->num_deps == 0 && it->deps != NULL) {
-			free(it->deps);
-			it->deps = NULL;
-		}
-	}
-}
-
-static void append(struct pkg_dep_list *out, struct pkg_dep_node *pkg)
-{
-	if (out->tail == NULL) {
-		out->head = out->tail = pkg;
-	} else {
-		out->tail->next = pkg;
-		out->tail = pkg;
-	}
-}
+	int ret = -1;
 
-static struct pkg_dep_node *remove_no_deps(struct pkg_dep_list *list)
-{
-	struct pkg_dep_node *it = list->head, *prev = NULL;
+	if (list->count < 2)
+		return 0;
 
-	while (it != NULL && it->num_deps != 0) {
-		prev = it;
-		it = it->next;
-	}
+	if (pkg_list_build_graph(list))
+		return -1;
 
-	if (it != NULL) {
-		if (prev == NULL) {
-			list->head = it->next;
-		} else {
-			prev->next = it->next;
-		}
+	order = calloc(list->count, sizeof(order[0]));
+	levels = calloc(list->count, sizeof(levels[0]));
 
-		if (it == list->tail)
-			list->tail = prev;
+	if (order == NULL || levels == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
 	}
 
-	return it;
-}
-
-int sort_by_dependencies(struct pkg_dep_list *list)
-{
-	struct pkg_dep_list result = { NULL, NULL };
-	struct pkg_dep_node *pkg;
-
-	while (list->head != NULL) {
-		pkg = remove_no_deps(list);
+	if (graph_topo_sort(&list->graph, NULL, order, &count, levels))
+		goto out;
 
-		if (pkg == NULL) {
-			fputs("cycle detected in dependency graph\n", stderr);
-			pkg_list_cleanup(&result);
-			return -1;
-		}
+	list->head = list->nodes[order[0]];
+	list->tail = list->nodes[order[count - 1]];
 
-		remove_dependency(list, pkg);
-		append(&result, pkg);
+	for (i = 0; i < count; ++i) {
+		it = list->nodes[order[i]];
+		it->level = levels[order[i]];
+		it->next = (i + 1 < count) ? list->nodes[order[i + 1]] : NULL;
 	}
 
-	*list = result;
-	return 0;
+	ret = 0;
+out:
+	free(levels);
+	free(order);
+	return ret;
 }
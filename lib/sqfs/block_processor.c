@@ -0,0 +1,349 @@
+/* SPDX-License-Identifier: ISC */
+#include <pthread.h>
+
+#include "internal.h"
+
+struct block_processor_t {
+	pthread_mutex_t mtx;
+	pthread_cond_t queue_cond;
+	pthread_cond_t done_cond;
+
+	/* blocks waiting for a worker, in FIFO order */
+	sqfs_block_t *queue;
+	sqfs_block_t *queue_last;
+
+	/* processed blocks, sorted by sequence number */
+	sqfs_block_t *done;
+
+	uint32_t enqueue_id;
+	uint32_t dequeue_id;
+
+	size_t backlog;
+	size_t max_backlog;
+	int status;
+	bool terminate;
+
+	compressor_t *cmp;
+	void *cmp_opt;
+	size_t max_block_size;
+
+	block_cb_t cb;
+	void *user;
+
+	unsigned int num_workers;
+	pthread_t workers[];
+};
+
+ssize_t sqfs_compress_block(compressor_t *cmp, void *cmp_opt,
+			    const uint8_t *in, size_t size,
+			    uint8_t *out, size_t outsize)
+{
+	compressor_stream_t *strm;
+	size_t used = 0;
+	ssize_t ret;
+
+	if (cmp->id == PKG_COMPRESSION_NONE)
+		return 0;
+
+	strm = cmp->compression_stream(cmp, cmp_opt);
+	if (strm == NULL)
+		return -1;
+
+	while (size > 0) {
+		ret = strm->write(strm, in, size);
+		if (ret < 0)
+			goto fail;
+
+		in += ret;
+		size -= ret;
+
+		if (size > 0) {
+			if (used >= outsize)
+				goto out_incompressible;
+
+			ret = strm->read(strm, out + used, outsize - used);
+			if (ret < 0)
+				goto fail;
+			used += ret;
+		}
+	}
+
+	strm->flush(strm);
+
+	for (;;) {
+		if (used >= outsize)
+			goto out_incompressible;
+
+		ret = strm->read(strm, out + used, outsize - used);
+		if (ret < 0)
+			goto fail;
+		if (ret == 0)
+			break;
+		used += ret;
+	}
+
+	strm->destroy(strm);
+	return used;
+out_incompressible:
+	strm->destroy(strm);
+	return 0;
+fail:
+	strm->destroy(strm);
+	return -1;
+}
+
+static bool is_zero_block(const uint8_t *data, size_t size)
+{
+	if (size == 0 || data[0] != 0)
+		return false;
+
+	return memcmp(data, data + 1, size - 1) == 0;
+}
+
+static int process_block(block_processor_t *proc, sqfs_block_t *blk,
+			 uint8_t *scratch)
+{
+	ssize_t ret;
+
+	if (!(blk->flags & SQFS_BLK_FRAGMENT) &&
+	    is_zero_block(blk->data, blk->size)) {
+		blk->size = 0;
+		return 0;
+	}
+
+	ret = sqfs_compress_block(proc->cmp, proc->cmp_opt, blk->data,
+				  blk->size, scratch, blk->size);
+	if (ret < 0)
+		return -1;
+
+	if (ret == 0) {
+		blk->flags |= SQFS_BLK_UNCOMPRESSED;
+	} else {
+		memcpy(blk->data, scratch, ret);
+		blk->size = ret;
+	}
+
+	return 0;
+}
+
+static void store_done(block_processor_t *proc, sqfs_block_t *blk)
+{
+	sqfs_block_t *it = proc->done, *prev = NULL;
+
+	while (it != NULL && it->sequence < blk->sequence) {
+		prev = it;
+		it = it->next;
+	}
+
+	if (prev == NULL) {
+		blk->next = proc->done;
+		proc->done = blk;
+	} else {
+		blk->next = prev->next;
+		prev->next = blk;
+	}
+}
+
+static void *worker_proc(void *arg)
+{
+	block_processor_t *proc = arg;
+	sqfs_block_t *blk;
+	uint8_t *scratch;
+	int ret;
+
+	scratch = malloc(proc->max_block_size);
+
+	pthread_mutex_lock(&proc->mtx);
+
+	if (scratch == NULL) {
+		fputs("out of memory\n", stderr);
+		proc->status = -1;
+		pthread_cond_broadcast(&proc->done_cond);
+		pthread_mutex_unlock(&proc->mtx);
+		return NULL;
+	}
+
+	for (;;) {
+		while (proc->queue == NULL && !proc->terminate)
+			pthread_cond_wait(&proc->queue_cond, &proc->mtx);
+
+		if (proc->terminate)
+			break;
+
+		blk = proc->queue;
+		proc->queue = blk->next;
+		if (proc->queue == NULL)
+			proc->queue_last = NULL;
+		blk->next = NULL;
+
+		pthread_mutex_unlock(&proc->mtx);
+		ret = process_block(proc, blk, scratch);
+		pthread_mutex_lock(&proc->mtx);
+
+		if (ret)
+			proc->status = -1;
+
+		store_done(proc, blk);
+		pthread_cond_broadcast(&proc->done_cond);
+	}
+
+	pthread_mutex_unlock(&proc->mtx);
+	free(scratch);
+	return NULL;
+}
+
+/* must be called with the mutex held */
+static void flush_done(block_processor_t *proc)
+{
+	sqfs_block_t *blk;
+	int ret, status;
+
+	while (proc->done != NULL &&
+	       proc->done->sequence == proc->dequeue_id) {
+		blk = proc->done;
+		proc->done = blk->next;
+		proc->dequeue_id += 1;
+		status = proc->status;
+
+		pthread_mutex_unlock(&proc->mtx);
+		ret = status == 0 ? proc->cb(proc->user, blk) : 0;
+		free(blk);
+		pthread_mutex_lock(&proc->mtx);
+
+		proc->backlog -= 1;
+		if (ret)
+			proc->status = -1;
+	}
+}
+
+block_processor_t *block_processor_create(size_t max_block_size,
+					  compressor_t *cmp, void *cmp_opt,
+					  unsigned int num_workers,
+					  size_t max_backlog,
+					  block_cb_t cb, void *user)
+{
+	block_processor_t *proc;
+	unsigned int i;
+
+	if (num_workers < 1)
+		num_workers = 1;
+
+	proc = calloc(1, sizeof(*proc) + num_workers * sizeof(pthread_t));
+	if (proc == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	pthread_mutex_init(&proc->mtx, NULL);
+	pthread_cond_init(&proc->queue_cond, NULL);
+	pthread_cond_init(&proc->done_cond, NULL);
+
+	proc->max_block_size = max_block_size;
+	proc->max_backlog = max_backlog;
+	proc->cmp = cmp;
+	proc->cmp_opt = cmp_opt;
+	proc->cb = cb;
+	proc->user = user;
+
+	for (i = 0; i < num_workers; ++i) {
+		if (pthread_create(proc->workers + i, NULL,
+				   worker_proc, proc)) {
+			fputs("error creating worker thread\n", stderr);
+			break;
+		}
+	}
+
+	proc->num_workers = i;
+
+	if (i < num_workers) {
+		block_processor_destroy(proc);
+		return NULL;
+	}
+
+	return proc;
+}
+
+static void free_list(sqfs_block_t *list)
+{
+	sqfs_block_t *blk;
+
+	while (list != NULL) {
+		blk = list;
+		list = list->next;
+		free(blk);
+	}
+}
+
+void block_processor_destroy(block_processor_t *proc)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&proc->mtx);
+	proc->terminate = true;
+	pthread_cond_broadcast(&proc->queue_cond);
+	pthread_mutex_unlock(&proc->mtx);
+
+	for (i = 0; i < proc->num_workers; ++i)
+		pthread_join(proc->workers[i], NULL);
+
+	free_list(proc->queue);
+	free_list(proc->done);
+
+	pthread_cond_destroy(&proc->done_cond);
+	pthread_cond_destroy(&proc->queue_cond);
+	pthread_mutex_destroy(&proc->mtx);
+	free(proc);
+}
+
+int block_processor_enqueue(block_processor_t *proc, sqfs_block_t *blk)
+{
+	int status;
+
+	pthread_mutex_lock(&proc->mtx);
+
+	blk->next = NULL;
+	blk->sequence = proc->enqueue_id++;
+
+	if (proc->queue_last == NULL) {
+		proc->queue = proc->queue_last = blk;
+	} else {
+		proc->queue_last->next = blk;
+		proc->queue_last = blk;
+	}
+
+	proc->backlog += 1;
+	pthread_cond_signal(&proc->queue_cond);
+
+	for (;;) {
+		flush_done(proc);
+
+		if (proc->status != 0 || proc->backlog <= proc->max_backlog)
+			break;
+
+		pthread_cond_wait(&proc->done_cond, &proc->mtx);
+	}
+
+	status = proc->status;
+	pthread_mutex_unlock(&proc->mtx);
+	return status;
+}
+
+int block_processor_finish(block_processor_t *proc)
+{
+	int status;
+
+	pthread_mutex_lock(&proc->mtx);
+
+	for (;;) {
+		flush_done(proc);
+
+		if (proc->status != 0 || proc->backlog == 0)
+			break;
+
+		pthread_cond_wait(&proc->done_cond, &proc->mtx);
+	}
+
+	status = proc->status;
+	pthread_mutex_unlock(&proc->mtx);
+	return status;
+}
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: ISC */
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <stdio.h>
+
+#include "util/hashtable.h"
+#include "util/util.h"
+#include "sqfs/sqfs.h"
+
+struct sqfs_node_t {
+	struct sqfs_node_t *next;
+	struct sqfs_node_t *parent;
+	char *name;
+
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+
+	uint32_t inode_num;
+	uint64_t inode_ref;
+
+	union {
+		struct {
+			struct sqfs_node_t *children;
+		} dir;
+
+		struct {
+			uint64_t size;
+			uint64_t written;
+			uint64_t start;
+			uint32_t *blocks;
+			size_t num_blocks;
+			uint32_t frag_index;
+			uint32_t frag_offset;
+
+			/* if set, the data is that of another file */
+			struct sqfs_node_t *same_as;
+		} file;
+
+		struct {
+			char *target;
+		} symlink;
+
+		struct {
+			dev_t devno;
+		} device;
+	} data;
+};
+
+/*****************************************************************************/
+
+enum {
+	/* the block is a fragment block, index is the fragment index */
+	SQFS_BLK_FRAGMENT = 0x01,
+
+	/* set by the block processor if compressing did not pay off */
+	SQFS_BLK_UNCOMPRESSED = 0x02,
+};
+
+typedef struct sqfs_block_t {
+	struct sqfs_block_t *next;
+	sqfs_node_t *node;
+	uint32_t sequence;
+	uint32_t index;
+	uint32_t flags;
+	uint32_t size;
+	uint8_t data[];
+} sqfs_block_t;
+
+typedef int (*block_cb_t)(void *user, sqfs_block_t *blk);
+
+typedef struct block_processor_t block_processor_t;
+
+/*
+  Compress data blocks on a pool of worker threads. The callback is
+  invoked for every block from the thread calling enqueue or finish,
+  strictly in the order in which the blocks were enqueued.
+ */
+block_processor_t *block_processor_create(size_t max_block_size,
+					  compressor_t *cmp, void *cmp_opt,
+					  unsigned int num_workers,
+					  size_t max_backlog,
+					  block_cb_t cb, void *user);
+
+void block_processor_destroy(block_processor_t *proc);
+
+/* takes ownership of the block */
+int block_processor_enqueue(block_processor_t *proc, sqfs_block_t *blk);
+
+/* wait for all enqueued blocks to be processed */
+int block_processor_finish(block_processor_t *proc);
+
+/*
+  Returns the size of the compressed data written to out, 0 if the data is
+  not compressible into less than outsize bytes, or -1 on failure.
+ */
+ssize_t sqfs_compress_block(compressor_t *cmp, void *cmp_opt,
+			    const uint8_t *in, size_t size,
+			    uint8_t *out, size_t outsize);
+
+/*****************************************************************************/
+
+typedef struct {
+	uint8_t data[SQFS_META_BLOCK_SIZE];
+	size_t offset;
+
+	uint8_t *out;
+	size_t out_used;
+	size_t out_max;
+
+	compressor_t *cmp;
+	void *cmp_opt;
+} meta_writer_t;
+
+void meta_writer_init(meta_writer_t *mw, compressor_t *cmp, void *cmp_opt);
+
+void meta_writer_cleanup(meta_writer_t *mw);
+
+int meta_writer_append(meta_writer_t *mw, const void *data, size_t size);
+
+int meta_writer_flush(meta_writer_t *mw);
+
+/* location of the next byte appended, relative to the start of the table */
+void meta_writer_get_position(const meta_writer_t *mw, uint64_t *block,
+			      uint32_t *offset);
+
+/*****************************************************************************/
+
+struct sqfs_writer_t {
+	const char *path;
+	int fd;
+	uint64_t offset;
+
+	compressor_t *cmp;
+	size_t block_size;
+	size_t dict_size;
+
+	block_processor_t *proc;
+
+	sqfs_node_t *root;
+	hash_table_t nodes;
+	uint32_t inode_count;
+
+	sqfs_block_t *current;
+	sqfs_node_t *current_file;
+
+	sqfs_block_t *frag_block;
+	sqfs_fragment_t *fragments;
+	size_t num_fragments;
+	size_t max_fragments;
+
+	uint32_t *ids;
+	size_t num_ids;
+
+	meta_writer_t inodes;
+	meta_writer_t dirs;
+};
+
+sqfs_node_t *sqfs_tree_add(sqfs_writer_t *sqfs, image_entry_t *ent);
+
+void sqfs_tree_destroy(sqfs_node_t *root);
+
+int sqfs_serialize_tree(sqfs_writer_t *sqfs);
+
+int sqfs_id_index(sqfs_writer_t *sqfs, uint32_t id);
+
+#endif /* INTERNAL_H */
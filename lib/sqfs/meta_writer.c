@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: ISC */
+#include "internal.h"
+
+void meta_writer_init(meta_writer_t *mw, compressor_t *cmp, void *cmp_opt)
+{
+	memset(mw, 0, sizeof(*mw));
+	mw->cmp = cmp;
+	mw->cmp_opt = cmp_opt;
+}
+
+void meta_writer_cleanup(meta_writer_t *mw)
+{
+	free(mw->out);
+	memset(mw, 0, sizeof(*mw));
+}
+
+static int reserve(meta_writer_t *mw, size_t size)
+{
+	size_t new_max = mw->out_max ? mw->out_max : SQFS_META_BLOCK_SIZE;
+	void *new;
+
+	if (mw->out_used + size <= mw->out_max)
+		return 0;
+
+	while (mw->out_used + size > new_max)
+		new_max *= 2;
+
+	new = realloc(mw->out, new_max);
+	if (new == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	mw->out = new;
+	mw->out_max = new_max;
+	return 0;
+}
+
+int meta_writer_flush(meta_writer_t *mw)
+{
+	uint16_t header;
+	ssize_t ret;
+
+	if (mw->offset == 0)
+		return 0;
+
+	if (reserve(mw, sizeof(header) + mw->offset))
+		return -1;
+
+	ret = sqfs_compress_block(mw->cmp, mw->cmp_opt, mw->data, mw->offset,
+				  mw->out + mw->out_used + sizeof(header),
+				  mw->offset);
+	if (ret < 0)
+		return -1;
+
+	if (ret == 0) {
+		memcpy(mw->out + mw->out_used + sizeof(header),
+		       mw->data, mw->offset);
+		header = htole16(mw->offset | SQFS_META_UNCOMPRESSED);
+		ret = mw->offset;
+	} else {
+		header = htole16(ret);
+	}
+
+	memcpy(mw->out + mw->out_used, &header, sizeof(header));
+	mw->out_used += sizeof(header) + ret;
+	mw->offset = 0;
+	return 0;
+}
+
+int meta_writer_append(meta_writer_t *mw, const void *data, size_t size)
+{
+	size_t diff;
+
+	while (size > 0) {
+		diff = sizeof(mw->data) - mw->offset;
+		if (diff > size)
+			diff = size;
+
+		memcpy(mw->data + mw->offset, data, diff);
+		mw->offset += diff;
+		data = (const char *)data + diff;
+		size -= diff;
+
+		if (mw->offset == sizeof(mw->data)) {
+			if (meta_writer_flush(mw))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+void meta_writer_get_position(const meta_writer_t *mw, uint64_t *block,
+			      uint32_t *offset)
+{
+	*block = mw->out_used;
+	*offset = mw->offset;
+}
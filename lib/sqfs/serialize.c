@@ -0,0 +1,357 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/sysmacros.h>
+
+#include "internal.h"
+
+static int compare_names(const void *lhs, const void *rhs)
+{
+	const sqfs_node_t *a = *((const sqfs_node_t **)lhs);
+	const sqfs_node_t *b = *((const sqfs_node_t **)rhs);
+
+	return strcmp(a->name, b->name);
+}
+
+static int sort_children(sqfs_node_t *dir)
+{
+	sqfs_node_t *it, **array;
+	size_t i, count = 0;
+
+	for (it = dir->data.dir.children; it != NULL; it = it->next)
+		++count;
+
+	if (count < 2)
+		return 0;
+
+	array = calloc(count, sizeof(array[0]));
+	if (array == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	for (i = 0, it = dir->data.dir.children; it != NULL; it = it->next)
+		array[i++] = it;
+
+	qsort(array, count, sizeof(array[0]), compare_names);
+
+	for (i = 0; i < count - 1; ++i)
+		array[i]->next = array[i + 1];
+
+	array[count - 1]->next = NULL;
+	dir->data.dir.children = array[0];
+
+	free(array);
+	return 0;
+}
+
+/*
+  Inode numbers are assigned in post-order, so the root directory receives
+  the highest number.
+ */
+static int number_inodes(sqfs_writer_t *sqfs, sqfs_node_t *node)
+{
+	sqfs_node_t *it;
+
+	if (S_ISDIR(node->mode)) {
+		if (sort_children(node))
+			return -1;
+
+		for (it = node->data.dir.children; it != NULL; it = it->next) {
+			if (number_inodes(sqfs, it))
+				return -1;
+		}
+	}
+
+	node->inode_num = ++sqfs->inode_count;
+	return 0;
+}
+
+static int write_common(sqfs_writer_t *sqfs, sqfs_node_t *node, int type)
+{
+	sqfs_inode_t inode;
+	uint32_t offset;
+	uint64_t block;
+	int uid, gid;
+
+	uid = sqfs_id_index(sqfs, node->uid);
+	gid = sqfs_id_index(sqfs, node->gid);
+	if (uid < 0 || gid < 0)
+		return -1;
+
+	meta_writer_get_position(&sqfs->inodes, &block, &offset);
+	node->inode_ref = (block << 16) | offset;
+
+	memset(&inode, 0, sizeof(inode));
+	inode.type = htole16(type);
+	inode.mode = htole16(node->mode & 07777);
+	inode.uid_idx = htole16(uid);
+	inode.gid_idx = htole16(gid);
+	inode.inode_number = htole32(node->inode_num);
+
+	return meta_writer_append(&sqfs->inodes, &inode, sizeof(inode));
+}
+
+static int write_file_inode(sqfs_writer_t *sqfs, sqfs_node_t *node)
+{
+	sqfs_node_t *src = node->data.file.same_as;
+	sqfs_inode_file_ext_t ext;
+	sqfs_inode_file_t file;
+	uint32_t size;
+	size_t i;
+
+	if (src != NULL) {
+		node->data.file.start = src->data.file.start;
+		node->data.file.frag_index = src->data.file.frag_index;
+		node->data.file.frag_offset = src->data.file.frag_offset;
+
+		for (i = 0; i < node->data.file.num_blocks; ++i)
+			node->data.file.blocks[i] = src->data.file.blocks[i];
+	}
+
+	if (node->data.file.written != node->data.file.size) {
+		fprintf(stderr, "%s: missing data for file '%s'\n",
+			sqfs->path, node->name);
+		return -1;
+	}
+
+	if (node->data.file.size > 0xFFFFFFFFUL ||
+	    node->data.file.start > 0xFFFFFFFFUL) {
+		if (write_common(sqfs, node, SQFS_INODE_EXT_FILE))
+			return -1;
+
+		memset(&ext, 0, sizeof(ext));
+		ext.blocks_start = htole64(node->data.file.start);
+		ext.file_size = htole64(node->data.file.size);
+		ext.nlink = htole32(1);
+		ext.fragment_idx = htole32(node->data.file.frag_index);
+		ext.fragment_offset = htole32(node->data.file.frag_offset);
+		ext.xattr_idx = htole32(0xFFFFFFFF);
+
+		if (meta_writer_append(&sqfs->inodes, &ext, sizeof(ext)))
+			return -1;
+	} else {
+		if (write_common(sqfs, node, SQFS_INODE_FILE))
+			return -1;
+
+		memset(&file, 0, sizeof(file));
+		file.blocks_start = htole32(node->data.file.start);
+		file.fragment_index = htole32(node->data.file.frag_index);
+		file.fragment_offset = htole32(node->data.file.frag_offset);
+		file.file_size = htole32(node->data.file.size);
+
+		if (meta_writer_append(&sqfs->inodes, &file, sizeof(file)))
+			return -1;
+	}
+
+	for (i = 0; i < node->data.file.num_blocks; ++i) {
+		size = htole32(node->data.file.blocks[i]);
+
+		if (meta_writer_append(&sqfs->inodes, &size, sizeof(size)))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int write_inode(sqfs_writer_t *sqfs, sqfs_node_t *node)
+{
+	sqfs_inode_slink_t slink;
+	sqfs_inode_dev_t dev;
+	unsigned int maj, min;
+	size_t len;
+
+	switch (node->mode & S_IFMT) {
+	case S_IFREG:
+		return write_file_inode(sqfs, node);
+	case S_IFLNK:
+		if (write_common(sqfs, node, SQFS_INODE_SLINK))
+			return -1;
+
+		len = strlen(node->data.symlink.target);
+
+		slink.nlink = htole32(1);
+		slink.target_size = htole32(len);
+
+		if (meta_writer_append(&sqfs->inodes, &slink, sizeof(slink)))
+			return -1;
+
+		return meta_writer_append(&sqfs->inodes,
+					  node->data.symlink.target, len);
+	case S_IFBLK:
+	case S_IFCHR:
+		if (write_common(sqfs, node, S_ISBLK(node->mode) ?
+				 SQFS_INODE_BDEV : SQFS_INODE_CDEV)) {
+			return -1;
+		}
+
+		maj = major(node->data.device.devno);
+		min = minor(node->data.device.devno);
+
+		dev.nlink = htole32(1);
+		dev.devno = htole32((min & 0xFF) | (maj << 8) |
+				    ((min & ~0xFF) << 12));
+
+		return meta_writer_append(&sqfs->inodes, &dev, sizeof(dev));
+	default:
+		break;
+	}
+
+	fprintf(stderr, "%s: %s: unsupported file type\n",
+		sqfs->path, node->name);
+	return -1;
+}
+
+static int dir_entry_type(sqfs_node_t *node)
+{
+	switch (node->mode & S_IFMT) {
+	case S_IFDIR:
+		return SQFS_INODE_DIR;
+	case S_IFREG:
+		return SQFS_INODE_FILE;
+	case S_IFLNK:
+		return SQFS_INODE_SLINK;
+	case S_IFBLK:
+		return SQFS_INODE_BDEV;
+	default:
+		break;
+	}
+
+	return SQFS_INODE_CDEV;
+}
+
+static bool can_share_header(sqfs_node_t *first, sqfs_node_t *it,
+			     size_t count)
+{
+	int64_t diff = (int64_t)it->inode_num - (int64_t)first->inode_num;
+
+	if (count >= 256)
+		return false;
+
+	if ((first->inode_ref >> 16) != (it->inode_ref >> 16))
+		return false;
+
+	return diff >= -32767 && diff <= 32767;
+}
+
+static int write_dir_listing(sqfs_writer_t *sqfs, sqfs_node_t *dir,
+			     size_t *size)
+{
+	sqfs_node_t *first, *it, *end;
+	sqfs_dir_header_t hdr;
+	sqfs_dir_entry_t ent;
+	size_t count, len;
+
+	*size = 0;
+
+	for (first = dir->data.dir.children; first != NULL; first = end) {
+		count = 0;
+		end = first;
+
+		while (end != NULL && can_share_header(first, end, count)) {
+			end = end->next;
+			++count;
+		}
+
+		hdr.count = htole32(count - 1);
+		hdr.start_block = htole32(first->inode_ref >> 16);
+		hdr.inode_number = htole32(first->inode_num);
+
+		if (meta_writer_append(&sqfs->dirs, &hdr, sizeof(hdr)))
+			return -1;
+
+		*size += sizeof(hdr);
+
+		for (it = first; it != end; it = it->next) {
+			len = strlen(it->name);
+
+			ent.offset = htole16(it->inode_ref & 0xFFFF);
+			ent.inode_diff = htole16((int16_t)(it->inode_num -
+							   first->inode_num));
+			ent.type = htole16(dir_entry_type(it));
+			ent.size = htole16(len - 1);
+
+			if (meta_writer_append(&sqfs->dirs, &ent, sizeof(ent)))
+				return -1;
+
+			if (meta_writer_append(&sqfs->dirs, it->name, len))
+				return -1;
+
+			*size += sizeof(ent) + len;
+		}
+	}
+
+	return 0;
+}
+
+static int serialize_dir(sqfs_writer_t *sqfs, sqfs_node_t *dir)
+{
+	sqfs_inode_dir_ext_t ext;
+	sqfs_inode_dir_t inode;
+	uint32_t nlink = 2, offset, parent;
+	size_t size;
+	uint64_t block;
+	sqfs_node_t *it;
+
+	for (it = dir->data.dir.children; it != NULL; it = it->next) {
+		if (S_ISDIR(it->mode)) {
+			if (serialize_dir(sqfs, it))
+				return -1;
+			++nlink;
+		} else {
+			if (write_inode(sqfs, it))
+				return -1;
+		}
+	}
+
+	meta_writer_get_position(&sqfs->dirs, &block, &offset);
+
+	if (write_dir_listing(sqfs, dir, &size))
+		return -1;
+
+	/* the size includes the implicit "." and ".." entries */
+	size += 3;
+
+	parent = dir->parent == NULL ? (sqfs->inode_count + 1) :
+		 dir->parent->inode_num;
+
+	if (size > 0xFFFF || block > 0xFFFFFFFFUL) {
+		if (write_common(sqfs, dir, SQFS_INODE_EXT_DIR))
+			return -1;
+
+		memset(&ext, 0, sizeof(ext));
+		ext.nlink = htole32(nlink);
+		ext.size = htole32(size);
+		ext.start_block = htole32(block);
+		ext.parent_inode = htole32(parent);
+		ext.offset = htole16(offset);
+		ext.xattr_idx = htole32(0xFFFFFFFF);
+
+		return meta_writer_append(&sqfs->inodes, &ext, sizeof(ext));
+	}
+
+	if (write_common(sqfs, dir, SQFS_INODE_DIR))
+		return -1;
+
+	inode.start_block = htole32(block);
+	inode.nlink = htole32(nlink);
+	inode.size = htole16(size);
+	inode.offset = htole16(offset);
+	inode.parent_inode = htole32(parent);
+
+	return meta_writer_append(&sqfs->inodes, &inode, sizeof(inode));
+}
+
+int sqfs_serialize_tree(sqfs_writer_t *sqfs)
+{
+	sqfs->inode_count = 0;
+
+	if (number_inodes(sqfs, sqfs->root))
+		return -1;
+
+	if (serialize_dir(sqfs, sqfs->root))
+		return -1;
+
+	if (meta_writer_flush(&sqfs->inodes))
+		return -1;
+
+	return meta_writer_flush(&sqfs->dirs);
+}
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: ISC */
+#include "internal.h"
+
+static sqfs_node_t *mknode(sqfs_node_t *parent, const char *name,
+			   size_t len)
+{
+	sqfs_node_t *node = calloc(1, sizeof(*node));
+
+	if (node == NULL)
+		goto fail_oom;
+
+	node->name = strndup(name, len);
+	if (node->name == NULL)
+		goto fail_oom;
+
+	node->parent = parent;
+	node->next = parent->data.dir.children;
+	parent->data.dir.children = node;
+	return node;
+fail_oom:
+	fputs("out of memory\n", stderr);
+	free(node);
+	return NULL;
+}
+
+static sqfs_node_t *get_parent(sqfs_writer_t *sqfs, const char *path)
+{
+	const char *ptr = strrchr(path, '/');
+	sqfs_node_t *parent, *node;
+	char *dirname;
+
+	if (ptr == NULL)
+		return sqfs->root;
+
+	dirname = strndup(path, ptr - path);
+	if (dirname == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	node = hash_table_lookup(&sqfs->nodes, dirname);
+
+	if (node == NULL) {
+		parent = get_parent(sqfs, dirname);
+		if (parent == NULL)
+			goto fail;
+
+		ptr = strrchr(dirname, '/');
+		ptr = (ptr == NULL) ? dirname : (ptr + 1);
+
+		node = mknode(parent, ptr, strlen(ptr));
+		if (node == NULL)
+			goto fail;
+
+		node->mode = S_IFDIR | 0755;
+
+		if (hash_table_set(&sqfs->nodes, dirname, node))
+			goto fail;
+	} else if (!S_ISDIR(node->mode)) {
+		fprintf(stderr, "%s: %s: not a directory\n",
+			sqfs->path, dirname);
+		goto fail;
+	}
+
+	free(dirname);
+	return node;
+fail:
+	free(dirname);
+	return NULL;
+}
+
+sqfs_node_t *sqfs_tree_add(sqfs_writer_t *sqfs, image_entry_t *ent)
+{
+	sqfs_node_t *node, *parent;
+	const char *name;
+
+	node = hash_table_lookup(&sqfs->nodes, ent->name);
+
+	if (node != NULL) {
+		if (!S_ISDIR(node->mode) || !S_ISDIR(ent->mode)) {
+			fprintf(stderr, "%s: %s: File exists\n",
+				sqfs->path, ent->name);
+			return NULL;
+		}
+
+		node->mode = ent->mode;
+		node->uid = ent->uid;
+		node->gid = ent->gid;
+		return node;
+	}
+
+	parent = get_parent(sqfs, ent->name);
+	if (parent == NULL)
+		return NULL;
+
+	name = strrchr(ent->name, '/');
+	name = (name == NULL) ? ent->name : (name + 1);
+
+	node = mknode(parent, name, strlen(name));
+	if (node == NULL)
+		return NULL;
+
+	node->mode = ent->mode;
+	node->uid = ent->uid;
+	node->gid = ent->gid;
+
+	switch (ent->mode & S_IFMT) {
+	case S_IFREG:
+		node->data.file.size = ent->data.file.size;
+		node->data.file.frag_index = SQFS_NO_FRAGMENT;
+		node->data.file.num_blocks = ent->data.file.size /
+					     sqfs->block_size;
+
+		if (node->data.file.num_blocks > 0) {
+			node->data.file.blocks =
+				calloc(node->data.file.num_blocks,
+				       sizeof(node->data.file.blocks[0]));
+
+			if (node->data.file.blocks == NULL)
+				goto fail_oom;
+		}
+		break;
+	case S_IFLNK:
+		node->data.symlink.target = strdup(ent->data.symlink.target);
+		if (node->data.symlink.target == NULL)
+			goto fail_oom;
+		break;
+	case S_IFBLK:
+	case S_IFCHR:
+		node->data.device.devno = ent->data.device.devno;
+		break;
+	default:
+		break;
+	}
+
+	if (hash_table_set(&sqfs->nodes, ent->name, node))
+		return NULL;
+
+	return node;
+fail_oom:
+	fputs("out of memory\n", stderr);
+	return NULL;
+}
+
+void sqfs_tree_destroy(sqfs_node_t *root)
+{
+	sqfs_node_t *node;
+
+	if (root == NULL)
+		return;
+
+	switch (root->mode & S_IFMT) {
+	case S_IFDIR:
+		while (root->data.dir.children != NULL) {
+			node = root->data.dir.children;
+			root->data.dir.children = node->next;
+
+			sqfs_tree_destroy(node);
+		}
+		break;
+	case S_IFREG:
+		free(root->data.file.blocks);
+		break;
+	case S_IFLNK:
+		free(root->data.symlink.target);
+		break;
+	default:
+		break;
+	}
+
+	free(root->name);
+	free(root);
+}
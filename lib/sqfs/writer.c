@@ -0,0 +1,528 @@
+/* SPDX-License-Identifier: ISC */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "internal.h"
+
+static int write_data(sqfs_writer_t *sqfs, const void *data, size_t size)
+{
+	ssize_t ret = write_retry(sqfs->fd, (void *)data, size);
+
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", sqfs->path, strerror(errno));
+		return -1;
+	}
+
+	if ((size_t)ret < size) {
+		fprintf(stderr, "%s: truncated write\n", sqfs->path);
+		return -1;
+	}
+
+	sqfs->offset += size;
+	return 0;
+}
+
+static int write_block(void *user, sqfs_block_t *blk)
+{
+	sqfs_writer_t *sqfs = user;
+	uint32_t size = blk->size;
+
+	if (blk->flags & SQFS_BLK_UNCOMPRESSED)
+		size |= SQFS_BLOCK_UNCOMPRESSED;
+
+	if (blk->flags & SQFS_BLK_FRAGMENT) {
+		sqfs->fragments[blk->index].start_offset =
+			htole64(sqfs->offset);
+		sqfs->fragments[blk->index].size = htole32(size);
+	} else {
+		if (blk->index == 0)
+			blk->node->data.file.start = sqfs->offset;
+
+		blk->node->data.file.blocks[blk->index] = size;
+	}
+
+	return write_data(sqfs, blk->data, blk->size);
+}
+
+static sqfs_block_t *alloc_block(sqfs_writer_t *sqfs)
+{
+	sqfs_block_t *blk = calloc(1, sizeof(*blk) + sqfs->block_size);
+
+	if (blk == NULL)
+		fputs("out of memory\n", stderr);
+
+	return blk;
+}
+
+static int flush_fragment_block(sqfs_writer_t *sqfs)
+{
+	sqfs_block_t *blk = sqfs->frag_block;
+
+	if (blk == NULL)
+		return 0;
+
+	sqfs->frag_block = NULL;
+	return block_processor_enqueue(sqfs->proc, blk);
+}
+
+static int add_fragment(sqfs_writer_t *sqfs, sqfs_node_t *node,
+			sqfs_block_t *tail)
+{
+	size_t new_max;
+	void *new;
+
+	if (sqfs->frag_block != NULL &&
+	    (sqfs->frag_block->size + tail->size) > sqfs->block_size) {
+		if (flush_fragment_block(sqfs))
+			return -1;
+	}
+
+	if (sqfs->frag_block == NULL) {
+		if (sqfs->num_fragments == sqfs->max_fragments) {
+			new_max = sqfs->max_fragments ?
+				  sqfs->max_fragments * 2 : 64;
+
+			new = realloc(sqfs->fragments,
+				      new_max * sizeof(sqfs->fragments[0]));
+			if (new == NULL) {
+				fputs("out of memory\n", stderr);
+				return -1;
+			}
+
+			sqfs->fragments = new;
+			sqfs->max_fragments = new_max;
+		}
+
+		sqfs->frag_block = alloc_block(sqfs);
+		if (sqfs->frag_block == NULL)
+			return -1;
+
+		sqfs->frag_block->flags = SQFS_BLK_FRAGMENT;
+		sqfs->frag_block->index = sqfs->num_fragments;
+
+		memset(sqfs->fragments + sqfs->num_fragments, 0,
+		       sizeof(sqfs->fragments[0]));
+		sqfs->num_fragments += 1;
+	}
+
+	node->data.file.frag_index = sqfs->frag_block->index;
+	node->data.file.frag_offset = sqfs->frag_block->size;
+
+	memcpy(sqfs->frag_block->data + sqfs->frag_block->size,
+	       tail->data, tail->size);
+	sqfs->frag_block->size += tail->size;
+	return 0;
+}
+
+int sqfs_id_index(sqfs_writer_t *sqfs, uint32_t id)
+{
+	void *new;
+	size_t i;
+
+	for (i = 0; i < sqfs->num_ids; ++i) {
+		if (sqfs->ids[i] == id)
+			return i;
+	}
+
+	if (sqfs->num_ids == 0x10000) {
+		fprintf(stderr, "%s: too many unique user/group IDs\n",
+			sqfs->path);
+		return -1;
+	}
+
+	new = realloc(sqfs->ids, (sqfs->num_ids + 1) * sizeof(sqfs->ids[0]));
+	if (new == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	sqfs->ids = new;
+	sqfs->ids[sqfs->num_ids] = id;
+	return sqfs->num_ids++;
+}
+
+/*
+  Write a table of fixed size entries as a sequence of meta data blocks,
+  followed by a list of their on-disk locations, which the super block
+  points to.
+ */
+static int write_table(sqfs_writer_t *sqfs, const void *data, size_t size,
+		       uint64_t *start)
+{
+	size_t i, count, diff;
+	meta_writer_t mw;
+	uint64_t *locs;
+	int ret = -1;
+
+	count = (size + SQFS_META_BLOCK_SIZE - 1) / SQFS_META_BLOCK_SIZE;
+
+	locs = calloc(count ? count : 1, sizeof(locs[0]));
+	if (locs == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	meta_writer_init(&mw, sqfs->cmp, &sqfs->dict_size);
+
+	for (i = 0; i < count; ++i) {
+		diff = size - i * SQFS_META_BLOCK_SIZE;
+		if (diff > SQFS_META_BLOCK_SIZE)
+			diff = SQFS_META_BLOCK_SIZE;
+
+		locs[i] = htole64(sqfs->offset + mw.out_used);
+
+		if (meta_writer_append(&mw, (const char *)data +
+				       i * SQFS_META_BLOCK_SIZE, diff)) {
+			goto out;
+		}
+
+		if (meta_writer_flush(&mw))
+			goto out;
+	}
+
+	if (write_data(sqfs, mw.out, mw.out_used))
+		goto out;
+
+	*start = sqfs->offset;
+
+	if (write_data(sqfs, locs, count * sizeof(locs[0])))
+		goto out;
+
+	ret = 0;
+out:
+	meta_writer_cleanup(&mw);
+	free(locs);
+	return ret;
+}
+
+static int write_super(sqfs_writer_t *sqfs, sqfs_super_t *super)
+{
+	ssize_t ret;
+
+	super->magic = htole32(super->magic);
+	super->inode_count = htole32(super->inode_count);
+	super->block_size = htole32(super->block_size);
+	super->fragment_entry_count = htole32(super->fragment_entry_count);
+	super->compression_id = htole16(super->compression_id);
+	super->block_log = htole16(super->block_log);
+	super->flags = htole16(super->flags);
+	super->id_count = htole16(super->id_count);
+	super->version_major = htole16(super->version_major);
+	super->version_minor = htole16(super->version_minor);
+	super->root_inode_ref = htole64(super->root_inode_ref);
+	super->bytes_used = htole64(super->bytes_used);
+	super->id_table_start = htole64(super->id_table_start);
+	super->xattr_id_table_start = htole64(super->xattr_id_table_start);
+	super->inode_table_start = htole64(super->inode_table_start);
+	super->directory_table_start = htole64(super->directory_table_start);
+	super->fragment_table_start = htole64(super->fragment_table_start);
+	super->export_table_start = htole64(super->export_table_start);
+
+	ret = pwrite(sqfs->fd, super, sizeof(*super), 0);
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", sqfs->path, strerror(errno));
+		return -1;
+	}
+
+	if ((size_t)ret < sizeof(*super)) {
+		fprintf(stderr, "%s: truncated write\n", sqfs->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pad_image(sqfs_writer_t *sqfs)
+{
+	static const uint8_t zero[4096];
+	size_t diff = sqfs->offset % sizeof(zero);
+
+	if (diff == 0)
+		return 0;
+
+	return write_data(sqfs, zero, sizeof(zero) - diff);
+}
+
+sqfs_writer_t *sqfs_writer_open(const char *path, compressor_t *cmp,
+				size_t block_size, unsigned int num_workers)
+{
+	sqfs_writer_t *sqfs = calloc(1, sizeof(*sqfs));
+	long cpus;
+
+	if (sqfs == NULL) {
+		fputs("out of memory\n", stderr);
+		return NULL;
+	}
+
+	if (num_workers == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_workers = cpus > 0 ? cpus : 1;
+	}
+
+	sqfs->path = path;
+	sqfs->cmp = cmp;
+	sqfs->block_size = block_size;
+	sqfs->dict_size = block_size;
+	sqfs->offset = sizeof(sqfs_super_t);
+
+	meta_writer_init(&sqfs->inodes, cmp, &sqfs->dict_size);
+	meta_writer_init(&sqfs->dirs, cmp, &sqfs->dict_size);
+
+	if (hash_table_init(&sqfs->nodes, 1024))
+		goto fail;
+
+	sqfs->root = calloc(1, sizeof(*sqfs->root));
+	if (sqfs->root == NULL) {
+		fputs("out of memory\n", stderr);
+		goto fail_tbl;
+	}
+
+	sqfs->root->mode = S_IFDIR | 0755;
+
+	sqfs->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (sqfs->fd < 0) {
+		perror(path);
+		goto fail_root;
+	}
+
+	if (lseek(sqfs->fd, sqfs->offset, SEEK_SET) == -1) {
+		perror(path);
+		goto fail_fd;
+	}
+
+	/*
+	  The dictionary size is passed as option to the lzma compressor. The
+	  kernel preallocates the xz dictionary, expecting it not to exceed
+	  the block size.
+	 */
+	sqfs->proc = block_processor_create(block_size, cmp, &sqfs->dict_size,
+					    num_workers, num_workers * 4,
+					    write_block, sqfs);
+	if (sqfs->proc == NULL)
+		goto fail_fd;
+
+	return sqfs;
+fail_fd:
+	close(sqfs->fd);
+fail_root:
+	free(sqfs->root);
+fail_tbl:
+	hash_table_cleanup(&sqfs->nodes);
+fail:
+	free(sqfs);
+	return NULL;
+}
+
+void sqfs_writer_close(sqfs_writer_t *sqfs)
+{
+	block_processor_destroy(sqfs->proc);
+	close(sqfs->fd);
+
+	sqfs_tree_destroy(sqfs->root);
+	hash_table_cleanup(&sqfs->nodes);
+
+	meta_writer_cleanup(&sqfs->inodes);
+	meta_writer_cleanup(&sqfs->dirs);
+
+	free(sqfs->current);
+	free(sqfs->frag_block);
+	free(sqfs->fragments);
+	free(sqfs->ids);
+	free(sqfs);
+}
+
+sqfs_node_t *sqfs_writer_add_entry(sqfs_writer_t *sqfs, image_entry_t *ent)
+{
+	return sqfs_tree_add(sqfs, ent);
+}
+
+int sqfs_writer_append_data(sqfs_writer_t *sqfs, sqfs_node_t *node,
+			    const void *data, size_t size)
+{
+	sqfs_block_t *blk;
+	size_t diff;
+
+	if (sqfs->current_file != node) {
+		if (sqfs->current_file != NULL || node->data.file.written) {
+			fprintf(stderr, "%s: %s: file data out of order\n",
+				sqfs->path, node->name);
+			return -1;
+		}
+
+		sqfs->current_file = node;
+	}
+
+	if (size > node->data.file.size - node->data.file.written) {
+		fprintf(stderr, "%s: %s: too much data for file\n",
+			sqfs->path, node->name);
+		return -1;
+	}
+
+	while (size > 0) {
+		if (sqfs->current == NULL) {
+			sqfs->current = alloc_block(sqfs);
+			if (sqfs->current == NULL)
+				return -1;
+		}
+
+		blk = sqfs->current;
+
+		diff = sqfs->block_size - blk->size;
+		if (diff > size)
+			diff = size;
+
+		memcpy(blk->data + blk->size, data, diff);
+		blk->size += diff;
+		data = (const char *)data + diff;
+		size -= diff;
+		node->data.file.written += diff;
+
+		if (blk->size == sqfs->block_size) {
+			blk->node = node;
+			blk->index = (node->data.file.written - 1) /
+				     sqfs->block_size;
+			sqfs->current = NULL;
+
+			if (block_processor_enqueue(sqfs->proc, blk))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+int sqfs_writer_share_data(sqfs_writer_t *sqfs, sqfs_node_t *node,
+			   sqfs_node_t *src)
+{
+	while (src->data.file.same_as != NULL)
+		src = src->data.file.same_as;
+
+	if (node->data.file.written != 0 || src == node ||
+	    src->data.file.size != node->data.file.size) {
+		fprintf(stderr, "%s: %s: cannot share data of %s\n",
+			sqfs->path, node->name, src->name);
+		return -1;
+	}
+
+	node->data.file.same_as = src;
+	node->data.file.written = node->data.file.size;
+	return 0;
+}
+
+int sqfs_writer_end_file(sqfs_writer_t *sqfs, sqfs_node_t *node)
+{
+	int ret = 0;
+
+	if (sqfs->current_file != NULL && sqfs->current_file != node) {
+		fprintf(stderr, "%s: %s: file data out of order\n",
+			sqfs->path, node->name);
+		return -1;
+	}
+
+	if (node->data.file.written != node->data.file.size) {
+		fprintf(stderr, "%s: %s: missing file data\n",
+			sqfs->path, node->name);
+		return -1;
+	}
+
+	if (sqfs->current != NULL && sqfs->current->size > 0)
+		ret = add_fragment(sqfs, node, sqfs->current);
+
+	if (sqfs->current != NULL)
+		sqfs->current->size = 0;
+
+	sqfs->current_file = NULL;
+	return ret;
+}
+
+int sqfs_writer_finish(sqfs_writer_t *sqfs)
+{
+	uint64_t table_start;
+	sqfs_super_t super;
+	size_t i;
+
+	if (sqfs->current_file != NULL) {
+		fprintf(stderr, "%s: %s: missing file data\n",
+			sqfs->path, sqfs->current_file->name);
+		return -1;
+	}
+
+	if (flush_fragment_block(sqfs))
+		return -1;
+
+	if (block_processor_finish(sqfs->proc))
+		return -1;
+
+	if (sqfs_serialize_tree(sqfs))
+		return -1;
+
+	memset(&super, 0, sizeof(super));
+	super.magic = SQFS_MAGIC;
+	super.inode_count = sqfs->inode_count;
+	super.block_size = sqfs->block_size;
+	super.fragment_entry_count = sqfs->num_fragments;
+	super.flags = SQFS_FLAG_NO_XATTRS;
+	super.version_major = SQFS_VERSION_MAJOR;
+	super.version_minor = SQFS_VERSION_MINOR;
+	super.root_inode_ref = sqfs->root->inode_ref;
+	super.xattr_id_table_start = SQFS_NO_TABLE;
+	super.export_table_start = SQFS_NO_TABLE;
+	super.fragment_table_start = SQFS_NO_TABLE;
+	super.id_count = sqfs->num_ids;
+
+	while ((1UL << super.block_log) < sqfs->block_size)
+		super.block_log += 1;
+
+	switch (sqfs->cmp->id) {
+	case PKG_COMPRESSION_LZMA:
+		super.compression_id = SQFS_COMP_XZ;
+		break;
+	case PKG_COMPRESSION_ZLIB:
+		super.compression_id = SQFS_COMP_GZIP;
+		break;
+	default:
+		/* SquashFS has no "none" compressor, flag everything raw */
+		super.compression_id = SQFS_COMP_GZIP;
+		super.flags |= SQFS_FLAG_UNCOMPRESSED_INODES |
+			       SQFS_FLAG_UNCOMPRESSED_DATA |
+			       SQFS_FLAG_UNCOMPRESSED_FRAGMENTS |
+			       SQFS_FLAG_UNCOMPRESSED_IDS;
+		break;
+	}
+
+	super.inode_table_start = sqfs->offset;
+	if (write_data(sqfs, sqfs->inodes.out, sqfs->inodes.out_used))
+		return -1;
+
+	super.directory_table_start = sqfs->offset;
+	if (write_data(sqfs, sqfs->dirs.out, sqfs->dirs.out_used))
+		return -1;
+
+	if (sqfs->num_fragments > 0) {
+		if (write_table(sqfs, sqfs->fragments,
+				sqfs->num_fragments *
+				sizeof(sqfs->fragments[0]), &table_start)) {
+			return -1;
+		}
+
+		super.fragment_table_start = table_start;
+	}
+
+	for (i = 0; i < sqfs->num_ids; ++i)
+		sqfs->ids[i] = htole32(sqfs->ids[i]);
+
+	if (write_table(sqfs, sqfs->ids, sqfs->num_ids * sizeof(sqfs->ids[0]),
+			&table_start)) {
+		return -1;
+	}
+
+	super.id_table_start = table_start;
+
+	super.bytes_used = sqfs->offset;
+
+	if (pad_image(sqfs))
+		return -1;
+
+	return write_super(sqfs, &super);
+}
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "util/util.h"
+
+#define SPLICE_CHUNK (64 * 1024)
+
+static bool copy_not_supported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+  Whatever is still in the pipe has already been consumed from the input,
+  so it must end up in the output, one way or the other.
+ */
+static int drain_pipe(int pipefd, int outfd, size_t size)
+{
+	char buffer[4096];
+	ssize_t ret;
+	size_t diff;
+
+	while (size > 0) {
+		diff = size < sizeof(buffer) ? size : sizeof(buffer);
+
+		ret = read_retry(pipefd, buffer, diff);
+		if (ret < 0)
+			return -1;
+
+		if ((size_t)ret < diff) {
+			errno = EIO;
+			return -1;
+		}
+
+		ret = write_retry(outfd, buffer, diff);
+		if (ret < 0)
+			return -1;
+
+		if ((size_t)ret < diff) {
+			errno = ENOSPC;
+			return -1;
+		}
+
+		size -= diff;
+	}
+
+	return 0;
+}
+
+static ssize_t splice_range(int infd, int outfd, size_t size)
+{
+	ssize_t ret, total = 0, in_pipe;
+	int pipefd[2];
+
+	if (pipe2(pipefd, O_CLOEXEC) != 0)
+		return 0;
+
+	while (size > 0) {
+		in_pipe = splice(infd, NULL, pipefd[1], NULL,
+				 size < SPLICE_CHUNK ? size : SPLICE_CHUNK,
+				 SPLICE_F_MOVE);
+		if (in_pipe < 0 && errno == EINTR)
+			continue;
+		if (in_pipe <= 0)
+			break;
+
+		while (in_pipe > 0) {
+			ret = splice(pipefd[0], NULL, outfd, NULL, in_pipe,
+				     SPLICE_F_MOVE);
+			if (ret < 0 && errno == EINTR)
+				continue;
+
+			if (ret <= 0) {
+				if (drain_pipe(pipefd[0], outfd, in_pipe))
+					goto fail;
+				ret = in_pipe;
+			}
+
+			in_pipe -= ret;
+			total += ret;
+			size -= ret;
+		}
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return total;
+fail:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return -1;
+}
+
+ssize_t copy_range(int infd, int outfd, size_t size)
+{
+	ssize_t ret, total = 0;
+
+	while (size > 0) {
+		ret = copy_file_range(infd, NULL, outfd, NULL, size, 0);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && total == 0 && copy_not_supported(errno))
+			return splice_range(infd, outfd, size);
+
+		if (ret <= 0)
+			break;
+
+		size -= ret;
+		total += ret;
+	}
+
+	return total;
+}
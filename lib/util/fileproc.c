@@ -1,62 +1,149 @@
 /* SPDX-License-Identifier: ISC */
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 
 #include "util/util.h"
 
-int foreach_line_in_file(const char *filename, void *usr, linecb_t fun)
+/*
+  Strip white space from both ends of the line in [start, end) and null
+  terminate it at the new end, which must be writable. Returns NULL for
+  blank lines.
+ */
+static char *trim(char *start, char *end)
+{
+	while (start < end && isspace(*start))
+		++start;
+
+	while (end > start && isspace(end[-1]))
+		--end;
+
+	*end = '\0';
+	return start == end ? NULL : start;
+}
+
+/*
+  The file is mapped privately and writable, so lines can be terminated in
+  place (copy-on-write only touches the pages that are actually modified)
+  and handed to the callback without copying them anywhere.
+ */
+static int foreach_line_mapped(int fd, size_t size, const char *filename,
+			       void *usr, linecb_t fun)
 {
-	FILE *f = fopen(filename, "r");
-	char *line = NULL, *ptr;
-	size_t n, lineno = 1;
-	ssize_t ret;
+	char *map, *ptr, *end, *nl, *line, *last = NULL;
+	size_t lineno = 0;
+	int ret = 0;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 1;
+
+	posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+	for (ptr = map, end = map + size; ptr < end; ptr = nl + 1) {
+		nl = memchr(ptr, '\n', end - ptr);
+		++lineno;
+
+		if (nl == NULL) {
+			/* no room for a terminator past the end of the map */
+			last = strndup(ptr, end - ptr);
+			if (last == NULL) {
+				fputs("out of memory\n", stderr);
+				ret = -1;
+				break;
+			}
+
+			line = trim(last, last + strlen(last));
+			nl = end - 1;
+		} else {
+			line = trim(ptr, nl);
+		}
+
+		if (line != NULL && fun(usr, filename, lineno, line)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(last);
+	munmap(map, size);
+	return ret;
+}
 
+static int foreach_line_stream(int fd, const char *filename,
+			       void *usr, linecb_t fun)
+{
+	size_t n = 0, lineno = 0;
+	char *buffer = NULL, *line;
+	int ret = 0;
+	ssize_t len;
+	FILE *f;
+
+	f = fdopen(fd, "r");
 	if (f == NULL) {
 		perror(filename);
+		close(fd);
 		return -1;
 	}
 
 	for (;;) {
-		free(line);
-
-		line = NULL;
 		errno = 0;
-		n = 0;
-		ret = getline(&line, &n, f);
+		len = getline(&buffer, &n, f);
 
-		if (ret < 0) {
-			if (errno == 0) {
-				ret = 0;
-				break;
+		if (len < 0) {
+			if (errno != 0) {
+				perror(filename);
+				ret = -1;
 			}
-			perror(filename);
 			break;
 		}
 
-		for (ptr = line; isspace(*ptr); ++ptr)
-			;
-
-		if (ptr != line)
-			memmove(line, ptr, strlen(ptr) + 1);
-
-		ptr = line + strlen(line);
-		while (ptr > line && isspace(ptr[-1]))
-			--ptr;
-		*ptr = '\0';
+		++lineno;
+		line = trim(buffer, buffer + len);
 
-		if (*line == '\0')
-			continue;
-
-		if (fun(usr, filename, lineno++, line)) {
+		if (line != NULL && fun(usr, filename, lineno, line)) {
 			ret = -1;
 			break;
 		}
 	}
 
-	free(line);
+	free(buffer);
 	fclose(f);
 	return ret;
 }
+
+int foreach_line_in_file(const char *filename, void *usr, linecb_t fun)
+{
+	struct stat sb;
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		perror(filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (S_ISREG(sb.st_mode)) {
+		if (sb.st_size == 0) {
+			close(fd);
+			return 0;
+		}
+
+		ret = foreach_line_mapped(fd, sb.st_size, filename, usr, fun);
+		if (ret <= 0) {
+			close(fd);
+			return ret;
+		}
+	}
+
+	/* pipes and anything else that cannot be mapped */
+	return foreach_line_stream(fd, filename, usr, fun);
+}
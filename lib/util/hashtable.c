@@ -1,148 +1,276 @@
 /* SPDX-License-Identifier: ISC */
-#include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "util/hashtable.h"
 
-/* R5 hash function (borrowed from reiserfs) */
-static uint32_t strhash(const char *s)
+#define MIN_CAPACITY 16
+
+/*
+  MurmurHash64A by Austin Appleby (public domain), working on 8 byte words
+  instead of the single bytes the old R5 hash used.
+ */
+static uint64_t strhash(const char *s)
 {
-	const signed char *str = (const signed char *)s;
-	uint32_t a = 0;
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	size_t i, len = strlen(s);
+	uint64_t k, h;
+
+	h = 0x9747b28c ^ (len * m);
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&k, s + i, sizeof(k));
+
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	if (i < len) {
+		k = 0;
+		memcpy(&k, s + i, len - i);
 
-	while (*str != '\0') {
-		a += *str << 4;
-		a += *str >> 4;
-		a *= 11;
-		str++;
+		h ^= k;
+		h *= m;
 	}
 
-	return a;
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+	return h;
 }
 
-int hash_table_init(hash_table_t *table, size_t size)
+/* how far an entry in a slot is away from its home slot */
+static size_t probe_distance(const hash_table_t *table, size_t slot)
 {
-	table->num_buckets = size;
-	table->count = 0;
-	table->buckets = calloc(size, sizeof(table->buckets[0]));
+	size_t home = table->entries[slot].hash & (table->capacity - 1);
+
+	return (slot - home) & (table->capacity - 1);
+}
 
-	if (table->buckets == NULL) {
+static bool needs_grow(const hash_table_t *table)
+{
+	/* keep the load factor at or below 80% */
+	return (table->count + 1) * 5 > table->capacity * 4;
+}
+
+static int alloc_entries(hash_table_t *table, size_t capacity)
+{
+	table->entries = calloc(capacity, sizeof(table->entries[0]));
+	if (table->entries == NULL) {
 		fputs("out of memory\n", stderr);
 		return -1;
 	}
 
+	table->capacity = capacity;
 	return 0;
 }
 
+int hash_table_init_flags(hash_table_t *table, size_t size, int flags)
+{
+	size_t capacity = MIN_CAPACITY;
+
+	while (capacity * 4 < size * 5)
+		capacity *= 2;
+
+	table->count = 0;
+	table->flags = flags;
+	return alloc_entries(table, capacity);
+}
+
+int hash_table_init(hash_table_t *table, size_t size)
+{
+	return hash_table_init_flags(table, size, 0);
+}
+
 void hash_table_cleanup(hash_table_t *table)
 {
-	hash_bucket_t *bucket;
 	size_t i;
 
-	for (i = 0; i < table->num_buckets; ++i) {
-		while (table->buckets[i] != NULL) {
-			bucket = table->buckets[i];
-			table->buckets[i] = bucket->next;
-
-			free(bucket->key);
-			free(bucket);
-		}
+	if (!(table->flags & HASH_TABLE_BORROW_KEYS)) {
+		for (i = 0; i < table->capacity; ++i)
+			free(table->entries[i].key);
 	}
 
-	free(table->buckets);
+	free(table->entries);
 
-	table->buckets = NULL;
-	table->num_buckets = 0;
+	table->entries = NULL;
+	table->capacity = 0;
 	table->count = 0;
 }
 
-void *hash_table_lookup(hash_table_t *table, const char *key)
+static hash_entry_t *find(hash_table_t *table, const char *key, uint64_t hash)
 {
-	hash_bucket_t *bucket;
-	uint32_t hash;
+	size_t mask = table->capacity - 1, slot = hash & mask, dist = 0;
+	hash_entry_t *ent;
 
-	hash = strhash(key);
-	bucket = table->buckets[hash % table->num_buckets];
+	for (;;) {
+		ent = table->entries + slot;
 
-	while (bucket != NULL) {
-		if (strcmp(bucket->key, key) == 0)
-			return bucket->value;
+		/* any entry of ours would have displaced a closer one */
+		if (ent->key == NULL || probe_distance(table, slot) < dist)
+			return NULL;
 
-		bucket = bucket->next;
+		if (ent->hash == hash && strcmp(ent->key, key) == 0)
+			return ent;
+
+		slot = (slot + 1) & mask;
+		++dist;
 	}
+}
 
-	return NULL;
+void *hash_table_lookup(hash_table_t *table, const char *key)
+{
+	hash_entry_t *ent = find(table, key, strhash(key));
+
+	return ent == NULL ? NULL : ent->value;
 }
 
-int hash_table_set(hash_table_t *table, const char *key, void *value)
+/* place an entry that is known not to be in the table yet */
+static hash_entry_t *place(hash_table_t *table, hash_entry_t ent)
 {
-	hash_bucket_t *bucket;
-	uint32_t hash;
-	size_t index;
+	size_t mask = table->capacity - 1, slot = ent.hash & mask, dist = 0;
+	hash_entry_t tmp, *ret = NULL;
 
-	hash = strhash(key);
-	index = hash % table->num_buckets;
-	bucket = table->buckets[index];
+	for (;;) {
+		if (table->entries[slot].key == NULL) {
+			table->entries[slot] = ent;
+			return ret == NULL ? table->entries + slot : ret;
+		}
 
-	while (bucket != NULL) {
-		if (strcmp(bucket->key, key) == 0) {
-			bucket->value = value;
-			return 0;
+		if (probe_distance(table, slot) < dist) {
+			tmp = table->entries[slot];
+			table->entries[slot] = ent;
+			ent = tmp;
+
+			if (ret == NULL)
+				ret = table->entries + slot;
+
+			dist = probe_distance(table, slot);
 		}
 
-		bucket = bucket->next;
+		slot = (slot + 1) & mask;
+		++dist;
+	}
+}
+
+static int grow(hash_table_t *table)
+{
+	hash_entry_t *old = table->entries;
+	size_t i, old_capacity = table->capacity;
+
+	if (alloc_entries(table, old_capacity * 2)) {
+		table->entries = old;
+		table->capacity = old_capacity;
+		return -1;
+	}
+
+	for (i = 0; i < old_capacity; ++i) {
+		if (old[i].key != NULL)
+			place(table, old[i]);
+	}
+
+	free(old);
+	return 0;
+}
+
+static hash_entry_t *insert(hash_table_t *table, const char *key, void *value)
+{
+	uint64_t hash = strhash(key);
+	hash_entry_t ent, *found;
+
+	found = find(table, key, hash);
+	if (found != NULL) {
+		found->value = value;
+		return found;
 	}
 
-	bucket = calloc(1, sizeof(*bucket));
-	if (bucket == NULL)
-		goto fail_oom;
+	if (needs_grow(table) && grow(table))
+		return NULL;
 
-	bucket->key = strdup(key);
-	if (bucket->key == NULL)
-		goto fail_oom;
+	ent.hash = hash;
+	ent.value = value;
 
-	bucket->value = value;
-	bucket->next = table->buckets[index];
+	if (table->flags & HASH_TABLE_BORROW_KEYS) {
+		ent.key = (char *)key;
+	} else {
+		ent.key = strdup(key);
+		if (ent.key == NULL) {
+			fputs("out of memory\n", stderr);
+			return NULL;
+		}
+	}
 
-	table->buckets[index] = bucket;
 	table->count += 1;
-	return 0;
-fail_oom:
-	free(bucket);
-	fputs("out of memory\n", stderr);
-	return -1;
+	return place(table, ent);
+}
+
+int hash_table_set(hash_table_t *table, const char *key, void *value)
+{
+	return insert(table, key, value) == NULL ? -1 : 0;
+}
+
+const char *hash_table_intern(hash_table_t *table, const char *key,
+			      void *value)
+{
+	hash_entry_t *ent = insert(table, key, value);
+
+	return ent == NULL ? NULL : ent->key;
+}
+
+/* backward shift deletion, no tombstones needed */
+static void remove_slot(hash_table_t *table, size_t slot)
+{
+	size_t mask = table->capacity - 1, next;
+
+	if (!(table->flags & HASH_TABLE_BORROW_KEYS))
+		free(table->entries[slot].key);
+
+	for (;;) {
+		next = (slot + 1) & mask;
+
+		if (table->entries[next].key == NULL ||
+		    probe_distance(table, next) == 0) {
+			break;
+		}
+
+		table->entries[slot] = table->entries[next];
+		slot = next;
+	}
+
+	memset(table->entries + slot, 0, sizeof(table->entries[0]));
+	table->count -= 1;
 }
 
 void hash_table_foreach(hash_table_t *table, void *usr,
 			int(*fun)(void *usr, const char *key, void *value))
 {
-	hash_bucket_t *bucket, *prev;
-	size_t i;
+	size_t i, start = 0, slot, mask = table->capacity - 1;
+	hash_entry_t *ent;
+
+	/*
+	  Start at an empty slot. Removing an entry only shifts
+	  entries of the same probe sequence back by one, and no sequence
+	  crosses an empty slot, so every entry is visited exactly once.
+	 */
+	while (start < table->capacity && table->entries[start].key != NULL)
+		++start;
+
+	for (i = 0; i < table->capacity; ++i) {
+		slot = (start + i) & mask;
+
+		for (;;) {
+			ent = table->entries + slot;
+
+			if (ent->key == NULL || !fun(usr, ent->key, ent->value))
+				break;
 
-	for (i = 0; i < table->num_buckets; ++i) {
-		prev = NULL;
-		bucket = table->buckets[i];
-
-		while (bucket != NULL) {
-			if (fun(usr, bucket->key, bucket->value)) {
-				if (prev == NULL) {
-					table->buckets[i] = bucket->next;
-					free(bucket->key);
-					free(bucket);
-					bucket = table->buckets[i];
-				} else {
-					prev->next = bucket->next;
-					free(bucket->key);
-					free(bucket);
-					bucket = prev->next;
-				}
-				table->count -= 1;
-			} else {
-				prev = bucket;
-				bucket = bucket->next;
-			}
+			remove_slot(table, slot);
 		}
 	}
 }
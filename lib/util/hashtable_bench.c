@@ -0,0 +1,408 @@
+/* SPDX-License-Identifier: ISC */
+/*
+  Microbenchmark for hash_table_t. Times insertion, lookups and removal via
+  foreach on the current table and on the chained R5 table it replaced,
+  using the same keys. Built with `make hashtable_bench`, it is not part of
+  the regular build.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "util/hashtable.h"
+
+#define LOOKUP_ROUNDS 10
+
+/*
+  The previous implementation: separate chaining with the R5 hash, growing
+  once the average chain length exceeds 2. Kept as is, apart from the
+  names, so both tables are measured on equal terms.
+ */
+typedef struct r5_bucket_t {
+	struct r5_bucket_t *next;
+	char *key;
+	void *value;
+} r5_bucket_t;
+
+typedef struct {
+	r5_bucket_t **buckets;
+	size_t num_buckets;
+	size_t count;
+} r5_table_t;
+
+static uint32_t r5_strhash(const char *s)
+{
+	const signed char *str = (const signed char *)s;
+	uint32_t a = 0;
+
+	while (*str != '\0') {
+		a += *str << 4;
+		a += *str >> 4;
+		a *= 11;
+		str++;
+	}
+
+	return a;
+}
+
+static int r5_init(r5_table_t *table, size_t size)
+{
+	table->num_buckets = size;
+	table->count = 0;
+	table->buckets = calloc(size, sizeof(table->buckets[0]));
+
+	if (table->buckets == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void r5_cleanup(r5_table_t *table)
+{
+	r5_bucket_t *bucket;
+	size_t i;
+
+	for (i = 0; i < table->num_buckets; ++i) {
+		while (table->buckets[i] != NULL) {
+			bucket = table->buckets[i];
+			table->buckets[i] = bucket->next;
+
+			free(bucket->key);
+			free(bucket);
+		}
+	}
+
+	free(table->buckets);
+
+	table->buckets = NULL;
+	table->num_buckets = 0;
+	table->count = 0;
+}
+
+static void *r5_lookup(r5_table_t *table, const char *key)
+{
+	r5_bucket_t *bucket;
+	uint32_t hash;
+
+	hash = r5_strhash(key);
+	bucket = table->buckets[hash % table->num_buckets];
+
+	while (bucket != NULL) {
+		if (strcmp(bucket->key, key) == 0)
+			return bucket->value;
+
+		bucket = bucket->next;
+	}
+
+	return NULL;
+}
+
+static void r5_grow(r5_table_t *table)
+{
+	size_t i, index, new_count = table->num_buckets * 2 + 1;
+	r5_bucket_t **new, *bucket;
+
+	new = calloc(new_count, sizeof(new[0]));
+	if (new == NULL)
+		return;
+
+	for (i = 0; i < table->num_buckets; ++i) {
+		while (table->buckets[i] != NULL) {
+			bucket = table->buckets[i];
+			table->buckets[i] = bucket->next;
+
+			index = r5_strhash(bucket->key) % new_count;
+			bucket->next = new[index];
+			new[index] = bucket;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = new;
+	table->num_buckets = new_count;
+}
+
+static int r5_set(r5_table_t *table, const char *key, void *value)
+{
+	r5_bucket_t *bucket;
+	uint32_t hash;
+	size_t index;
+
+	hash = r5_strhash(key);
+	index = hash % table->num_buckets;
+	bucket = table->buckets[index];
+
+	while (bucket != NULL) {
+		if (strcmp(bucket->key, key) == 0) {
+			bucket->value = value;
+			return 0;
+		}
+
+		bucket = bucket->next;
+	}
+
+	if (table->count >= table->num_buckets * 2) {
+		r5_grow(table);
+		index = hash % table->num_buckets;
+	}
+
+	bucket = calloc(1, sizeof(*bucket));
+	if (bucket == NULL)
+		goto fail_oom;
+
+	bucket->key = strdup(key);
+	if (bucket->key == NULL)
+		goto fail_oom;
+
+	bucket->value = value;
+	bucket->next = table->buckets[index];
+
+	table->buckets[index] = bucket;
+	table->count += 1;
+	return 0;
+fail_oom:
+	free(bucket);
+	fputs("out of memory\n", stderr);
+	return -1;
+}
+
+static void r5_foreach(r5_table_t *table, void *usr,
+		       int(*fun)(void *usr, const char *key, void *value))
+{
+	r5_bucket_t *bucket, *prev;
+	size_t i;
+
+	for (i = 0; i < table->num_buckets; ++i) {
+		prev = NULL;
+		bucket = table->buckets[i];
+
+		while (bucket != NULL) {
+			if (fun(usr, bucket->key, bucket->value)) {
+				if (prev == NULL) {
+					table->buckets[i] = bucket->next;
+					free(bucket->key);
+					free(bucket);
+					bucket = table->buckets[i];
+				} else {
+					prev->next = bucket->next;
+					free(bucket->key);
+					free(bucket);
+					bucket = prev->next;
+				}
+				table->count -= 1;
+			} else {
+				prev = bucket;
+				bucket = bucket->next;
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+
+typedef struct {
+	double insert_ms;
+	double hit_ns;
+	double miss_ns;
+	double remove_ms;
+} results_t;
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* package names are what the tables mostly hold in practice */
+static char **make_keys(size_t count, const char *fmt)
+{
+	char **keys = calloc(count, sizeof(keys[0]));
+	size_t i;
+
+	if (keys == NULL)
+		goto fail;
+
+	for (i = 0; i < count; ++i) {
+		if (asprintf(keys + i, fmt, i) < 0) {
+			keys[i] = NULL;
+			goto fail;
+		}
+	}
+
+	return keys;
+fail:
+	fputs("out of memory\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+/*
+  Look the keys up in a fixed, pseudo random order. Walking them in the
+  order they were inserted favors the R5 table, since consecutive names
+  hash to neighbouring buckets that were also allocated one after another.
+ */
+static void shuffle_keys(char **keys, size_t count)
+{
+	uint64_t state = 0x9E3779B97F4A7C15UL;
+	size_t i, j;
+	char *tmp;
+
+	for (i = count; i > 1; --i) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		j = state % i;
+		tmp = keys[i - 1];
+		keys[i - 1] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+static void free_keys(char **keys, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		free(keys[i]);
+
+	free(keys);
+}
+
+/* remove every other entry, in the order the table visits them */
+static int remove_half(void *usr, const char *key, void *value)
+{
+	size_t *counter = usr;
+	(void)key; (void)value;
+
+	return (*counter)++ % 2 == 0;
+}
+
+static size_t sink;
+
+static void bench_current(char **keys, char **lookups, char **misses,
+			  size_t count, results_t *out)
+{
+	size_t i, round, counter = 0;
+	hash_table_t table;
+	uint64_t start;
+
+	/* start small, like callers that cannot estimate the final size */
+	if (hash_table_init(&table, 16))
+		exit(EXIT_FAILURE);
+
+	start = time_ns();
+	for (i = 0; i < count; ++i) {
+		if (hash_table_set(&table, keys[i], keys[i]))
+			exit(EXIT_FAILURE);
+	}
+	out->insert_ms = (double)(time_ns() - start) / 1e6;
+
+	start = time_ns();
+	for (round = 0; round < LOOKUP_ROUNDS; ++round) {
+		for (i = 0; i < count; ++i)
+			sink += hash_table_lookup(&table, lookups[i]) != NULL;
+	}
+	out->hit_ns = (double)(time_ns() - start) / (count * LOOKUP_ROUNDS);
+
+	start = time_ns();
+	for (round = 0; round < LOOKUP_ROUNDS; ++round) {
+		for (i = 0; i < count; ++i)
+			sink += hash_table_lookup(&table, misses[i]) != NULL;
+	}
+	out->miss_ns = (double)(time_ns() - start) / (count * LOOKUP_ROUNDS);
+
+	start = time_ns();
+	hash_table_foreach(&table, &counter, remove_half);
+	out->remove_ms = (double)(time_ns() - start) / 1e6;
+
+	hash_table_cleanup(&table);
+}
+
+static void bench_r5(char **keys, char **lookups, char **misses,
+		     size_t count, results_t *out)
+{
+	size_t i, round, counter = 0;
+	r5_table_t table;
+	uint64_t start;
+
+	if (r5_init(&table, 16))
+		exit(EXIT_FAILURE);
+
+	start = time_ns();
+	for (i = 0; i < count; ++i) {
+		if (r5_set(&table, keys[i], keys[i]))
+			exit(EXIT_FAILURE);
+	}
+	out->insert_ms = (double)(time_ns() - start) / 1e6;
+
+	start = time_ns();
+	for (round = 0; round < LOOKUP_ROUNDS; ++round) {
+		for (i = 0; i < count; ++i)
+			sink += r5_lookup(&table, lookups[i]) != NULL;
+	}
+	out->hit_ns = (double)(time_ns() - start) / (count * LOOKUP_ROUNDS);
+
+	start = time_ns();
+	for (round = 0; round < LOOKUP_ROUNDS; ++round) {
+		for (i = 0; i < count; ++i)
+			sink += r5_lookup(&table, misses[i]) != NULL;
+	}
+	out->miss_ns = (double)(time_ns() - start) / (count * LOOKUP_ROUNDS);
+
+	start = time_ns();
+	r5_foreach(&table, &counter, remove_half);
+	out->remove_ms = (double)(time_ns() - start) / 1e6;
+
+	r5_cleanup(&table);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = { 1000, 30000, 300000 };
+	size_t i, count, num_sizes;
+	results_t old, new;
+	char **keys, **lookups, **misses;
+
+	num_sizes = argc > 1 ? (size_t)(argc - 1) :
+		sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+	printf("%8s %21s %21s %21s %21s\n", "keys", "insert ms (old/new)",
+	       "hit ns (old/new)", "miss ns (old/new)",
+	       "remove ms (old/new)");
+
+	for (i = 0; i < num_sizes; ++i) {
+		count = argc > 1 ? strtoul(argv[i + 1], NULL, 10) :
+			default_sizes[i];
+		if (count == 0) {
+			fprintf(stderr, "%s: expected a key count\n",
+				argv[i + 1]);
+			return EXIT_FAILURE;
+		}
+
+		keys = make_keys(count, "libfoo-%zu-dev");
+		misses = make_keys(count, "libbar-%zu-doc");
+		lookups = make_keys(count, "libfoo-%zu-dev");
+		shuffle_keys(lookups, count);
+		shuffle_keys(misses, count);
+
+		bench_r5(keys, lookups, misses, count, &old);
+		bench_current(keys, lookups, misses, count, &new);
+
+		printf("%8zu %10.1f /%9.1f %10.1f /%9.1f %10.1f /%9.1f "
+		       "%10.1f /%9.1f\n", count,
+		       old.insert_ms, new.insert_ms, old.hit_ns, new.hit_ns,
+		       old.miss_ns, new.miss_ns, old.remove_ms, new.remove_ms);
+
+		free_keys(lookups, count);
+		free_keys(misses, count);
+		free_keys(keys, count);
+	}
+
+	return sink == (size_t)-1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 /* SPDX-License-Identifier: ISC */
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -11,26 +12,31 @@ void input_file_complain(const char *filename, size_t linenum, const char *msg)
 	fprintf(stderr, "%s: %zu: %s\n", filename, linenum, msg);
 }
 
+/*
+  The keywords are chained by their first character, so a line is only ever
+  compared against the keywords it can possibly match.
+ */
 struct userdata {
 	const keyword_handler_t *handlers;
-	size_t count;
 	void *obj;
+
+	size_t *lengths;
+	int *next;
+	int first[256];
 };
 
 static int handle_line(void *usr, const char *filename,
 		       size_t linenum, char *line)
 {
 	struct userdata *u = usr;
-	size_t i, len;
-
-	while (isspace(*line))
-		++line;
+	size_t len;
+	int i;
 
-	if (*line == '\0' || *line == '#')
+	if (*line == '#')
 		return 0;
 
-	for (i = 0; i < u->count; ++i) {
-		len = strlen(u->handlers[i].name);
+	for (i = u->first[(unsigned char)*line]; i >= 0; i = u->next[i]) {
+		len = u->lengths[i];
 
 		if (strncmp(line, u->handlers[i].name, len) != 0)
 			continue;
@@ -41,7 +47,7 @@ static int handle_line(void *usr, const char *filename,
 		break;
 	}
 
-	if (i == u->count) {
+	if (i < 0) {
 		fprintf(stderr, "%s: %zu: unknown keyword\n",
 			filename, linenum);
 		return -1;
@@ -53,7 +59,36 @@ static int handle_line(void *usr, const char *filename,
 int process_file(const char *filename, const keyword_handler_t *handlers,
 		 size_t count, void *obj)
 {
-	struct userdata u = { handlers, count, obj };
+	struct userdata u;
+	unsigned char c;
+	int ret = -1;
+	size_t i;
+
+	memset(&u, 0, sizeof(u));
+	u.handlers = handlers;
+	u.obj = obj;
+	memset(u.first, 0xFF, sizeof(u.first));
+
+	u.lengths = calloc(count ? count : 1, sizeof(u.lengths[0]));
+	u.next = calloc(count ? count : 1, sizeof(u.next[0]));
+
+	if (u.lengths == NULL || u.next == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	/* insert back to front, so earlier entries take precedence */
+	for (i = count; i-- > 0; ) {
+		c = handlers[i].name[0];
+
+		u.lengths[i] = strlen(handlers[i].name);
+		u.next[i] = u.first[c];
+		u.first[c] = i;
+	}
 
-	return foreach_line_in_file(filename, &u, handle_line);
+	ret = foreach_line_in_file(filename, &u, handle_line);
+out:
+	free(u.next);
+	free(u.lengths);
+	return ret;
 }
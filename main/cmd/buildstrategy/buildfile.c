@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: ISC */
+#include "buildstrategy.h"
+
+/*
+  Every source package becomes a stamp file target that runs the build
+  command with the package name and touches the stamp when it succeeds.
+  The dependencies are order-only, so an interrupted build restarts where
+  it left off and the build tool is free to run independent packages in
+  parallel.
+ */
+static void print_escaped(const char *str, bool ninja)
+{
+	for (; *str != '\0'; ++str) {
+		if (*str == '$' || (ninja && (*str == ' ' || *str == ':')))
+			fputc('$', stdout);
+
+		fputc(*str, stdout);
+	}
+}
+
+static void print_stamp(size_t id, bool ninja)
+{
+	fputs(ninja ? "$stampdir/" : "$(STAMPDIR)/", stdout);
+	print_escaped(src_pkg_by_id(id)->name, ninja);
+}
+
+static void print_target(const graph_t *graph, const bool *mask,
+			 size_t id, bool ninja)
+{
+	bool first = true;
+	size_t i;
+
+	fputs(ninja ? "build " : "", stdout);
+	print_stamp(id, ninja);
+	fputs(ninja ? ": build" : ":", stdout);
+
+	for (i = graph->offsets[id]; i < graph->offsets[id + 1]; ++i) {
+		if (!mask[graph->edges[i]])
+			continue;
+
+		if (first) {
+			fputs(ninja ? " || " : " | ", stdout);
+		} else {
+			fputc(' ', stdout);
+		}
+
+		print_stamp(graph->edges[i], ninja);
+		first = false;
+	}
+
+	if (ninja) {
+		fputs("\n  pkg = ", stdout);
+		print_escaped(src_pkg_by_id(id)->name, true);
+		fputs("\n\n", stdout);
+	} else {
+		fputs("\n\t@mkdir -p $(STAMPDIR)\n\t$(BUILD_COMMAND) ", stdout);
+		print_escaped(src_pkg_by_id(id)->name, false);
+		fputs("\n\t@touch $@\n\n", stdout);
+	}
+}
+
+int src_pkg_output_build_file(const char *command, bool ninja)
+{
+	size_t i, count, n = src_pkg_count();
+	const graph_t *graph = src_pkg_graph();
+	size_t *order = NULL;
+	bool *mask = NULL;
+	int ret = -1;
+
+	order = calloc(n ? n : 1, sizeof(order[0]));
+	mask = calloc(n ? n : 1, sizeof(mask[0]));
+
+	if (order == NULL || mask == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i)
+		mask[i] = (src_pkg_by_id(i)->flags & FLAG_BUILD_PKG) != 0;
+
+	if (graph_topo_sort(graph, mask, order, &count, NULL))
+		goto out;
+
+	fputs("# generated by pkg buildstrategy\n", stdout);
+
+	if (ninja) {
+		printf("build_command = %s\n", command);
+		fputs("stampdir = stamps\n\n"
+		      "rule build\n"
+		      "  command = mkdir -p $stampdir && "
+		      "$build_command $pkg && touch $out\n"
+		      "  description = BUILD $pkg\n\n", stdout);
+	} else {
+		printf("BUILD_COMMAND ?= %s\n", command);
+		fputs("STAMPDIR ?= stamps\n\n"
+		      ".PHONY: all\n"
+		      "all:", stdout);
+
+		for (i = 0; i < count; ++i) {
+			fputs(" \\\n\t", stdout);
+			print_stamp(order[i], false);
+		}
+
+		fputs("\n\n", stdout);
+	}
+
+	for (i = 0; i < count; ++i)
+		print_target(graph, mask, order[i], ninja);
+
+	if (ninja) {
+		fputs("build all: phony", stdout);
+
+		for (i = 0; i < count; ++i) {
+			fputs(" $\n    ", stdout);
+			print_stamp(order[i], true);
+		}
+
+		fputs("\ndefault all\n", stdout);
+	}
+
+	ret = 0;
+out:
+	free(mask);
+	free(order);
+	return ret;
+}
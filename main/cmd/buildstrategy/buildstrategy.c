@@ -41,8 +41,6 @@ static int handle_depends(const char *filename, size_t linenum,
 			  const char *sourcepkg, const char *binpkg)
 {
 	source_pkg_t *src, *dep;
-	size_t count;
-	void *new;
 	(void)filename; (void)linenum;
 
 	src = src_pkg_get(sourcepkg);
@@ -53,19 +51,33 @@ static int handle_depends(const char *filename, size_t linenum,
 	if (dep == NULL)
 		return -1;
 
-	if ((src->num_depends % 10) == 0) {
-		count = src->num_depends + 10;
+	return src_pkg_add_depends(src, dep);
+}
 
-		new = realloc(src->depends, sizeof(src->depends[0]) * count);
-		if (new == NULL) {
-			fputs("out of memory\n", stderr);
-			return -1;
-		}
+static int handle_duration(const char *filename, size_t linenum,
+			   const char *sourcepkg, const char *value)
+{
+	unsigned long duration;
+	source_pkg_t *src;
+	char *end;
+
+	duration = strtoul(value, &end, 10);
 
-		src->depends = new;
+	while (isspace(*end))
+		++end;
+
+	if (!isdigit(*value) || *end != '\0') {
+		input_file_complain(filename, linenum,
+				    "expected a duration in seconds");
+		return -1;
 	}
 
-	src->depends[src->num_depends++] = dep;
+	/* packages that are not part of the graph are never scheduled */
+	src = src_pkg_find(sourcepkg);
+	if (src != NULL) {
+		src->duration = duration;
+		src->flags |= FLAG_HAS_DURATION;
+	}
 	return 0;
 }
 
@@ -92,31 +104,44 @@ static const struct option long_opts[] = {
 	{ "provides", required_argument, NULL, 'p' },
 	{ "depends", required_argument, NULL, 'd' },
 	{ "graph", no_argument, NULL, 'g' },
+	{ "waves", no_argument, NULL, 'w' },
+	{ "durations", required_argument, NULL, 'D' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "rebuild-for", no_argument, NULL, 'r' },
+	{ "ninja", no_argument, NULL, 'N' },
+	{ "makefile", no_argument, NULL, 'M' },
+	{ "build-command", required_argument, NULL, 'c' },
+	{ "graph-cache", required_argument, NULL, 'G' },
 	{ NULL, 0, NULL, 0 },
 };
 
-static const char *short_opts = "p:d:P:g";
+static const char *short_opts = "p:d:P:gwD:j:rNMc:G:";
 
-static void pkg_mark_deps(source_pkg_t *pkg)
+static int read_inputs(const char *provides, const char *depends,
+		       const char *prefere)
 {
-	size_t i;
+	if (prefere != NULL && foreach_line(prefere, handle_prefere) != 0)
+		return -1;
 
-	if (pkg->flags & FLAG_BUILD_PKG)
-		return;
+	if (foreach_line(provides, handle_provides))
+		return -1;
 
-	pkg->flags |= FLAG_BUILD_PKG;
+	if (depends != NULL && foreach_line(depends, handle_depends) != 0)
+		return -1;
 
-	for (i = 0; i < pkg->num_depends; ++i) {
-		if ((pkg->depends[i]->flags & FLAG_BUILD_PKG) == 0)
-			pkg_mark_deps(pkg->depends[i]);
-	}
+	return src_pkg_build_graph();
 }
 
 static int cmd_buildstrategy(int argc, char **argv)
 {
 	const char *provides = NULL, *depends = NULL, *prefere = NULL;
 	int i, ret = EXIT_FAILURE, mode = MODE_BUILD_ORDER;
-	source_pkg_t *pkg;
+	int direction = GRAPH_FORWARD;
+	const char *command = "build-package", *graph_cache = NULL;
+	const char *durations = NULL, *inputs[3];
+	size_t jobs = 1;
+	int loaded = 0;
+	source_pkg_t **pkgs = NULL;
 
 	if (src_pkg_init())
 		return EXIT_FAILURE;
@@ -142,6 +167,37 @@ static int cmd_buildstrategy(int argc, char **argv)
 		case 'g':
 			mode = MODE_BUILD_GRAPH;
 			break;
+		case 'w':
+			mode = MODE_BUILD_WAVES;
+			break;
+		case 'D':
+			durations = optarg;
+			mode = MODE_BUILD_SCHEDULE;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 10);
+			if (jobs == 0) {
+				fputs("number of jobs must be at least 1\n",
+				      stderr);
+				goto fail_arg;
+			}
+			mode = MODE_BUILD_SCHEDULE;
+			break;
+		case 'r':
+			direction = GRAPH_REVERSE;
+			break;
+		case 'N':
+			mode = MODE_BUILD_NINJA;
+			break;
+		case 'M':
+			mode = MODE_BUILD_MAKEFILE;
+			break;
+		case 'c':
+			command = optarg;
+			break;
+		case 'G':
+			graph_cache = optarg;
+			break;
 		default:
 			goto fail_arg;
 		}
@@ -157,29 +213,75 @@ static int cmd_buildstrategy(int argc, char **argv)
 		goto fail_arg;
 	}
 
-	if (prefere != NULL && foreach_line(prefere, handle_prefere) != 0)
-		goto out;
+	inputs[0] = provides;
+	inputs[1] = depends;
+	inputs[2] = prefere;
 
-	if (foreach_line(provides, handle_provides))
+	if (graph_cache != NULL) {
+		loaded = graph_cache_load(graph_cache, inputs);
+		if (loaded < 0)
+			goto out;
+	}
+
+	if (!loaded) {
+		if (read_inputs(provides, depends, prefere))
+			goto out;
+
+		if (graph_cache != NULL &&
+		    graph_cache_store(graph_cache, inputs) != 0) {
+			goto out;
+		}
+	}
+
+	if (durations != NULL && foreach_line(durations, handle_duration))
 		goto out;
 
-	if (depends != NULL && foreach_line(depends, handle_depends) != 0)
+	pkgs = calloc(argc - optind, sizeof(pkgs[0]));
+	if (pkgs == NULL) {
+		fputs("out of memory\n", stderr);
 		goto out;
+	}
 
 	for (i = optind; i < argc; ++i) {
-		pkg = provider_get(NULL, argv[i]);
-		if (pkg == NULL)
-			goto out;
-
-		pkg_mark_deps(pkg);
+		if (direction == GRAPH_REVERSE) {
+			pkgs[i - optind] = src_pkg_find(argv[i]);
+
+			if (pkgs[i - optind] == NULL) {
+				fprintf(stderr, "Unknown source package '%s'.\n",
+					argv[i]);
+				goto out;
+			}
+		} else {
+			pkgs[i - optind] = provider_get(NULL, argv[i]);
+			if (pkgs[i - optind] == NULL)
+				goto out;
+		}
 	}
 
+	if (src_pkg_mark_deps(pkgs, argc - optind, direction))
+		goto out;
+
 	switch (mode) {
 	case MODE_BUILD_GRAPH:
 		fputs("digraph buildgraph {\n\tcompound=true;\n", stdout);
 		src_pkg_print_graph_cluster();
 		fputs("}\n", stdout);
 		break;
+	case MODE_BUILD_WAVES:
+		if (src_pkg_output_build_waves())
+			goto out;
+		break;
+	case MODE_BUILD_SCHEDULE:
+		if (src_pkg_output_schedule(jobs))
+			goto out;
+		break;
+	case MODE_BUILD_NINJA:
+	case MODE_BUILD_MAKEFILE:
+		if (src_pkg_output_build_file(command,
+					      mode == MODE_BUILD_NINJA)) {
+			goto out;
+		}
+		break;
 	default:
 		if (src_pkg_output_build_order())
 			goto out;
@@ -188,9 +290,11 @@ static int cmd_buildstrategy(int argc, char **argv)
 
 	ret = EXIT_SUCCESS;
 out:
+	free(pkgs);
 	provider_cleanup();
 out_src:
 	src_pkg_cleanup();
+	graph_cache_close();
 	return ret;
 fail_arg:
 	tell_read_help(argv[0]);
@@ -224,7 +328,42 @@ static command_t buildstrategy = {
 "                         provides a binary package, this file contains the\n"
 "                         prefered one we should use.\n"
 "  --graph, -g            Instead of printing out an ordered list, produce\n"
-"                         a dot graph of the source packages to be built.\n",
+"                         a dot graph of the source packages to be built.\n"
+"  --waves, -w            Instead of printing out an ordered list, print one\n"
+"                         line per build wave, prefixed with the wave number.\n"
+"                         All source packages of a wave only depend on\n"
+"                         packages from previous waves and can be built\n"
+"                         concurrently.\n"
+"  --durations, -D <file> A two column CSV file. Each line contains the name\n"
+"                         of a source package and how long it takes to\n"
+"                         build in seconds. Instead of printing out an\n"
+"                         ordered list, print a build schedule for the\n"
+"                         number of workers set with `--jobs`. Packages\n"
+"                         missing from the file are assumed to take the\n"
+"                         average time of the listed ones.\n"
+"  --jobs, -j <count>     The number of packages that can be built at the\n"
+"                         same time when printing a schedule. Defaults to 1.\n"
+"  --rebuild-for, -r      The packages on the command line are names of\n"
+"                         changed source packages. Instead of what they\n"
+"                         need, work out the source packages that have to be\n"
+"                         rebuilt because they (indirectly) depend on them.\n"
+"  --ninja, -N            Print a build.ninja file instead, with one target\n"
+"                         per source package that runs the build command\n"
+"                         and touches a stamp file.\n"
+"  --makefile, -M         Same as `--ninja`, but print a Makefile.\n"
+"  --build-command, -c <cmd>  The command for the `--ninja` and `--makefile`\n"
+"                         targets, invoked with the source package name.\n"
+"                         Defaults to `build-package`.\n"
+"  --graph-cache, -G <file>  Store the graph computed from the input files\n"
+"                         in a binary cache file and reuse it, without\n"
+"                         parsing the input files, as long as they remain\n"
+"                         unchanged.\n"
+"\n"
+"A build schedule has one line per source package, ordered by start time,\n"
+"with the worker number, the estimated start and end time and the package\n"
+"name, separated by spaces. Whenever a worker becomes idle, it starts the\n"
+"package with the longest chain of dependent builds. The schedule is\n"
+"followed by the critical path, its length and the predicted total time.\n",
 	.run_cmd = cmd_buildstrategy,
 };
 
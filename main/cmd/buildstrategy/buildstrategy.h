@@ -12,22 +12,32 @@
 #include "command.h"
 #include "util/util.h"
 #include "util/hashtable.h"
+#include "util/input_file.h"
+#include "graph/graph.h"
 
 enum {
 	FLAG_BUILD_PKG = 0x01,
+	FLAG_HAS_DURATION = 0x02,
 };
 
 enum {
 	MODE_BUILD_ORDER = 0,
 	MODE_BUILD_GRAPH,
+	MODE_BUILD_WAVES,
+	MODE_BUILD_SCHEDULE,
+	MODE_BUILD_NINJA,
+	MODE_BUILD_MAKEFILE,
 };
 
 typedef struct source_pkg_t {
 	struct source_pkg_t *next;
 	char *name;
 
-	struct source_pkg_t **depends;
-	size_t num_depends;
+	/* node ID in the build dependency graph */
+	size_t id;
+
+	/* expected build time in seconds, if FLAG_HAS_DURATION is set */
+	unsigned long duration;
 
 	int flags;
 } source_pkg_t;
@@ -38,8 +48,54 @@ void src_pkg_cleanup(void);
 
 source_pkg_t *src_pkg_get(const char *name);
 
+int src_pkg_add_depends(source_pkg_t *pkg, source_pkg_t *dep);
+
+/*
+  Use the packages and the dependency graph of a loaded graph cache instead
+  of parsing the input files. Nothing is copied, the strings and the graph
+  arrays must stay mapped until src_pkg_cleanup.
+ */
+int src_pkg_attach(size_t count, const char *strtab,
+		   const uint64_t *name_offsets, const graph_t *graph);
+
+/* turn the collected dependencies into the graph, after reading the input */
+int src_pkg_build_graph(void);
+
+size_t src_pkg_count(void);
+
+source_pkg_t *src_pkg_by_id(size_t id);
+
+/* only valid after src_pkg_build_graph */
+const graph_t *src_pkg_graph(void);
+
+source_pkg_t *src_pkg_find(const char *name);
+
+/*
+  Flag the given packages for building. In GRAPH_FORWARD direction, also
+  flag everything they need to be built. In GRAPH_REVERSE direction, also
+  flag everything that needs them, i.e. has to be rebuilt if they change.
+ */
+int src_pkg_mark_deps(source_pkg_t **pkgs, size_t count, int direction);
+
 int src_pkg_output_build_order(void);
 
+/*
+  Print one line per dependency level, listing the packages that can be
+  built concurrently once all previous levels are done.
+ */
+int src_pkg_output_build_waves(void);
+
+/*
+  Simulate building the flagged packages on the given number of workers,
+  always starting the ready package with the longest remaining chain of
+  dependent builds first. Prints the worker and start time for every
+  package, the critical path and the predicted total build time.
+ */
+int src_pkg_output_schedule(size_t jobs);
+
+/* print a build.ninja or a Makefile with one target per flagged package */
+int src_pkg_output_build_file(const char *command, bool ninja);
+
 int provider_init(void);
 
 void provider_cleanup(void);
@@ -48,8 +104,31 @@ int provider_add(const char *sourcepkg, const char *binpkg);
 
 int provider_add_prefered(const char *binpkg, const char *sourcepkg);
 
+/* call fun for every binary package that resolves to a source package */
+int provider_foreach(void *usr, int (*fun)(void *usr, const char *binpkg,
+					   source_pkg_t *src));
+
 source_pkg_t *provider_get(const char *parent, const char *binpkg);
 
 void src_pkg_print_graph_cluster(void);
 
+/*
+  The graph cache holds the packages, the dependency graph and the resolved
+  providers computed from a set of input files (provides, depends, prefere;
+  unused ones are NULL). graph_cache_load returns 1 if the cache is valid for
+  the input files and was loaded, 0 if it is missing or stale, or -1 on
+  error.
+ */
+int graph_cache_load(const char *path, const char *const inputs[3]);
+
+int graph_cache_store(const char *path, const char *const inputs[3]);
+
+void graph_cache_close(void);
+
+bool graph_cache_is_loaded(void);
+
+source_pkg_t *graph_cache_find_source(const char *name);
+
+source_pkg_t *graph_cache_find_binary(const char *name);
+
 #endif /* BUILDSTRATEGY_H */
@@ -0,0 +1,574 @@
+/* SPDX-License-Identifier: ISC */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "buildstrategy.h"
+
+#define GRAPH_CACHE_MAGIC "PKGBSGC"
+#define GRAPH_CACHE_VERSION 1
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325UL
+#define FNV_PRIME 0x100000001B3UL
+
+/*
+  The cache file is written in native byte order and word size, it is only
+  meant to be reused on the same machine. After the header, the following
+  arrays are stored back to back:
+
+    uint64_t src_names[num_src]       string table offsets, by package ID
+    uint64_t src_sorted[num_src]      package IDs, sorted by name
+    size_t   offsets[num_src + 1]     the dependency graph, see graph_t
+    size_t   edges[num_edges]
+    size_t   rev_offsets[num_src + 1]
+    size_t   rev_edges[num_edges]
+    uint64_t bin_names[num_bin]       string table offsets, sorted by name
+    uint64_t bin_src[num_bin]         resolved source package IDs
+    char     strtab[strtab_size]      null-terminated names
+
+  Everything can be used directly from the mapping, so loading it only
+  takes a few checks instead of parsing the input files again.
+ */
+typedef struct {
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	uint64_t present;
+} input_stamp_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t word_size;
+
+	input_stamp_t inputs[3];
+
+	uint64_t num_src;
+	uint64_t num_edges;
+	uint64_t num_bin;
+	uint64_t strtab_size;
+} graph_cache_header_t;
+
+static struct {
+	void *map;
+	size_t map_size;
+
+	const graph_cache_header_t *hdr;
+	const uint64_t *src_names;
+	const uint64_t *src_sorted;
+	const uint64_t *bin_names;
+	const uint64_t *bin_src;
+	const char *strtab;
+} cache;
+
+/*****************************************************************************/
+
+static int hash_file(int fd, const char *path, uint64_t *out)
+{
+	uint64_t hash = FNV_OFFSET_BASIS;
+	uint8_t buffer[65536];
+	ssize_t i, ret;
+
+	for (;;) {
+		ret = read_retry(fd, buffer, sizeof(buffer));
+		if (ret < 0) {
+			perror(path);
+			return -1;
+		}
+
+		if (ret == 0)
+			break;
+
+		for (i = 0; i < ret; ++i) {
+			hash ^= buffer[i];
+			hash *= FNV_PRIME;
+		}
+	}
+
+	*out = hash;
+	return 0;
+}
+
+/*
+  Stat an input file and, if with_hash is set, hash its contents. Without a
+  hash, a stamp can only be compared by size and modification time.
+ */
+static int stamp_input(const char *path, input_stamp_t *stamp, bool with_hash)
+{
+	struct stat sb;
+	int fd, ret;
+
+	memset(stamp, 0, sizeof(*stamp));
+	if (path == NULL)
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	stamp->present = 1;
+	stamp->size = sb.st_size;
+	stamp->mtime_sec = sb.st_mtim.tv_sec;
+	stamp->mtime_nsec = sb.st_mtim.tv_nsec;
+
+	ret = with_hash ? hash_file(fd, path, &stamp->hash) : 0;
+	close(fd);
+	return ret;
+}
+
+/* 1 if the input is unchanged, 0 if not, -1 on error */
+static int input_unchanged(const char *path, const input_stamp_t *cached)
+{
+	input_stamp_t now;
+
+	if (stamp_input(path, &now, false))
+		return -1;
+
+	if (now.present != cached->present || now.size != cached->size)
+		return 0;
+
+	if (!now.present || (now.mtime_sec == cached->mtime_sec &&
+			     now.mtime_nsec == cached->mtime_nsec)) {
+		return 1;
+	}
+
+	/* touched, but possibly not modified */
+	if (stamp_input(path, &now, true))
+		return -1;
+
+	return now.hash == cached->hash;
+}
+
+/*****************************************************************************/
+
+static bool check_ids(const uint64_t *ids, size_t count, size_t limit)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (ids[i] >= limit)
+			return false;
+	}
+
+	return true;
+}
+
+static bool check_csr(const size_t *offsets, const size_t *edges,
+		      size_t num_src, size_t num_edges)
+{
+	size_t i;
+
+	if (offsets[0] != 0 || offsets[num_src] != num_edges)
+		return false;
+
+	for (i = 0; i < num_src; ++i) {
+		if (offsets[i] > offsets[i + 1])
+			return false;
+	}
+
+	for (i = 0; i < num_edges; ++i) {
+		if (edges[i] >= num_src)
+			return false;
+	}
+
+	return true;
+}
+
+static bool check_names(const uint64_t *names, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (names[i] >= cache.hdr->strtab_size)
+			return false;
+	}
+
+	return true;
+}
+
+int graph_cache_load(const char *path, const char *const inputs[3])
+{
+	const graph_cache_header_t *hdr;
+	size_t num_src, num_edges, num_bin;
+	uint64_t expect;
+	struct stat sb;
+	const char *ptr;
+	graph_t graph;
+	int i, fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &sb) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		goto out_stale;
+	}
+
+	cache.map_size = sb.st_size;
+	cache.map = mmap(NULL, cache.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (cache.map == MAP_FAILED) {
+		perror(path);
+		cache.map = NULL;
+		return -1;
+	}
+
+	hdr = cache.hdr = cache.map;
+
+	if (memcmp(hdr->magic, GRAPH_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != GRAPH_CACHE_VERSION ||
+	    hdr->word_size != sizeof(size_t)) {
+		goto out_stale;
+	}
+
+	for (i = 0; i < 3; ++i) {
+		ret = input_unchanged(inputs[i], hdr->inputs + i);
+		if (ret < 0) {
+			graph_cache_close();
+			return -1;
+		}
+		if (ret == 0)
+			goto out_stale;
+	}
+
+	/* the counts are checked against the file size before anything else */
+	if (hdr->num_src > cache.map_size || hdr->num_edges > cache.map_size ||
+	    hdr->num_bin > cache.map_size ||
+	    hdr->strtab_size > cache.map_size) {
+		goto out_corrupt;
+	}
+
+	num_src = hdr->num_src;
+	num_edges = hdr->num_edges;
+	num_bin = hdr->num_bin;
+
+	expect = sizeof(*hdr) + 2 * num_src * sizeof(uint64_t) +
+		2 * (num_src + 1 + num_edges) * sizeof(size_t) +
+		2 * num_bin * sizeof(uint64_t) + hdr->strtab_size;
+
+	if (expect != cache.map_size || hdr->strtab_size == 0)
+		goto out_corrupt;
+
+	ptr = (const char *)cache.map + sizeof(*hdr);
+
+	cache.src_names = (const uint64_t *)ptr;
+	ptr += num_src * sizeof(uint64_t);
+	cache.src_sorted = (const uint64_t *)ptr;
+	ptr += num_src * sizeof(uint64_t);
+
+	memset(&graph, 0, sizeof(graph));
+	graph.num_nodes = num_src;
+	graph.num_edges = num_edges;
+	graph.offsets = (size_t *)ptr;
+	ptr += (num_src + 1) * sizeof(size_t);
+	graph.edges = (size_t *)ptr;
+	ptr += num_edges * sizeof(size_t);
+	graph.rev_offsets = (size_t *)ptr;
+	ptr += (num_src + 1) * sizeof(size_t);
+	graph.rev_edges = (size_t *)ptr;
+	ptr += num_edges * sizeof(size_t);
+
+	cache.bin_names = (const uint64_t *)ptr;
+	ptr += num_bin * sizeof(uint64_t);
+	cache.bin_src = (const uint64_t *)ptr;
+	ptr += num_bin * sizeof(uint64_t);
+	cache.strtab = ptr;
+
+	if (cache.strtab[hdr->strtab_size - 1] != '\0' ||
+	    !check_names(cache.src_names, num_src) ||
+	    !check_names(cache.bin_names, num_bin) ||
+	    !check_ids(cache.src_sorted, num_src, num_src) ||
+	    !check_ids(cache.bin_src, num_bin, num_src) ||
+	    !check_csr(graph.offsets, graph.edges, num_src, num_edges) ||
+	    !check_csr(graph.rev_offsets, graph.rev_edges,
+		       num_src, num_edges)) {
+		goto out_corrupt;
+	}
+
+	if (src_pkg_attach(num_src, cache.strtab, cache.src_names, &graph)) {
+		graph_cache_close();
+		return -1;
+	}
+
+	return 1;
+out_corrupt:
+	fprintf(stderr, "%s: graph cache is corrupted, ignoring it\n", path);
+out_stale:
+	graph_cache_close();
+	return 0;
+}
+
+void graph_cache_close(void)
+{
+	if (cache.map != NULL)
+		munmap(cache.map, cache.map_size);
+
+	memset(&cache, 0, sizeof(cache));
+}
+
+bool graph_cache_is_loaded(void)
+{
+	return cache.map != NULL;
+}
+
+static const char *cache_name(const uint64_t *names, size_t i)
+{
+	return cache.strtab + names[i];
+}
+
+source_pkg_t *graph_cache_find_source(const char *name)
+{
+	size_t lo = 0, hi = cache.hdr->num_src, mid;
+	uint64_t id;
+	int ret;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		id = cache.src_sorted[mid];
+		ret = strcmp(name, cache_name(cache.src_names, id));
+
+		if (ret == 0)
+			return src_pkg_by_id(id);
+
+		if (ret < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+source_pkg_t *graph_cache_find_binary(const char *name)
+{
+	size_t lo = 0, hi = cache.hdr->num_bin, mid;
+	int ret;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		ret = strcmp(name, cache_name(cache.bin_names, mid));
+
+		if (ret == 0)
+			return src_pkg_by_id(cache.bin_src[mid]);
+
+		if (ret < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+
+typedef struct {
+	const char *name;
+	uint64_t value;
+} name_entry_t;
+
+typedef struct {
+	name_entry_t *bins;
+	size_t num_bins;
+	size_t max_bins;
+} store_ctx_t;
+
+static int add_binary(void *usr, const char *binpkg, source_pkg_t *src)
+{
+	store_ctx_t *ctx = usr;
+	size_t new_max;
+	void *new;
+
+	if (ctx->num_bins == ctx->max_bins) {
+		new_max = ctx->max_bins ? ctx->max_bins * 2 : 1024;
+
+		new = realloc(ctx->bins, new_max * sizeof(ctx->bins[0]));
+		if (new == NULL) {
+			fputs("out of memory\n", stderr);
+			return -1;
+		}
+
+		ctx->bins = new;
+		ctx->max_bins = new_max;
+	}
+
+	ctx->bins[ctx->num_bins].name = binpkg;
+	ctx->bins[ctx->num_bins].value = src->id;
+	ctx->num_bins += 1;
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const name_entry_t *lhs = a, *rhs = b;
+
+	return strcmp(lhs->name, rhs->name);
+}
+
+static int write_array(int fd, const void *data, size_t size)
+{
+	ssize_t ret = write_retry(fd, (void *)data, size);
+
+	return (ret < 0 || (size_t)ret < size) ? -1 : 0;
+}
+
+/* append a name to the string table, returning its offset */
+static int write_name(int fd, const char *name, uint64_t *offset)
+{
+	size_t len = strlen(name) + 1;
+
+	if (write_array(fd, name, len))
+		return -1;
+
+	*offset += len;
+	return 0;
+}
+
+int graph_cache_store(const char *path, const char *const inputs[3])
+{
+	size_t i, num_src = src_pkg_count();
+	const graph_t *graph = src_pkg_graph();
+	uint64_t *names = NULL, *ids = NULL;
+	name_entry_t *sorted = NULL;
+	graph_cache_header_t hdr;
+	char *temp = NULL;
+	store_ctx_t ctx;
+	uint64_t offset;
+	int fd = -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, GRAPH_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = GRAPH_CACHE_VERSION;
+	hdr.word_size = sizeof(size_t);
+
+	for (i = 0; i < 3; ++i) {
+		if (stamp_input(inputs[i], hdr.inputs + i, true))
+			return -1;
+	}
+
+	if (provider_foreach(&ctx, add_binary))
+		goto fail;
+
+	names = calloc(num_src + ctx.num_bins + 1, sizeof(names[0]));
+	ids = calloc(num_src + ctx.num_bins + 1, sizeof(ids[0]));
+	sorted = calloc(num_src + 1, sizeof(sorted[0]));
+	temp = malloc(strlen(path) + 32);
+
+	if (names == NULL || ids == NULL || sorted == NULL || temp == NULL) {
+		fputs("out of memory\n", stderr);
+		goto fail;
+	}
+
+	/* string table layout: source names by ID, then binary names */
+	offset = 0;
+	for (i = 0; i < num_src; ++i) {
+		names[i] = offset;
+		offset += strlen(src_pkg_by_id(i)->name) + 1;
+
+		sorted[i].name = src_pkg_by_id(i)->name;
+		sorted[i].value = i;
+	}
+
+	qsort(sorted, num_src, sizeof(sorted[0]), compare_entries);
+	qsort(ctx.bins, ctx.num_bins, sizeof(ctx.bins[0]), compare_entries);
+
+	for (i = 0; i < num_src; ++i)
+		ids[i] = sorted[i].value;
+
+	for (i = 0; i < ctx.num_bins; ++i) {
+		names[num_src + i] = offset;
+		ids[num_src + i] = ctx.bins[i].value;
+		offset += strlen(ctx.bins[i].name) + 1;
+	}
+
+	hdr.num_src = num_src;
+	hdr.num_edges = graph->num_edges;
+	hdr.num_bin = ctx.num_bins;
+	hdr.strtab_size = offset ? offset : 1;
+
+	sprintf(temp, "%s.%ld", path, (long)getpid());
+
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(temp);
+		goto fail;
+	}
+
+	if (write_array(fd, &hdr, sizeof(hdr)) ||
+	    write_array(fd, names, num_src * sizeof(names[0])) ||
+	    write_array(fd, ids, num_src * sizeof(ids[0])) ||
+	    write_array(fd, graph->offsets, (num_src + 1) * sizeof(size_t)) ||
+	    write_array(fd, graph->edges, graph->num_edges * sizeof(size_t)) ||
+	    write_array(fd, graph->rev_offsets,
+			(num_src + 1) * sizeof(size_t)) ||
+	    write_array(fd, graph->rev_edges,
+			graph->num_edges * sizeof(size_t)) ||
+	    write_array(fd, names + num_src,
+			ctx.num_bins * sizeof(names[0])) ||
+	    write_array(fd, ids + num_src, ctx.num_bins * sizeof(ids[0]))) {
+		goto fail_write;
+	}
+
+	offset = 0;
+	for (i = 0; i < num_src; ++i) {
+		if (write_name(fd, src_pkg_by_id(i)->name, &offset))
+			goto fail_write;
+	}
+
+	for (i = 0; i < ctx.num_bins; ++i) {
+		if (write_name(fd, ctx.bins[i].name, &offset))
+			goto fail_write;
+	}
+
+	if (offset == 0 && write_array(fd, "", 1))
+		goto fail_write;
+
+	if (close(fd) != 0) {
+		fd = -1;
+		goto fail_write;
+	}
+	fd = -1;
+
+	if (rename(temp, path) != 0) {
+		perror(path);
+		goto fail_unlink;
+	}
+
+	free(temp);
+	free(sorted);
+	free(ids);
+	free(names);
+	free(ctx.bins);
+	return 0;
+fail_write:
+	perror(temp);
+fail_unlink:
+	if (fd >= 0)
+		close(fd);
+	unlink(temp);
+fail:
+	free(temp);
+	free(sorted);
+	free(ids);
+	free(names);
+	free(ctx.bins);
+	return -1;
+}
@@ -50,9 +50,60 @@ int provider_add_prefered(const char *binpkg, const char *sourcepkg)
 	return hash_table_set(&tbl_preferes, binpkg, src);
 }
 
+/* pick a provider from the list, taking the preferred one into account */
+static source_pkg_t *resolve(source_pkg_t *spkg, source_pkg_t *pref)
+{
+	if (spkg->next == NULL)
+		return (pref == NULL || strcmp(spkg->name, pref->name) == 0) ?
+			spkg : NULL;
+
+	if (pref == NULL)
+		return NULL;
+
+	while (spkg != NULL && strcmp(spkg->name, pref->name) != 0)
+		spkg = spkg->next;
+
+	return spkg;
+}
+
+struct foreach_ctx {
+	void *usr;
+	int (*fun)(void *usr, const char *binpkg, source_pkg_t *src);
+	int ret;
+};
+
+static int foreach_cb(void *usr, const char *binpkg, void *p)
+{
+	struct foreach_ctx *ctx = usr;
+	source_pkg_t *src;
+
+	src = resolve(p, hash_table_lookup(&tbl_preferes, binpkg));
+
+	if (src != NULL && ctx->ret == 0)
+		ctx->ret = ctx->fun(ctx->usr, binpkg, src);
+
+	return 0;
+}
+
+int provider_foreach(void *usr, int (*fun)(void *usr, const char *binpkg,
+					   source_pkg_t *src))
+{
+	struct foreach_ctx ctx = { usr, fun, 0 };
+
+	hash_table_foreach(&tbl_provides, &ctx, foreach_cb);
+	return ctx.ret;
+}
+
 source_pkg_t *provider_get(const char *parent, const char *binpkg)
 {
-	source_pkg_t *spkg, *pref;
+	source_pkg_t *spkg, *pref, *src;
+
+	if (graph_cache_is_loaded()) {
+		spkg = graph_cache_find_binary(binpkg);
+		if (spkg == NULL)
+			goto fail_cached;
+		return spkg;
+	}
 
 	spkg = hash_table_lookup(&tbl_provides, binpkg);
 	if (spkg == NULL)
@@ -60,28 +111,22 @@ source_pkg_t *provider_get(const char *parent, const char *binpkg)
 
 	pref = hash_table_lookup(&tbl_preferes, binpkg);
 
-	if (spkg->next != NULL) {
-		if (pref == NULL)
-			goto fail_no_pref;
-
-		while (spkg != NULL && strcmp(spkg->name, pref->name) != 0) {
-			spkg = spkg->next;
-		}
-
-		if (spkg == NULL) {
-			spkg = hash_table_lookup(&tbl_provides, binpkg);
-			goto fail_provider;
-		}
-	} else {
-		if (pref != NULL && strcmp(spkg->name, pref->name) != 0)
-			goto fail_provider;
-	}
+	src = resolve(spkg, pref);
+	if (src != NULL)
+		return src;
 
-	return spkg;
+	if (pref == NULL)
+		goto fail_no_pref;
+
+	goto fail_provider;
 fail_none:
 	fprintf(stderr, "No source package provides binary package '%s'.\n\n",
 		binpkg);
 	goto fail;
+fail_cached:
+	fprintf(stderr, "No source package provides binary package '%s', or\n"
+		"no preferred provider is set for it.\n\n", binpkg);
+	goto fail;
 fail_provider:
 	fprintf(stderr,
 		"Preferred provider for binary package '%s' is set to\n"
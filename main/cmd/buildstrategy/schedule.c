@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: ISC */
+#include <stdint.h>
+
+#include "buildstrategy.h"
+
+/*
+  Critical path first list scheduling: the priority of a package is its own
+  duration plus the longest chain of builds that depend on it. Whenever a
+  worker is idle, it picks the ready package with the highest priority. The
+  build is simulated event by event, advancing the clock to the next time a
+  running build finishes.
+ */
+typedef struct {
+	size_t *items;
+	size_t count;
+
+	/* ordering of the items, returns true if a goes first */
+	bool (*before)(const void *ctx, size_t a, size_t b);
+	const void *ctx;
+} heap_t;
+
+typedef struct {
+	unsigned long *prio;
+	unsigned long *finish;
+	size_t *slot;
+} sched_state_t;
+
+static bool ready_before(const void *ctx, size_t a, size_t b)
+{
+	const sched_state_t *st = ctx;
+
+	if (st->prio[a] != st->prio[b])
+		return st->prio[a] > st->prio[b];
+
+	return a < b;
+}
+
+static bool running_before(const void *ctx, size_t a, size_t b)
+{
+	const sched_state_t *st = ctx;
+
+	if (st->finish[a] != st->finish[b])
+		return st->finish[a] < st->finish[b];
+
+	return st->slot[a] < st->slot[b];
+}
+
+static void heap_push(heap_t *heap, size_t item)
+{
+	size_t i = heap->count++, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+
+		if (!heap->before(heap->ctx, item, heap->items[parent]))
+			break;
+
+		heap->items[i] = heap->items[parent];
+		i = parent;
+	}
+
+	heap->items[i] = item;
+}
+
+static size_t heap_pop(heap_t *heap)
+{
+	size_t top = heap->items[0], last, i = 0, child;
+
+	last = heap->items[--heap->count];
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap->count)
+			break;
+
+		if (child + 1 < heap->count &&
+		    heap->before(heap->ctx, heap->items[child + 1],
+				 heap->items[child])) {
+			child += 1;
+		}
+
+		if (!heap->before(heap->ctx, heap->items[child], last))
+			break;
+
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+
+	heap->items[i] = last;
+	return top;
+}
+
+static unsigned long default_duration(const bool *mask, size_t count)
+{
+	unsigned long sum = 0, num = 0;
+	source_pkg_t *pkg;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		pkg = src_pkg_by_id(i);
+
+		if (mask[i] && (pkg->flags & FLAG_HAS_DURATION)) {
+			sum += pkg->duration;
+			num += 1;
+		}
+	}
+
+	return num > 0 ? (sum + num / 2) / num : 1;
+}
+
+static void print_critical_path(const sched_state_t *st, const size_t *order,
+				size_t total, const size_t *next)
+{
+	size_t i, node, start;
+
+	if (total == 0)
+		return;
+
+	start = order[0];
+
+	for (i = 1; i < total; ++i) {
+		if (st->prio[order[i]] > st->prio[start])
+			start = order[i];
+	}
+
+	printf("critical path:");
+
+	for (node = start; node != SIZE_MAX; node = next[node])
+		printf(" %s", src_pkg_by_id(node)->name);
+
+	printf("\ncritical path length: %lu\n", st->prio[start]);
+}
+
+int src_pkg_output_schedule(size_t jobs)
+{
+	size_t i, j, node, dep, total, n = src_pkg_count();
+	size_t *order = NULL, *next = NULL, *pending = NULL;
+	size_t *free_slots = NULL, num_free;
+	unsigned long *duration = NULL, now = 0, fallback;
+	const graph_t *graph = src_pkg_graph();
+	heap_t ready, running;
+	sched_state_t st;
+	bool *mask = NULL;
+	int ret = -1;
+
+	memset(&st, 0, sizeof(st));
+	memset(&ready, 0, sizeof(ready));
+	memset(&running, 0, sizeof(running));
+
+	if (n == 0)
+		return 0;
+
+	if (jobs > n)
+		jobs = n;
+
+	mask = calloc(n, sizeof(mask[0]));
+	order = calloc(n, sizeof(order[0]));
+	next = calloc(n, sizeof(next[0]));
+	pending = calloc(n, sizeof(pending[0]));
+	duration = calloc(n, sizeof(duration[0]));
+	st.prio = calloc(n, sizeof(st.prio[0]));
+	st.finish = calloc(n, sizeof(st.finish[0]));
+	st.slot = calloc(n, sizeof(st.slot[0]));
+	ready.items = calloc(n, sizeof(ready.items[0]));
+	running.items = calloc(jobs, sizeof(running.items[0]));
+	free_slots = calloc(jobs, sizeof(free_slots[0]));
+
+	if (mask == NULL || order == NULL || next == NULL || pending == NULL ||
+	    duration == NULL || st.prio == NULL || st.finish == NULL ||
+	    st.slot == NULL || ready.items == NULL || running.items == NULL ||
+	    free_slots == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	for (i = 0; i < n; ++i)
+		mask[i] = (src_pkg_by_id(i)->flags & FLAG_BUILD_PKG) != 0;
+
+	if (graph_topo_sort(graph, mask, order, &total, NULL))
+		goto out;
+
+	fallback = default_duration(mask, n);
+
+	for (i = 0; i < total; ++i) {
+		node = order[i];
+
+		if (src_pkg_by_id(node)->flags & FLAG_HAS_DURATION) {
+			duration[node] = src_pkg_by_id(node)->duration;
+		} else {
+			duration[node] = fallback;
+		}
+	}
+
+	/* priorities, walking from the last level back to the first */
+	for (i = total; i-- > 0; ) {
+		node = order[i];
+		next[node] = SIZE_MAX;
+
+		for (j = graph->rev_offsets[node];
+		     j < graph->rev_offsets[node + 1]; ++j) {
+			dep = graph->rev_edges[j];
+
+			if (!mask[dep])
+				continue;
+
+			if (next[node] == SIZE_MAX ||
+			    st.prio[dep] > st.prio[next[node]]) {
+				next[node] = dep;
+			}
+		}
+
+		st.prio[node] = duration[node];
+		if (next[node] != SIZE_MAX)
+			st.prio[node] += st.prio[next[node]];
+	}
+
+	/* simulate the build */
+	ready.before = ready_before;
+	ready.ctx = &st;
+	running.before = running_before;
+	running.ctx = &st;
+
+	for (i = 0; i < jobs; ++i)
+		free_slots[i] = jobs - 1 - i;
+	num_free = jobs;
+
+	for (i = 0; i < total; ++i) {
+		node = order[i];
+
+		for (j = graph->offsets[node];
+		     j < graph->offsets[node + 1]; ++j) {
+			if (mask[graph->edges[j]])
+				pending[node] += 1;
+		}
+
+		if (pending[node] == 0)
+			heap_push(&ready, node);
+	}
+
+	for (;;) {
+		while (num_free > 0 && ready.count > 0) {
+			node = heap_pop(&ready);
+
+			st.slot[node] = free_slots[--num_free];
+			st.finish[node] = now + duration[node];
+			heap_push(&running, node);
+
+			printf("%lu %lu %lu %s\n", (unsigned long)st.slot[node],
+			       now, st.finish[node], src_pkg_by_id(node)->name);
+		}
+
+		if (running.count == 0)
+			break;
+
+		now = st.finish[running.items[0]];
+
+		while (running.count > 0 &&
+		       st.finish[running.items[0]] == now) {
+			node = heap_pop(&running);
+			free_slots[num_free++] = st.slot[node];
+
+			for (j = graph->rev_offsets[node];
+			     j < graph->rev_offsets[node + 1]; ++j) {
+				dep = graph->rev_edges[j];
+
+				if (mask[dep] && --pending[dep] == 0)
+					heap_push(&ready, dep);
+			}
+		}
+	}
+
+	print_critical_path(&st, order, total, next);
+	printf("total build time: %lu\n", now);
+	ret = 0;
+out:
+	free(free_slots);
+	free(running.items);
+	free(ready.items);
+	free(st.slot);
+	free(st.finish);
+	free(st.prio);
+	free(duration);
+	free(pending);
+	free(next);
+	free(order);
+	free(mask);
+	return ret;
+}
@@ -3,33 +3,68 @@
 
 static hash_table_t tbl_sourcepkgs;
 
-static int src_pkg_destroy(void *usr, const char *name, void *p)
-{
-	source_pkg_t *pkg = p;
-	(void)name; (void)usr;
+/* source packages by node ID and the build dependency edges between them */
+static source_pkg_t **pkg_by_id;
+static size_t num_pkgs;
+static size_t max_pkgs;
 
-	free(pkg->name);
-	free(pkg->depends);
-	free(pkg);
-	return 1;
-}
+static graph_builder_t dep_edges;
+static graph_t dep_graph;
+
+/* set if the packages and the graph come from a graph cache */
+static source_pkg_t *pkg_pool;
 
 int src_pkg_init(void)
 {
-	return hash_table_init(&tbl_sourcepkgs, 1024);
+	graph_builder_init(&dep_edges);
+	/* the keys are the names stored in the packages themselves */
+	return hash_table_init_flags(&tbl_sourcepkgs, 1024,
+				     HASH_TABLE_BORROW_KEYS);
 }
 
 void src_pkg_cleanup(void)
 {
-	hash_table_foreach(&tbl_sourcepkgs, NULL, src_pkg_destroy);
+	size_t i;
+
+	if (pkg_pool != NULL) {
+		free(pkg_pool);
+		pkg_pool = NULL;
+		memset(&dep_graph, 0, sizeof(dep_graph));
+	} else {
+		for (i = 0; i < num_pkgs; ++i) {
+			free(pkg_by_id[i]->name);
+			free(pkg_by_id[i]);
+		}
+
+		graph_cleanup(&dep_graph);
+	}
+
+	free(pkg_by_id);
+	pkg_by_id = NULL;
+	num_pkgs = max_pkgs = 0;
+
+	graph_builder_cleanup(&dep_edges);
 	hash_table_cleanup(&tbl_sourcepkgs);
 }
 
 source_pkg_t *src_pkg_get(const char *name)
 {
 	source_pkg_t *src = hash_table_lookup(&tbl_sourcepkgs, name);
+	size_t new_max;
+	void *new;
 
 	if (src == NULL) {
+		if (num_pkgs == max_pkgs) {
+			new_max = max_pkgs ? max_pkgs * 2 : 1024;
+
+			new = realloc(pkg_by_id, new_max * sizeof(pkg_by_id[0]));
+			if (new == NULL)
+				goto fail_oom;
+
+			pkg_by_id = new;
+			max_pkgs = new_max;
+		}
+
 		src = calloc(1, sizeof(*src));
 		if (src == NULL)
 			goto fail_oom;
@@ -38,8 +73,11 @@ source_pkg_t *src_pkg_get(const char *name)
 		if (src->name == NULL)
 			goto fail_oom;
 
-		if (hash_table_set(&tbl_sourcepkgs, name, src))
+		if (hash_table_set(&tbl_sourcepkgs, src->name, src))
 			goto fail;
+
+		src->id = num_pkgs;
+		pkg_by_id[num_pkgs++] = src;
 	}
 	return src;
 fail_oom:
@@ -51,95 +89,169 @@ fail:
 	return NULL;
 }
 
-static int remove_untagged(void *usr, const char *name, void *p)
+source_pkg_t *src_pkg_find(const char *name)
 {
-	int mask = *((int *)usr);
-	source_pkg_t *pkg = p;
-	(void)name;
-
-	if ((pkg->flags & mask) == 0) {
-		free(pkg->name);
-		free(pkg->depends);
-		free(pkg);
-		return 1;
-	}
+	if (pkg_pool != NULL)
+		return graph_cache_find_source(name);
 
-	return 0;
+	return hash_table_lookup(&tbl_sourcepkgs, name);
 }
 
-static int find_no_dep(void *usr, const char *name, void *p)
+int src_pkg_attach(size_t count, const char *strtab,
+		   const uint64_t *name_offsets, const graph_t *graph)
 {
-	source_pkg_t *pkg = p;
-	int *found = usr;
+	size_t i;
+
+	pkg_pool = calloc(count ? count : 1, sizeof(pkg_pool[0]));
+	pkg_by_id = calloc(count ? count : 1, sizeof(pkg_by_id[0]));
+
+	if (pkg_pool == NULL || pkg_by_id == NULL) {
+		fputs("out of memory\n", stderr);
+		free(pkg_pool);
+		free(pkg_by_id);
+		pkg_pool = NULL;
+		pkg_by_id = NULL;
+		return -1;
+	}
 
-	if (pkg->num_depends == 0) {
-		printf("%s\n", name);
-		pkg->flags &= ~FLAG_BUILD_PKG;
-		*found = 1;
+	for (i = 0; i < count; ++i) {
+		pkg_pool[i].name = (char *)strtab + name_offsets[i];
+		pkg_pool[i].id = i;
+		pkg_by_id[i] = pkg_pool + i;
 	}
 
+	num_pkgs = max_pkgs = count;
+	dep_graph = *graph;
 	return 0;
 }
 
-static int remove_unmarked_deps(void *usr, const char *name, void *p)
+int src_pkg_build_graph(void)
 {
-	source_pkg_t *pkg = p;
-	size_t i = 0;
-	(void)usr; (void)name;
-
-	while (i < pkg->num_depends) {
-		if ((pkg->depends[i]->flags & FLAG_BUILD_PKG) == 0) {
-			pkg->depends[i] = pkg->depends[pkg->num_depends - 1];
-			pkg->num_depends -= 1;
-		} else {
-			++i;
-		}
-	}
+	if (pkg_pool != NULL)
+		return 0;
 
-	return 0;
+	return graph_build(&dep_graph, &dep_edges, num_pkgs);
 }
 
-int src_pkg_output_build_order(void)
+int src_pkg_add_depends(source_pkg_t *pkg, source_pkg_t *dep)
+{
+	return graph_builder_add_edge(&dep_edges, pkg->id, dep->id);
+}
+
+size_t src_pkg_count(void)
 {
-	int i = FLAG_BUILD_PKG;
+	return num_pkgs;
+}
 
-	hash_table_foreach(&tbl_sourcepkgs, &i, remove_untagged);
+source_pkg_t *src_pkg_by_id(size_t id)
+{
+	return pkg_by_id[id];
+}
 
-	while (tbl_sourcepkgs.count > 0) {
-		i = 0;
-		hash_table_foreach(&tbl_sourcepkgs, &i, find_no_dep);
-		if (!i) {
-			fputs("cycle detected in package dependencies!\n",
-			      stderr);
-			return -1;
-		}
+const graph_t *src_pkg_graph(void)
+{
+	return &dep_graph;
+}
 
-		hash_table_foreach(&tbl_sourcepkgs, NULL, remove_unmarked_deps);
+int src_pkg_mark_deps(source_pkg_t **pkgs, size_t count, int direction)
+{
+	size_t i, *roots = NULL;
+	bool *marked = NULL;
+	int ret = -1;
 
-		i = FLAG_BUILD_PKG;
-		hash_table_foreach(&tbl_sourcepkgs, &i, remove_untagged);
+	roots = calloc(count ? count : 1, sizeof(roots[0]));
+	marked = calloc(num_pkgs ? num_pkgs : 1, sizeof(marked[0]));
+
+	if (roots == NULL || marked == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
 	}
 
-	return 0;
+	for (i = 0; i < count; ++i)
+		roots[i] = pkgs[i]->id;
+
+	if (graph_closure(&dep_graph, roots, count, direction, marked))
+		goto out;
+
+	for (i = 0; i < num_pkgs; ++i) {
+		if (marked[i])
+			pkg_by_id[i]->flags |= FLAG_BUILD_PKG;
+	}
+
+	ret = 0;
+out:
+	free(marked);
+	free(roots);
+	return ret;
 }
 
-static int print_cluster(void *usr, const char *name, void *p)
+static int output_sorted(bool waves)
 {
-	source_pkg_t *pkg = p;
-	size_t i;
-	(void)usr;
+	size_t i, count, *order = NULL, *levels = NULL;
+	bool *mask = NULL;
+	int ret = -1;
 
-	if (!(pkg->flags & FLAG_BUILD_PKG))
-		return 0;
+	order = calloc(num_pkgs ? num_pkgs : 1, sizeof(order[0]));
+	levels = calloc(num_pkgs ? num_pkgs : 1, sizeof(levels[0]));
+	mask = calloc(num_pkgs ? num_pkgs : 1, sizeof(mask[0]));
 
-	for (i = 0; i < pkg->num_depends; ++i) {
-		printf("\t\"%s\" -> \"%s\"\n",
-		       name, pkg->depends[i]->name);
+	if (order == NULL || levels == NULL || mask == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
 	}
-	return 0;
+
+	for (i = 0; i < num_pkgs; ++i)
+		mask[i] = (pkg_by_id[i]->flags & FLAG_BUILD_PKG) != 0;
+
+	if (graph_topo_sort(&dep_graph, mask, order, &count, levels))
+		goto out;
+
+	for (i = 0; i < count; ++i) {
+		if (!waves) {
+			printf("%s\n", pkg_by_id[order[i]]->name);
+			continue;
+		}
+
+		if (i == 0 || levels[order[i - 1]] != levels[order[i]]) {
+			printf("%s%lu:", i == 0 ? "" : "\n",
+			       (unsigned long)levels[order[i]]);
+		}
+
+		printf(" %s", pkg_by_id[order[i]]->name);
+	}
+
+	if (waves && count > 0)
+		fputc('\n', stdout);
+
+	ret = 0;
+out:
+	free(mask);
+	free(levels);
+	free(order);
+	return ret;
+}
+
+int src_pkg_output_build_order(void)
+{
+	return output_sorted(false);
+}
+
+int src_pkg_output_build_waves(void)
+{
+	return output_sorted(true);
 }
 
 void src_pkg_print_graph_cluster(void)
 {
-	hash_table_foreach(&tbl_sourcepkgs, NULL, print_cluster);
+	size_t i, j;
+
+	for (i = 0; i < num_pkgs; ++i) {
+		if (!(pkg_by_id[i]->flags & FLAG_BUILD_PKG))
+			continue;
+
+		for (j = dep_graph.offsets[i]; j < dep_graph.offsets[i + 1]; ++j) {
+			printf("\t\"%s\" -> \"%s\"\n", pkg_by_id[i]->name,
+			       pkg_by_id[dep_graph.edges[j]]->name);
+		}
+	}
 }
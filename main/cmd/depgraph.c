@@ -21,15 +21,17 @@ static const char *short_opts = "dR:";
 
 static void print_dot_graph(struct pkg_dep_list *list)
 {
+	const graph_t *graph = &list->graph;
 	struct pkg_dep_node *it;
 	size_t i;
 
 	printf("digraph dependencies {\n");
 
 	for (it = list->head; it != NULL; it = it->next) {
-		for (i = 0; i < it->num_deps; ++i) {
+		for (i = graph->offsets[it->id];
+		     i < graph->offsets[it->id + 1]; ++i) {
 			printf("\t\"%s\" -> \"%s\";\n",
-			       it->name, it->deps[i]->name);
+			       it->name, list->nodes[graph->edges[i]]->name);
 		}
 	}
 
@@ -90,6 +92,9 @@ static int cmd_depgraph(int argc, char **argv)
 			goto out;
 	}
 
+	if (pkg_list_build_graph(&list))
+		goto out;
+
 	print_dot_graph(&list);
 	ret = EXIT_SUCCESS;
 out:
@@ -16,7 +16,10 @@
 enum {
 	INSTALL_MODE_INSTALL = 0,
 	INSTALL_MODE_LIST_PKG,
+	INSTALL_MODE_LIST_LEVELS,
 	INSTALL_MODE_LIST_FILES,
+	INSTALL_MODE_CPIO,
+	INSTALL_MODE_SQFS,
 };
 
 static const struct option long_opts[] = {
@@ -26,34 +29,360 @@ static const struct option long_opts[] = {
 	{ "no-dependencies", no_argument, NULL, 'd' },
 	{ "repo-dir", required_argument, NULL, 'R' },
 	{ "list-packages", no_argument, NULL, 'p' },
+	{ "list-levels", no_argument, NULL, 'P' },
 	{ "list-files", required_argument, NULL, 'l' },
 	{ "no-symlinks", no_argument, NULL, 'L' },
 	{ "no-devices", no_argument, NULL, 'D' },
+	{ "sync", required_argument, NULL, 's' },
+	{ "output-cpio", required_argument, NULL, 'c' },
+	{ "compressor", required_argument, NULL, 'z' },
+	{ "output-squashfs", required_argument, NULL, 'S' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "hardlink", no_argument, NULL, 'H' },
+	{ "cache-dir", required_argument, NULL, 'C' },
+	{ "cache-size", required_argument, NULL, 'M' },
 	{ NULL, 0, NULL, 0 },
 };
 
-static const char *short_opts = "r:omdR:pl:F:LD";
+static const char *short_opts = "r:omdR:pPl:F:LDs:c:z:S:j:HC:M:";
 
-static int unpack_packages(int repofd, int rootfd, int flags,
-			   struct pkg_dep_list *list)
+typedef struct install_root_t {
+	struct install_root_t *next;
+
+	char *path;
+	int fd;
+
+	/* packages requested only for this root via --root <path>=<list> */
+	struct pkg_dep_list request;
+
+	/* all packages that end up in this root, including dependencies */
+	struct pkg_dep_list packages;
+} install_root_t;
+
+static void free_roots(install_root_t *list)
+{
+	install_root_t *root;
+
+	while (list != NULL) {
+		root = list;
+		list = list->next;
+
+		if (root->fd != -1)
+			close(root->fd);
+
+		pkg_list_cleanup(&root->request);
+		pkg_list_cleanup(&root->packages);
+		free(root->path);
+		free(root);
+	}
+}
+
+static install_root_t *add_root(install_root_t **list, const char *arg,
+				bool create)
+{
+	const char *sep = strchr(arg, '=');
+	install_root_t *root, *it;
+	char *names, *name;
+
+	root = calloc(1, sizeof(*root));
+	if (root == NULL)
+		goto fail_oom;
+
+	root->fd = -1;
+
+	if (sep == NULL) {
+		root->path = strdup(arg);
+	} else {
+		root->path = strndup(arg, sep - arg);
+	}
+
+	if (root->path == NULL)
+		goto fail_oom;
+
+	if (sep != NULL) {
+		names = strdup(sep + 1);
+		if (names == NULL)
+			goto fail_oom;
+
+		for (name = strtok(names, ","); name != NULL;
+		     name = strtok(NULL, ",")) {
+			if (append_pkg(&root->request, name) == NULL) {
+				free(names);
+				goto fail;
+			}
+		}
+
+		free(names);
+	}
+
+	if (create && mkdir_p(root->path))
+		goto fail;
+
+	root->fd = open(root->path, O_RDONLY | O_DIRECTORY);
+	if (root->fd < 0) {
+		perror(root->path);
+		goto fail;
+	}
+
+	if (*list == NULL) {
+		*list = root;
+	} else {
+		for (it = *list; it->next != NULL; it = it->next)
+			;
+		it->next = root;
+	}
+
+	return root;
+fail_oom:
+	fputs("out of memory\n", stderr);
+fail:
+	free_roots(root);
+	return NULL;
+}
+
+static int append_unique(struct pkg_dep_list *list, const char *name)
+{
+	if (find_pkg(list, name) != NULL)
+		return 0;
+
+	return append_pkg(list, name) == NULL ? -1 : 0;
+}
+
+static int add_closure(struct pkg_dep_list *list, struct pkg_dep_list *common,
+		       install_root_t *root)
+{
+	size_t num_roots = 0, *ids = NULL;
+	struct pkg_dep_node *it;
+	bool *marked = NULL;
+	int ret = -1;
+
+	ids = calloc(common->count + root->request.count + 1, sizeof(ids[0]));
+	marked = calloc(list->count ? list->count : 1, sizeof(marked[0]));
+
+	if (ids == NULL || marked == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	for (it = common->head; it != NULL; it = it->next)
+		ids[num_roots++] = find_pkg(list, it->name)->id;
+
+	for (it = root->request.head; it != NULL; it = it->next)
+		ids[num_roots++] = find_pkg(list, it->name)->id;
+
+	if (graph_closure(&list->graph, ids, num_roots, GRAPH_FORWARD, marked))
+		goto out;
+
+	for (it = list->head; it != NULL; it = it->next) {
+		if (marked[it->id] && append_pkg(&root->packages,
+						 it->name) == NULL) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	free(marked);
+	free(ids);
+	return ret;
+}
+
+/*
+  Merge the packages of all roots into a single list, sorted such that every
+  package is only installed once its dependencies are in place, and work out
+  which packages go into which root.
+ */
+static int resolve_roots(int repofd, install_root_t *roots,
+			 struct pkg_dep_list *common,
+			 struct pkg_dep_list *list, bool resolve_deps)
 {
 	struct pkg_dep_node *it;
+	install_root_t *root;
+
+	for (it = common->head; it != NULL; it = it->next) {
+		if (append_unique(list, it->name))
+			return -1;
+	}
+
+	for (root = roots; root != NULL; root = root->next) {
+		for (it = root->request.head; it != NULL; it = it->next) {
+			if (append_unique(list, it->name))
+				return -1;
+		}
+	}
+
+	if (resolve_deps) {
+		if (collect_dependencies(repofd, list))
+			return -1;
+
+		if (sort_by_dependencies(list))
+			return -1;
+	}
+
+	if (pkg_list_build_graph(list))
+		return -1;
+
+	for (root = roots; root != NULL; root = root->next) {
+		if (add_closure(list, common, root))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int unpack_packages(int repofd, install_root_t *roots, int flags,
+			   pkg_cache_t *cache, struct pkg_dep_list *list)
+{
+	pkg_unpack_stats_t stats;
+	struct pkg_dep_node *it;
+	install_root_t *root;
+	size_t count = 0;
 	pkg_reader_t *rd;
+	int *rootfds;
+
+	for (root = roots; root != NULL; root = root->next)
+		++count;
+
+	rootfds = calloc(count, sizeof(rootfds[0]));
+	if (rootfds == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	memset(&stats, 0, sizeof(stats));
 
 	for (it = list->head; it != NULL; it = it->next) {
+		count = 0;
+
+		for (root = roots; root != NULL; root = root->next) {
+			if (find_pkg(&root->packages, it->name) != NULL)
+				rootfds[count++] = root->fd;
+		}
+
+		if (count == 0)
+			continue;
+
 		rd = pkg_reader_open_repo(repofd, it->name);
 		if (rd == NULL)
-			return -1;
+			goto fail;
 
-		if (pkg_unpack(rootfd, flags, rd)) {
+		if (pkg_unpack_multi(rootfds, count, flags, rd, cache,
+				     &stats)) {
 			pkg_reader_close(rd);
-			return -1;
+			goto fail;
+		}
+
+		pkg_reader_close(rd);
+	}
+
+	if (flags & (UNPACK_SYNC_PACKAGE | UNPACK_SYNC_STRICT)) {
+		printf("time spent syncing: %lu.%03lu s\n",
+		       (unsigned long)(stats.sync_time / 1000000000UL),
+		       (unsigned long)(stats.sync_time / 1000000UL) % 1000);
+	}
+
+	if (cache != NULL) {
+		printf("package cache: %lu hits, %lu misses\n",
+		       (unsigned long)stats.cache_hits,
+		       (unsigned long)stats.cache_misses);
+	}
+
+	free(rootfds);
+	return 0;
+fail:
+	free(rootfds);
+	return -1;
+}
+
+static int write_cpio(int repofd, const char *path, compressor_t *cmp,
+		      int flags, struct pkg_dep_list *list)
+{
+	struct pkg_dep_node *it;
+	pkg_reader_t *rd;
+	pkg_cpio_t *cpio;
+
+	/* the kernel can only unpack xz streams, not raw zlib streams */
+	if (cmp->id != PKG_COMPRESSION_NONE &&
+	    cmp->id != PKG_COMPRESSION_LZMA) {
+		fprintf(stderr, "%s: compressor %s is not supported for "
+			"cpio archives\n", path, cmp->name);
+		return -1;
+	}
+
+	cpio = pkg_cpio_open(path, cmp);
+	if (cpio == NULL)
+		return -1;
+
+	for (it = list->head; it != NULL; it = it->next) {
+		rd = pkg_reader_open_repo(repofd, it->name);
+		if (rd == NULL)
+			goto fail;
+
+		if (pkg_cpio_add(cpio, flags, rd)) {
+			pkg_reader_close(rd);
+			goto fail;
 		}
 
 		pkg_reader_close(rd);
 	}
 
+	if (pkg_cpio_finish(cpio))
+		goto fail;
+
+	pkg_cpio_close(cpio);
 	return 0;
+fail:
+	pkg_cpio_close(cpio);
+	return -1;
+}
+
+static int write_sqfs(int repofd, const char *path, compressor_t *cmp,
+		      unsigned int jobs, int flags, struct pkg_dep_list *list)
+{
+	struct pkg_dep_node *it;
+	sqfs_writer_t *sqfs;
+	pkg_reader_t *rd;
+
+	sqfs = sqfs_writer_open(path, cmp, SQFS_DEFAULT_BLOCK_SIZE, jobs);
+	if (sqfs == NULL)
+		return -1;
+
+	for (it = list->head; it != NULL; it = it->next) {
+		rd = pkg_reader_open_repo(repofd, it->name);
+		if (rd == NULL)
+			goto fail;
+
+		if (pkg_sqfs_add(sqfs, flags, rd)) {
+			pkg_reader_close(rd);
+			goto fail;
+		}
+
+		pkg_reader_close(rd);
+	}
+
+	if (sqfs_writer_finish(sqfs))
+		goto fail;
+
+	sqfs_writer_close(sqfs);
+	return 0;
+fail:
+	sqfs_writer_close(sqfs);
+	return -1;
+}
+
+static compressor_t *get_default_compressor(void)
+{
+	compressor_t *cmp;
+
+	cmp = compressor_by_id(PKG_COMPRESSION_LZMA);
+	if (cmp != NULL)
+		return cmp;
+
+	cmp = compressor_by_id(PKG_COMPRESSION_ZLIB);
+	if (cmp != NULL)
+		return cmp;
+
+	return compressor_by_id(PKG_COMPRESSION_NONE);
 }
 
 static void list_packages(struct pkg_dep_list *list)
@@ -64,6 +393,24 @@ static void list_packages(struct pkg_dep_list *list)
 		printf("%s\n", it->name);
 }
 
+static void list_levels(struct pkg_dep_list *list)
+{
+	struct pkg_dep_node *it, *prev = NULL;
+
+	for (it = list->head; it != NULL; it = it->next) {
+		if (prev == NULL || prev->level != it->level) {
+			printf("%s%lu:", prev == NULL ? "" : "\n",
+			       (unsigned long)it->level);
+		}
+
+		printf(" %s", it->name);
+		prev = it;
+	}
+
+	if (prev != NULL)
+		fputc('\n', stdout);
+}
+
 static int list_files(int repofd, const char *rootdir, TOC_FORMAT format,
 		      struct pkg_dep_list *list)
 {
@@ -97,13 +444,20 @@ static int list_files(int repofd, const char *rootdir, TOC_FORMAT format,
 static int cmd_install(int argc, char **argv)
 {
 	int ret = EXIT_FAILURE, mode = INSTALL_MODE_INSTALL;
-	int i, rootfd = -1, repofd = -1, flags = 0;
+	struct pkg_dep_list list, common;
+	const char *rootdir = NULL, *outfile = NULL;
 	TOC_FORMAT format = TOC_FORMAT_PRETTY;
-	const char *rootdir = NULL;
-	struct pkg_dep_list list;
+	uint64_t cache_size = PKG_CACHE_DEFAULT_SIZE;
+	const char *cache_dir = NULL;
+	install_root_t *roots = NULL;
+	int i, repofd = -1, flags = 0;
+	pkg_cache_t *cache = NULL;
+	compressor_t *cmp = NULL;
+	unsigned int jobs = 0;
 	bool resolve_deps = true;
 
 	memset(&list, 0, sizeof(list));
+	memset(&common, 0, sizeof(common));
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -117,6 +471,9 @@ static int cmd_install(int argc, char **argv)
 		case 'p':
 			mode = INSTALL_MODE_LIST_PKG;
 			break;
+		case 'P':
+			mode = INSTALL_MODE_LIST_LEVELS;
+			break;
 		case 'l':
 			mode = INSTALL_MODE_LIST_FILES;
 			if (strcmp(optarg, "initrd") == 0) {
@@ -145,23 +502,20 @@ static int cmd_install(int argc, char **argv)
 			}
 			break;
 		case 'r':
-			if (rootfd != -1) {
-				fputs("root specified more than once\n",
-				      stderr);
-				tell_read_help(argv[0]);
-				goto out;
-			}
-
-			if (mkdir_p(optarg))
-				goto out;
-
-			rootfd = open(optarg, O_RDONLY | O_DIRECTORY);
-			if (rootfd < 0) {
-				perror(optarg);
+			if (add_root(&roots, optarg, true) == NULL)
 				goto out;
-			}
 
-			rootdir = optarg;
+			if (rootdir == NULL)
+				rootdir = roots->path;
+			break;
+		case 'H':
+			flags |= UNPACK_HARDLINK;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'M':
+			cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
 			break;
 		case 'o':
 			flags |= UNPACK_NO_CHOWN;
@@ -175,6 +529,31 @@ static int cmd_install(int argc, char **argv)
 		case 'D':
 			flags |= UNPACK_NO_DEVICES;
 			break;
+		case 's':
+			if (pkg_unpack_parse_sync_mode(optarg, &flags)) {
+				tell_read_help(argv[0]);
+				goto out;
+			}
+			break;
+		case 'c':
+			mode = INSTALL_MODE_CPIO;
+			outfile = optarg;
+			break;
+		case 'S':
+			mode = INSTALL_MODE_SQFS;
+			outfile = optarg;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			cmp = compressor_by_name(optarg);
+			if (cmp == NULL) {
+				fprintf(stderr, "unknown compressor '%s'\n",
+					optarg);
+				goto out;
+			}
+			break;
 		default:
 			tell_read_help(argv[0]);
 			goto out;
@@ -189,47 +568,68 @@ static int cmd_install(int argc, char **argv)
 		}
 	}
 
-	if (rootfd == -1) {
-		rootfd = open(INSTALLROOT, O_RDONLY | O_DIRECTORY);
-		if (rootfd < 0) {
-			perror(INSTALLROOT);
+	if (roots == NULL) {
+		if (add_root(&roots, INSTALLROOT, false) == NULL)
 			goto out;
-		}
+	} else if (roots->next != NULL && mode != INSTALL_MODE_INSTALL) {
+		fputs("multiple roots can only be used for installing\n",
+		      stderr);
+		goto out;
 	}
 
 	for (i = optind; i < argc; ++i) {
-		if (append_pkg(&list, argv[i]) == NULL)
+		if (append_pkg(&common, argv[i]) == NULL)
 			goto out;
 	}
 
-	if (resolve_deps) {
-		if (collect_dependencies(repofd, &list))
-			goto out;
-
-		if (sort_by_dependencies(&list))
-			goto out;
-	}
+	if (resolve_roots(repofd, roots, &common, &list, resolve_deps))
+		goto out;
 
 	switch (mode) {
 	case INSTALL_MODE_LIST_PKG:
 		list_packages(&list);
 		break;
+	case INSTALL_MODE_LIST_LEVELS:
+		list_levels(&list);
+		break;
 	case INSTALL_MODE_LIST_FILES:
 		if (list_files(repofd, rootdir, format, &list))
 			goto out;
 		break;
+	case INSTALL_MODE_CPIO:
+		if (cmp == NULL)
+			cmp = compressor_by_id(PKG_COMPRESSION_NONE);
+
+		if (write_cpio(repofd, outfile, cmp, flags, &list))
+			goto out;
+		break;
+	case INSTALL_MODE_SQFS:
+		if (cmp == NULL)
+			cmp = get_default_compressor();
+
+		if (write_sqfs(repofd, outfile, cmp, jobs, flags, &list))
+			goto out;
+		break;
 	default:
-		if (unpack_packages(repofd, rootfd, flags, &list))
+		if (cache_dir != NULL) {
+			cache = pkg_cache_open(cache_dir, cache_size);
+			if (cache == NULL)
+				goto out;
+		}
+
+		if (unpack_packages(repofd, roots, flags, cache, &list))
 			goto out;
 		break;
 	}
 
 	ret = EXIT_SUCCESS;
 out:
-	if (rootfd != -1)
-		close(rootfd);
+	if (cache != NULL)
+		pkg_cache_close(cache);
 	if (repofd != -1)
 		close(repofd);
+	free_roots(roots);
+	pkg_list_cleanup(&common);
 	pkg_list_cleanup(&list);
 	return ret;
 }
@@ -247,8 +647,18 @@ static command_t install = {
 "  --repo-dir, -R <path>     Specify the input repository path to fetch the\n"
 "                            packages from.\n"
 "                            If not set, defaults to " REPODIR ".\n"
-"  --root, -r <path>         A root directory to unpack the package.\n"
+"  --root, -r <path>[=<packages>]  A root directory to unpack the package.\n"
 "                            If not set, defaults to " INSTALLROOT ".\n"
+"\n"
+"                            May be repeated to install into several roots,\n"
+"                            each package is decompressed only once. The\n"
+"                            optional comma separated list adds packages\n"
+"                            only to that root.\n"
+"  --hardlink, -H            Hard link files shared between multiple roots\n"
+"                            or the cache instead of reflinking them.\n"
+"  --cache-dir, -C <path>    Keep extracted files in a package cache.\n"
+"  --cache-size, -M <MiB>    Upper bound for the cache size.\n"
+"                            See `help unpack' for details on the cache.\n"
 "  --no-chown, -o            Do not change ownership of the extracted data.\n"
 "                            Keep the uid/gid of the user who runs the \n"
 "                            program.\n"
@@ -257,10 +667,27 @@ static command_t install = {
 "                            directories.\n"
 "  --no-symlink, -L          Do not create symlinks.\n"
 "  --no-devices, -D          Do not create device files.\n"
+"  --sync, -s <mode>         Specify how hard to try making sure the\n"
+"                            installed data actually reaches the disk:\n"
+"\n"
+"                            \"none\" (default) does not sync at all.\n"
+"\n"
+"                            \"package\" starts write back for every file\n"
+"                            and syncs the file system once after each\n"
+"                            package has been unpacked.\n"
+"\n"
+"                            \"strict\" additionally waits for every single\n"
+"                            file and directory to be written out.\n"
+"\n"
+"                            If syncing is enabled, the time spent waiting\n"
+"                            for the disk is reported at the end.\n"
 "  --no-dependencies, -d     Do not resolve dependencies, only install files\n"
 "                            packages listed on the command line.\n"
 "  --list-packages, -p       Do not install packages, print out final\n"
 "                            package list that would be installed.\n"
+"  --list-levels, -P         Like --list-packages, but print one line per\n"
+"                            dependency level. Packages on the same level\n"
+"                            do not depend on each other.\n"
 "  --list-files, -l <format> Do not install packages, print out table of\n"
 "                            contents for all packages that would be\n"
 "                            installed in a specified format.\n"
@@ -269,7 +696,17 @@ static command_t install = {
 "                            pretty printed format with details is used.\n"
 "\n"
 "                            If \"initrd\" is specified, the format of Linux\n"
-"                            gen_init_cpio is produced.\n",
+"                            gen_init_cpio is produced.\n"
+"  --output-cpio, -c <file>  Do not install packages, instead write a newc\n"
+"                            cpio archive for use as Linux initramfs. No\n"
+"                            staging directory or root privileges needed.\n"
+"  --output-squashfs, -S <file>  Do not install packages, instead build a\n"
+"                            SquashFS image directly from the packages.\n"
+"  --compressor, -z <name>   Compressor for the cpio archive (\"none\" or\n"
+"                            \"lzma\", default: none) or the SquashFS image\n"
+"                            (default: lzma, or zlib if unavailable).\n"
+"  --jobs, -j <count>        Number of threads used for compressing SquashFS\n"
+"                            data blocks. Defaults to the number of CPUs.\n",
 	.run_cmd = cmd_install,
 };
 
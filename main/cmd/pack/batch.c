@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: ISC */
+#include <pthread.h>
+#include <time.h>
+
+#include "pack.h"
+
+/*
+  The packages of a batch are independent of each other, so a fixed number
+  of workers simply claim the next unprocessed job until none are left. The
+  timings are collected in the job array and printed in manifest order once
+  all workers are done, so the report does not depend on the scheduling.
+ */
+typedef struct {
+	pack_batch_t *batch;
+	const pack_options_t *opt;
+
+	pthread_mutex_t mtx;
+	size_t next;
+} batch_pool_t;
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+int pack_batch_add(pack_batch_t *batch, const char *descfile,
+		   const char *filelist)
+{
+	size_t new_max;
+	pack_job_t *new;
+
+	if (batch->count == batch->max) {
+		new_max = batch->max ? batch->max * 2 : 16;
+		new = realloc(batch->jobs, new_max * sizeof(new[0]));
+		if (new == NULL)
+			goto fail_oom;
+
+		batch->jobs = new;
+		batch->max = new_max;
+	}
+
+	new = batch->jobs + batch->count;
+	memset(new, 0, sizeof(*new));
+
+	new->descfile = strdup(descfile);
+	if (new->descfile == NULL)
+		goto fail_oom;
+
+	if (filelist != NULL) {
+		new->filelist = strdup(filelist);
+		if (new->filelist == NULL) {
+			free(new->descfile);
+			goto fail_oom;
+		}
+	}
+
+	batch->count += 1;
+	return 0;
+fail_oom:
+	fputs("out of memory\n", stderr);
+	return -1;
+}
+
+static int handle_manifest_line(void *usr, const char *filename,
+				size_t linenum, char *line)
+{
+	char *descfile = line, *filelist = NULL, *end;
+
+	if (*line == '#')
+		return 0;
+
+	for (end = line; *end != '\0' && !isspace(*end); ++end)
+		;
+
+	if (*end != '\0') {
+		*(end++) = '\0';
+
+		while (isspace(*end))
+			++end;
+
+		filelist = end;
+
+		while (*end != '\0' && !isspace(*end))
+			++end;
+
+		if (*end != '\0') {
+			input_file_complain(filename, linenum,
+					    "expected description file and "
+					    "optional file list");
+			return -1;
+		}
+	}
+
+	return pack_batch_add(usr, descfile, filelist);
+}
+
+int pack_batch_read(pack_batch_t *batch, const char *manifest)
+{
+	return foreach_line_in_file(manifest, batch, handle_manifest_line);
+}
+
+static void *pack_worker(void *arg)
+{
+	batch_pool_t *pool = arg;
+	struct timespec start;
+	pack_job_t *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mtx);
+		job = NULL;
+		if (pool->next < pool->batch->count)
+			job = pool->batch->jobs + pool->next++;
+		pthread_mutex_unlock(&pool->mtx);
+
+		if (job == NULL)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		job->status = pack_package(job->descfile, job->filelist,
+					   pool->opt);
+
+		job->seconds = elapsed(&start);
+	}
+
+	return NULL;
+}
+
+int pack_batch_run(pack_batch_t *batch, const pack_options_t *opt,
+		   size_t num_workers, bool report)
+{
+	size_t i, started = 0, failed = 0, skipped = 0;
+	struct timespec start;
+	pthread_t *workers;
+	batch_pool_t pool;
+
+	if (num_workers > batch->count)
+		num_workers = batch->count;
+
+	if (num_workers == 0)
+		return 0;
+
+	workers = calloc(num_workers, sizeof(workers[0]));
+	if (workers == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.batch = batch;
+	pool.opt = opt;
+	pthread_mutex_init(&pool.mtx, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < num_workers; ++i) {
+		if (pthread_create(workers + i, NULL, pack_worker, &pool)) {
+			if (started > 0)
+				break;
+
+			fputs("failed to create packing thread\n", stderr);
+			free(workers);
+			pthread_mutex_destroy(&pool.mtx);
+			return -1;
+		}
+
+		started += 1;
+	}
+
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < batch->count; ++i) {
+		if (batch->jobs[i].status < 0) {
+			failed += 1;
+			continue;
+		}
+
+		if (batch->jobs[i].status > 0) {
+			skipped += 1;
+			if (report) {
+				printf("%s: up to date\n",
+				       batch->jobs[i].descfile);
+			}
+		} else if (report) {
+			printf("%s: %.3fs\n", batch->jobs[i].descfile,
+			       batch->jobs[i].seconds);
+		}
+	}
+
+	if (report) {
+		printf("%zu packed, %zu up to date, %zu failed in %.3fs\n",
+		       batch->count - failed - skipped, skipped, failed,
+		       elapsed(&start));
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&pool.mtx);
+	return failed > 0 ? -1 : 0;
+}
+
+void pack_batch_cleanup(pack_batch_t *batch)
+{
+	size_t i;
+
+	for (i = 0; i < batch->count; ++i) {
+		free(batch->jobs[i].descfile);
+		free(batch->jobs[i].filelist);
+	}
+
+	free(batch->jobs);
+	memset(batch, 0, sizeof(*batch));
+}
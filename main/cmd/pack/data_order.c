@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier: ISC */
+#include "pack.h"
+
+/*
+  The TOC is always sorted the same way, the data order only decides which
+  file gets which ID, i.e. in what order the file contents are stored in
+  the data record:
+
+  size        ascending by size, the order of the TOC
+  directory   grouped by directory, so unpacking writes one directory at a
+              time
+  type        grouped by file name extension, then by directory
+  similarity  grouped by the kind of content found at the start of the file
+              (text, scripts, ELF, compressed, other binary), then by
+              extension and size, so that data with similar statistics
+              ends up in the same window of the compressor
+ */
+static const char *names[DATA_ORDER_COUNT] = {
+	[DATA_ORDER_SIZE] = "size",
+	[DATA_ORDER_DIRECTORY] = "directory",
+	[DATA_ORDER_TYPE] = "type",
+	[DATA_ORDER_SIMILARITY] = "similarity",
+};
+
+enum {
+	CONTENT_TEXT = 0,
+	CONTENT_SCRIPT,
+	CONTENT_ELF,
+	CONTENT_BINARY,
+	CONTENT_COMPRESSED,
+};
+
+typedef struct {
+	image_entry_t *ent;
+	const char *basename;
+	const char *extension;
+	size_t dirlen;
+	uint32_t position;
+	int content;
+} order_key_t;
+
+static const struct {
+	const char *magic;
+	size_t length;
+} compressed[] = {
+	{ "\x1f\x8b", 2 },
+	{ "\xfd" "7zXZ\0", 6 },
+	{ "\x28\xb5\x2f\xfd", 4 },
+	{ "BZh", 3 },
+	{ "PK\x03\x04", 4 },
+	{ "\x89PNG", 4 },
+	{ "\xff\xd8\xff", 3 },
+};
+
+static int classify(const char *path, int *out)
+{
+	uint8_t buffer[512];
+	ssize_t i, ret;
+	size_t j;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	ret = read_retry(fd, buffer, sizeof(buffer));
+	close(fd);
+
+	if (ret < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (ret >= 4 && memcmp(buffer, "\x7f" "ELF", 4) == 0) {
+		*out = CONTENT_ELF;
+		return 0;
+	}
+
+	if (ret >= 2 && buffer[0] == '#' && buffer[1] == '!') {
+		*out = CONTENT_SCRIPT;
+		return 0;
+	}
+
+	for (j = 0; j < sizeof(compressed) / sizeof(compressed[0]); ++j) {
+		if ((size_t)ret >= compressed[j].length &&
+		    memcmp(buffer, compressed[j].magic,
+			   compressed[j].length) == 0) {
+			*out = CONTENT_COMPRESSED;
+			return 0;
+		}
+	}
+
+	*out = CONTENT_TEXT;
+
+	for (i = 0; i < ret; ++i) {
+		if (buffer[i] == 0 ||
+		    (buffer[i] < 0x20 && !isspace(buffer[i]))) {
+			*out = CONTENT_BINARY;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_directory(const order_key_t *a, const order_key_t *b)
+{
+	size_t len = a->dirlen < b->dirlen ? a->dirlen : b->dirlen;
+	int diff = memcmp(a->ent->name, b->ent->name, len);
+
+	if (diff != 0)
+		return diff;
+
+	if (a->dirlen != b->dirlen)
+		return a->dirlen < b->dirlen ? -1 : 1;
+
+	return strcmp(a->basename, b->basename);
+}
+
+static int compare_position(const order_key_t *a, const order_key_t *b)
+{
+	return a->position < b->position ? -1 : (a->position > b->position);
+}
+
+static int cmp_directory(const void *lhs, const void *rhs)
+{
+	return compare_directory(lhs, rhs);
+}
+
+static int cmp_type(const void *lhs, const void *rhs)
+{
+	const order_key_t *a = lhs, *b = rhs;
+	int diff = strcmp(a->extension, b->extension);
+
+	return diff != 0 ? diff : compare_directory(a, b);
+}
+
+static int cmp_similarity(const void *lhs, const void *rhs)
+{
+	const order_key_t *a = lhs, *b = rhs;
+	int diff;
+
+	if (a->content != b->content)
+		return a->content < b->content ? -1 : 1;
+
+	diff = strcmp(a->extension, b->extension);
+	if (diff != 0)
+		return diff;
+
+	if (a->ent->data.file.size != b->ent->data.file.size)
+		return a->ent->data.file.size < b->ent->data.file.size ? -1 : 1;
+
+	return compare_position(a, b);
+}
+
+int data_order_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < DATA_ORDER_COUNT; ++i) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+const char *data_order_name(DATA_ORDER order)
+{
+	return names[order];
+}
+
+int data_order_apply(image_entry_t *list, DATA_ORDER order)
+{
+	size_t i, count = 0;
+	order_key_t *keys;
+	image_entry_t *ent;
+	const char *ptr;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		if (S_ISREG(ent->mode))
+			count += 1;
+	}
+
+	if (count == 0)
+		return 0;
+
+	keys = calloc(count, sizeof(keys[0]));
+	if (keys == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	for (i = 0, ent = list; ent != NULL; ent = ent->next) {
+		if (!S_ISREG(ent->mode))
+			continue;
+
+		keys[i].ent = ent;
+		keys[i].position = i;
+
+		ptr = strrchr(ent->name, '/');
+		keys[i].basename = ptr == NULL ? ent->name : (ptr + 1);
+		keys[i].dirlen = ptr == NULL ? 0 : (size_t)(ptr - ent->name);
+
+		ptr = strrchr(keys[i].basename, '.');
+		keys[i].extension = ptr == NULL ? "" : ptr;
+
+		if (order == DATA_ORDER_SIMILARITY &&
+		    classify(ent->data.file.location, &keys[i].content)) {
+			free(keys);
+			return -1;
+		}
+
+		i += 1;
+	}
+
+	switch (order) {
+	case DATA_ORDER_DIRECTORY:
+		qsort(keys, count, sizeof(keys[0]), cmp_directory);
+		break;
+	case DATA_ORDER_TYPE:
+		qsort(keys, count, sizeof(keys[0]), cmp_type);
+		break;
+	case DATA_ORDER_SIMILARITY:
+		qsort(keys, count, sizeof(keys[0]), cmp_similarity);
+		break;
+	default:
+		break;
+	}
+
+	for (i = 0; i < count; ++i)
+		keys[i].ent->data.file.id = i;
+
+	free(keys);
+	return 0;
+}
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: ISC */
+#include <pthread.h>
+
+#include "pack.h"
+
+/*
+  Only files whose size matches that of another file can have the same
+  content, so only those are hashed. Files with the same size and hash are
+  compared byte by byte before they are merged, so a hash collision cannot
+  corrupt a package. Of a set of identical files, the one that comes first
+  in the data order keeps its place and the others refer to it.
+ */
+typedef struct {
+	image_entry_t *ent;
+	size_t position;
+	uint64_t hash;
+} dedup_file_t;
+
+typedef struct {
+	dedup_file_t *files;
+	size_t count;
+
+	pthread_mutex_t mtx;
+	size_t next;
+	bool failed;
+} hash_pool_t;
+
+static int cmp_size(const void *lhs, const void *rhs)
+{
+	const dedup_file_t *a = lhs, *b = rhs;
+
+	if (a->ent->data.file.size != b->ent->data.file.size)
+		return a->ent->data.file.size < b->ent->data.file.size ? -1 : 1;
+
+	return a->position < b->position ? -1 : 1;
+}
+
+static int cmp_content(const void *lhs, const void *rhs)
+{
+	const dedup_file_t *a = lhs, *b = rhs;
+
+	if (a->ent->data.file.size != b->ent->data.file.size)
+		return a->ent->data.file.size < b->ent->data.file.size ? -1 : 1;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	return a->position < b->position ? -1 : 1;
+}
+
+static void *hash_worker(void *arg)
+{
+	hash_pool_t *pool = arg;
+	dedup_file_t *file;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mtx);
+		if (pool->failed || pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->mtx);
+			break;
+		}
+		file = pool->files + pool->next++;
+		pthread_mutex_unlock(&pool->mtx);
+
+		if (file->ent->data.file.size == 0)
+			continue;
+
+		if (pack_hash_file(file->ent->data.file.location,
+				   &file->hash)) {
+			pthread_mutex_lock(&pool->mtx);
+			pool->failed = true;
+			pthread_mutex_unlock(&pool->mtx);
+		}
+	}
+
+	return NULL;
+}
+
+static int hash_files(dedup_file_t *files, size_t count, size_t num_workers)
+{
+	size_t i, started = 0;
+	pthread_t *workers;
+	hash_pool_t pool;
+
+	if (num_workers > count)
+		num_workers = count;
+
+	if (num_workers == 0)
+		return 0;
+
+	workers = calloc(num_workers, sizeof(workers[0]));
+	if (workers == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.files = files;
+	pool.count = count;
+	pthread_mutex_init(&pool.mtx, NULL);
+
+	for (i = 0; i < num_workers; ++i) {
+		if (pthread_create(workers + i, NULL, hash_worker, &pool))
+			break;
+
+		started += 1;
+	}
+
+	/* without any helper threads, do all the work here */
+	if (started == 0)
+		hash_worker(&pool);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_destroy(&pool.mtx);
+	free(workers);
+	return pool.failed ? -1 : 0;
+}
+
+static int open_input(const image_entry_t *ent)
+{
+	int fd = open(ent->data.file.location, O_RDONLY);
+
+	if (fd < 0)
+		perror(ent->data.file.location);
+
+	return fd;
+}
+
+/* Returns 1 if two files of the same size have the same content. */
+static int files_equal(const image_entry_t *a, const image_entry_t *b)
+{
+	uint8_t abuf[65536], bbuf[65536];
+	ssize_t aret, bret;
+	int afd, bfd, ret = -1;
+
+	if (a->data.file.size == 0)
+		return 1;
+
+	afd = open_input(a);
+	if (afd < 0)
+		return -1;
+
+	bfd = open_input(b);
+	if (bfd < 0) {
+		close(afd);
+		return -1;
+	}
+
+	for (;;) {
+		aret = read_retry(afd, abuf, sizeof(abuf));
+		if (aret < 0) {
+			perror(a->data.file.location);
+			break;
+		}
+
+		bret = read_retry(bfd, bbuf, sizeof(bbuf));
+		if (bret < 0) {
+			perror(b->data.file.location);
+			break;
+		}
+
+		if (aret != bret || memcmp(abuf, bbuf, aret) != 0) {
+			ret = 0;
+			break;
+		}
+
+		if (aret == 0) {
+			ret = 1;
+			break;
+		}
+	}
+
+	close(bfd);
+	close(afd);
+	return ret;
+}
+
+/*
+  Within a run of files with the same size and hash, which are sorted by
+  position, merge each file into the first earlier one it is equal to.
+ */
+static int merge_run(dedup_file_t *files, size_t count, size_t *same_as)
+{
+	size_t i, j;
+	int ret;
+
+	for (i = 1; i < count; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (same_as[files[j].position] != files[j].position)
+				continue;
+
+			ret = files_equal(files[j].ent, files[i].ent);
+			if (ret < 0)
+				return -1;
+
+			if (ret > 0) {
+				same_as[files[i].position] = files[j].position;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int pack_dedup_files(image_entry_t *list, size_t num_workers)
+{
+	size_t i, start, end, count, num_candidates = 0;
+	dedup_file_t *files = NULL;
+	size_t *same_as = NULL;
+	image_entry_t **index;
+	int ret = -1, shared;
+	uint32_t id;
+
+	index = image_entry_file_index(list, &count);
+	if (index == NULL)
+		return -1;
+
+	if (count < 2) {
+		free(index);
+		return 0;
+	}
+
+	files = calloc(count, sizeof(files[0]));
+	same_as = calloc(count, sizeof(same_as[0]));
+	if (files == NULL || same_as == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	for (i = 0; i < count; ++i) {
+		files[i].ent = index[i];
+		files[i].position = i;
+		same_as[i] = i;
+	}
+
+	qsort(files, count, sizeof(files[0]), cmp_size);
+
+	for (i = 0; i < count; ++i) {
+		if ((i > 0 && files[i - 1].ent->data.file.size ==
+		     files[i].ent->data.file.size) ||
+		    (i + 1 < count && files[i + 1].ent->data.file.size ==
+		     files[i].ent->data.file.size)) {
+			files[num_candidates++] = files[i];
+		}
+	}
+
+	if (hash_files(files, num_candidates, num_workers))
+		goto out;
+
+	qsort(files, num_candidates, sizeof(files[0]), cmp_content);
+
+	for (start = 0; start < num_candidates; start = end) {
+		end = start + 1;
+
+		while (end < num_candidates &&
+		       files[end].hash == files[start].hash &&
+		       files[end].ent->data.file.size ==
+		       files[start].ent->data.file.size) {
+			++end;
+		}
+
+		if (merge_run(files + start, end - start, same_as))
+			goto out;
+	}
+
+	/* merged files always come after the file they refer to */
+	for (i = 0, id = 0, shared = 0; i < count; ++i) {
+		if (same_as[i] == i) {
+			index[i]->data.file.id = id++;
+		} else {
+			index[i]->data.file.id = index[same_as[i]]->data.file.id;
+			shared += 1;
+		}
+	}
+
+	ret = shared;
+out:
+	free(same_as);
+	free(files);
+	free(index);
+	return ret;
+}
@@ -73,9 +73,67 @@ static int handle_data_compressor(char *line, const char *filename,
 	return 0;
 }
 
+static int handle_data_order(char *line, const char *filename,
+			     size_t linenum, void *obj)
+{
+	pkg_desc_t *desc = obj;
+	int order;
+
+	order = data_order_from_name(line);
+
+	if (order < 0) {
+		input_file_complain(filename, linenum, "unknown data order");
+		return -1;
+	}
+
+	desc->data_order = order;
+	return 0;
+}
+
+static int handle_data_alignment(char *line, const char *filename,
+				 size_t linenum, void *obj)
+{
+	pkg_desc_t *desc = obj;
+	unsigned long value;
+	char *end;
+
+	value = strtoul(line, &end, 10);
+
+	if (*end != '\0' || (value != 0 && (value < 512 ||
+					     value > 1024 * 1024 ||
+					     (value & (value - 1)) != 0))) {
+		input_file_complain(filename, linenum, "data alignment must "
+				    "be 0 or a power of two from 512 to 1M");
+		return -1;
+	}
+
+	desc->data_alignment = value;
+	return 0;
+}
+
+static int handle_deduplicate(char *line, const char *filename,
+			      size_t linenum, void *obj)
+{
+	pkg_desc_t *desc = obj;
+
+	if (strcmp(line, "yes") == 0) {
+		desc->deduplicate = true;
+	} else if (strcmp(line, "no") == 0) {
+		desc->deduplicate = false;
+	} else {
+		input_file_complain(filename, linenum, "expected yes or no");
+		return -1;
+	}
+
+	return 0;
+}
+
 static const keyword_handler_t line_hooks[] = {
 	{ "toc-compressor", handle_toc_compressor },
 	{ "data-compressor", handle_data_compressor },
+	{ "data-order", handle_data_order },
+	{ "data-alignment", handle_data_alignment },
+	{ "deduplicate", handle_deduplicate },
 	{ "requires", handle_requires },
 };
 
@@ -105,6 +163,7 @@ int desc_read(const char *path, pkg_desc_t *desc)
 	char *ptr;
 
 	memset(desc, 0, sizeof(*desc));
+	desc->deduplicate = true;
 
 	if (process_file(path, line_hooks, NUM_LINE_HOOKS, desc))
 		return -1;
@@ -121,6 +180,14 @@ int desc_read(const char *path, pkg_desc_t *desc)
 		return -1;
 	}
 
+	if (desc->data_alignment > 0 &&
+	    desc->datacmp->id != PKG_COMPRESSION_NONE) {
+		fprintf(stderr, "%s: data alignment requires the data "
+			"compressor `none`\n", path);
+		desc_free(desc);
+		return -1;
+	}
+
 	ptr = strrchr(path, '/');
 
 	desc->name = strdup((ptr == NULL) ? path : (ptr + 1));
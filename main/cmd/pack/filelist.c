@@ -29,11 +29,15 @@ static void unescape_name(char *name)
 	*dst = '\0';
 }
 
-static image_entry_t *filelist_mkentry(char *line, const char *filename,
+/*
+  Parse the common part of an entry and advance the line pointer to the
+  type specific rest of the line.
+ */
+static image_entry_t *filelist_mkentry(char **lineptr, const char *filename,
 				       size_t linenum, mode_t filetype)
 {
+	char *line = *lineptr;
 	image_entry_t *ent;
-	char *start = line;
 	size_t i;
 
 	ent = calloc(1, sizeof(*ent));
@@ -150,10 +154,7 @@ static image_entry_t *filelist_mkentry(char *line, const char *filename,
 	while (isdigit(*line))
 		ent->gid = (ent->gid * 10) + (*(line++) - '0');
 
-	line = skipspace(line);
-
-	/* remove processed data */
-	memmove(start, line, strlen(line) + 1);
+	*lineptr = skipspace(line);
 	return ent;
 fail:
 	free(ent->name);
@@ -164,7 +165,8 @@ fail:
 int filelist_mkdir(char *line, const char *filename,
 		   size_t linenum, void *obj)
 {
-	image_entry_t *ent = filelist_mkentry(line,filename,linenum,S_IFDIR);
+	image_entry_t *ent = filelist_mkentry(&line, filename, linenum,
+						S_IFDIR);
 	image_entry_t **listptr = obj;
 
 	if (ent == NULL)
@@ -178,7 +180,8 @@ int filelist_mkdir(char *line, const char *filename,
 int filelist_mkslink(char *line, const char *filename,
 		     size_t linenum, void *obj)
 {
-	image_entry_t *ent = filelist_mkentry(line,filename,linenum,S_IFLNK);
+	image_entry_t *ent = filelist_mkentry(&line, filename, linenum,
+						S_IFLNK);
 	image_entry_t **listptr = obj;
 
 	if (ent == NULL)
@@ -207,7 +210,8 @@ fail:
 int filelist_mkfile(char *line, const char *filename,
 		    size_t linenum, void *obj)
 {
-	image_entry_t *ent = filelist_mkentry(line,filename,linenum,S_IFREG);
+	image_entry_t *ent = filelist_mkentry(&line, filename, linenum,
+						S_IFREG);
 	image_entry_t **listptr = obj;
 	const char *ptr;
 	struct stat sb;
@@ -263,7 +267,7 @@ static int filelist_mknod(char *line, const char *filename,
 	unsigned int maj, min;
 	char *ptr;
 
-	ent = filelist_mkentry(line, filename, linenum, S_IFCHR);
+	ent = filelist_mkentry(&line, filename, linenum, S_IFCHR);
 	if (ent == NULL)
 		return -1;
 
@@ -310,7 +314,7 @@ static const keyword_handler_t line_hooks[] = {
 
 #define NUM_LINE_HOOKS (sizeof(line_hooks) / sizeof(line_hooks[0]))
 
-static int alloc_file_ids(image_entry_t *list)
+int filelist_alloc_file_ids(image_entry_t *list)
 {
 	image_entry_t *ent;
 	uint64_t file_id = 0;
@@ -319,7 +323,7 @@ static int alloc_file_ids(image_entry_t *list)
 		if (!S_ISREG(ent->mode))
 			continue;
 
-		if (file_id > 0x00000000FFFFFFFFUL) {
+		if (file_id >= PKG_FILE_ID_PADDING) {
 			fprintf(stderr, "too many input files\n");
 			return -1;
 		}
@@ -340,7 +344,7 @@ int filelist_read(const char *filename, image_entry_t **out)
 	if (list != NULL) {
 		list = image_entry_sort(list);
 
-		if (alloc_file_ids(list))
+		if (filelist_alloc_file_ids(list))
 			goto fail;
 	}
 
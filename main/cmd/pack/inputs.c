@@ -0,0 +1,405 @@
+/* SPDX-License-Identifier: ISC */
+#include <inttypes.h>
+
+#include "pack.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325UL
+#define FNV_PRIME 0x100000001B3UL
+
+#define INPUTS_VERSION 1
+
+/*
+  The manifest is a text file next to the package, with a header line that
+  records the manifest version and the compressors used, a line with the
+  size and modification time of the package itself and one line per input
+  file:
+
+      pkg-inputs <version> <toc compressor> <data compressor>
+      output <size> <mtime sec> <mtime nsec>
+      input <size> <mtime sec> <mtime nsec> <content hash> <path>
+
+  The inputs are compared in order, so any change to the description or
+  the file list is a mismatch. An input whose size matches but whose time
+  stamp does not is hashed, so merely touching a file does not cause the
+  package to be rebuilt. For a staging directory, the time stamp of the
+  directory says nothing about the files below it, so instead of the
+  directory itself, the entries generated from it are hashed.
+ */
+typedef struct {
+	pack_inputs_t *inputs;
+	const char *pkgpath;
+	size_t index;
+	bool stale;
+} check_state_t;
+
+int pack_hash_file(const char *path, uint64_t *out)
+{
+	uint64_t hash = FNV_OFFSET_BASIS;
+	uint8_t buffer[65536];
+	ssize_t i, ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	for (;;) {
+		ret = read_retry(fd, buffer, sizeof(buffer));
+		if (ret < 0) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+
+		if (ret == 0)
+			break;
+
+		for (i = 0; i < ret; ++i) {
+			hash ^= buffer[i];
+			hash *= FNV_PRIME;
+		}
+	}
+
+	close(fd);
+	*out = hash;
+	return 0;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *ptr = data;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		hash ^= ptr[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static void hash_listing(input_stamp_t *stamp, const char *path,
+			 image_entry_t *list)
+{
+	uint64_t hash = FNV_OFFSET_BASIS, value;
+	image_entry_t *ent;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		hash = hash_bytes(hash, ent->name, strlen(ent->name) + 1);
+
+		value = ((uint64_t)ent->mode << 32) | ent->uid;
+		hash = hash_bytes(hash, &value, sizeof(value));
+		value = ent->gid;
+		hash = hash_bytes(hash, &value, sizeof(value));
+
+		switch (ent->mode & S_IFMT) {
+		case S_IFLNK:
+			hash = hash_bytes(hash, ent->data.symlink.target,
+					  strlen(ent->data.symlink.target) + 1);
+			break;
+		case S_IFCHR:
+		case S_IFBLK:
+			value = ent->data.device.devno;
+			hash = hash_bytes(hash, &value, sizeof(value));
+			break;
+		default:
+			break;
+		}
+	}
+
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->path = path;
+	stamp->hash = hash;
+	stamp->hashed = true;
+	stamp->listing = true;
+}
+
+static int stat_input(input_stamp_t *stamp, const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	stamp->path = path;
+	stamp->mode = sb.st_mode;
+	stamp->size = sb.st_size;
+	stamp->mtime = sb.st_mtim;
+	stamp->hashed = false;
+	return 0;
+}
+
+static bool same_time(const struct timespec *a, long long sec, long nsec)
+{
+	return a->tv_sec == sec && a->tv_nsec == nsec;
+}
+
+int pack_inputs_init(pack_inputs_t *inputs, const char *descfile,
+		     const char *filelist, const pkg_desc_t *desc,
+		     image_entry_t *list)
+{
+	input_stamp_t *stamp;
+	image_entry_t *ent;
+	size_t count = 2;
+
+	memset(inputs, 0, sizeof(*inputs));
+	inputs->toccmp = desc->toccmp->id;
+	inputs->datacmp = desc->datacmp->id;
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		if (S_ISREG(ent->mode))
+			count += 1;
+	}
+
+	inputs->stamps = calloc(count, sizeof(inputs->stamps[0]));
+	if (inputs->stamps == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	if (stat_input(inputs->stamps + inputs->count++, descfile))
+		goto fail;
+
+	if (filelist != NULL) {
+		stamp = inputs->stamps + inputs->count++;
+
+		if (stat_input(stamp, filelist))
+			goto fail;
+
+		if (S_ISDIR(stamp->mode))
+			hash_listing(stamp, filelist, list);
+	}
+
+	for (ent = list; ent != NULL; ent = ent->next) {
+		if (!S_ISREG(ent->mode))
+			continue;
+
+		if (stat_input(inputs->stamps + inputs->count++,
+			       ent->data.file.location)) {
+			goto fail;
+		}
+	}
+
+	return 0;
+fail:
+	pack_inputs_cleanup(inputs);
+	return -1;
+}
+
+static int check_output(check_state_t *st, char *line)
+{
+	unsigned long long size;
+	struct stat sb;
+	long long sec;
+	long nsec;
+
+	if (sscanf(line, "output %llu %lld %ld", &size, &sec, &nsec) != 3)
+		return -1;
+
+	if (stat(st->pkgpath, &sb) != 0)
+		return -1;
+
+	if ((unsigned long long)sb.st_size != size ||
+	    !same_time(&sb.st_mtim, sec, nsec)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_input(check_state_t *st, char *line)
+{
+	unsigned long long size;
+	input_stamp_t *stamp;
+	uint64_t hash;
+	long long sec;
+	int path_start;
+	long nsec;
+
+	if (st->index >= st->inputs->count)
+		return -1;
+
+	stamp = st->inputs->stamps + st->index++;
+
+	if (sscanf(line, "input %llu %lld %ld %" SCNx64 " %n",
+		   &size, &sec, &nsec, &hash, &path_start) != 4) {
+		return -1;
+	}
+
+	if (strcmp(line + path_start, stamp->path) != 0 ||
+	    stamp->size != size)
+		return -1;
+
+	if (stamp->listing)
+		return stamp->hash == hash ? 0 : -1;
+
+	if (same_time(&stamp->mtime, sec, nsec)) {
+		stamp->hash = hash;
+		stamp->hashed = true;
+		return 0;
+	}
+
+	if (pack_hash_file(stamp->path, &stamp->hash))
+		return -1;
+
+	stamp->hashed = true;
+	st->inputs->touched = true;
+	return stamp->hash == hash ? 0 : -1;
+}
+
+static int check_line(void *usr, const char *filename, size_t linenum,
+		      char *line)
+{
+	check_state_t *st = usr;
+	unsigned int version, toccmp, datacmp;
+	int ret;
+	(void)filename;
+
+	if (linenum == 1) {
+		ret = sscanf(line, "pkg-inputs %u %u %u",
+			     &version, &toccmp, &datacmp) == 3 &&
+			version == INPUTS_VERSION &&
+			toccmp == st->inputs->toccmp &&
+			datacmp == st->inputs->datacmp ? 0 : -1;
+	} else if (linenum == 2) {
+		ret = check_output(st, line);
+	} else {
+		ret = check_input(st, line);
+	}
+
+	if (ret != 0)
+		st->stale = true;
+
+	return ret;
+}
+
+int pack_inputs_check(pack_inputs_t *inputs, const char *manifest,
+		      const char *pkgpath)
+{
+	check_state_t st;
+	struct stat sb;
+
+	if (stat(manifest, &sb) != 0) {
+		if (errno == ENOENT)
+			return 0;
+
+		perror(manifest);
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	st.inputs = inputs;
+	st.pkgpath = pkgpath;
+
+	if (foreach_line_in_file(manifest, &st, check_line)) {
+		if (st.stale)
+			return 0;
+		return -1;
+	}
+
+	if (st.index != inputs->count)
+		return 0;
+
+	/* refresh the time stamps, so the files are not hashed again */
+	if (inputs->touched && pack_inputs_store(inputs, manifest, pkgpath))
+		return -1;
+
+	return 1;
+}
+
+int pack_inputs_store(pack_inputs_t *inputs, const char *manifest,
+		      const char *pkgpath)
+{
+	input_stamp_t *stamp;
+	struct stat sb;
+	char *tmpname;
+	size_t i;
+	FILE *fp;
+
+	/*
+	  Hash after packing, then check that nothing was modified in the
+	  meantime. If it was, no manifest is written and the next run packs
+	  again.
+	 */
+	for (i = 0; i < inputs->count; ++i) {
+		stamp = inputs->stamps + i;
+
+		if (stamp->listing)
+			continue;
+
+		if (!stamp->hashed) {
+			if (pack_hash_file(stamp->path, &stamp->hash))
+				return -1;
+			stamp->hashed = true;
+		}
+
+		if (stat(stamp->path, &sb) != 0) {
+			perror(stamp->path);
+			return -1;
+		}
+
+		if ((uint64_t)sb.st_size != stamp->size ||
+		    !same_time(&sb.st_mtim, stamp->mtime.tv_sec,
+			       stamp->mtime.tv_nsec)) {
+			fprintf(stderr, "%s: modified while packing\n",
+				stamp->path);
+			return 0;
+		}
+	}
+
+	if (stat(pkgpath, &sb) != 0) {
+		perror(pkgpath);
+		return -1;
+	}
+
+	tmpname = alloca(strlen(manifest) + 5);
+	sprintf(tmpname, "%s.tmp", manifest);
+
+	fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		perror(tmpname);
+		return -1;
+	}
+
+	fprintf(fp, "pkg-inputs %u %u %u\n", INPUTS_VERSION,
+		(unsigned int)inputs->toccmp, (unsigned int)inputs->datacmp);
+
+	fprintf(fp, "output %llu %lld %ld\n", (unsigned long long)sb.st_size,
+		(long long)sb.st_mtim.tv_sec, (long)sb.st_mtim.tv_nsec);
+
+	for (i = 0; i < inputs->count; ++i) {
+		stamp = inputs->stamps + i;
+
+		fprintf(fp, "input %llu %lld %ld %016" PRIx64 " %s\n",
+			(unsigned long long)stamp->size,
+			(long long)stamp->mtime.tv_sec,
+			(long)stamp->mtime.tv_nsec, stamp->hash, stamp->path);
+	}
+
+	if (fflush(fp) != 0 || ferror(fp)) {
+		perror(tmpname);
+		fclose(fp);
+		unlink(tmpname);
+		return -1;
+	}
+
+	fclose(fp);
+
+	if (rename(tmpname, manifest) != 0) {
+		perror(manifest);
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+void pack_inputs_cleanup(pack_inputs_t *inputs)
+{
+	free(inputs->stamps);
+	memset(inputs, 0, sizeof(*inputs));
+}
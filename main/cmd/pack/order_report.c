@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: ISC */
+#include <time.h>
+
+#include "pkg/pkgreader.h"
+#include "pkg/pkgio.h"
+
+#include "pack.h"
+
+/*
+  The package is generated and unpacked once per data order, using a
+  scratch package file and directory in the repository directory. All
+  input files are read once up front, so the first order measured does not
+  pay for a cold page cache.
+ */
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static int warm_up(image_entry_t *list)
+{
+	uint8_t buffer[65536];
+	ssize_t ret;
+	int fd;
+
+	for (; list != NULL; list = list->next) {
+		if (!S_ISREG(list->mode))
+			continue;
+
+		fd = open(list->data.file.location, O_RDONLY);
+		if (fd < 0) {
+			perror(list->data.file.location);
+			return -1;
+		}
+
+		do {
+			ret = read_retry(fd, buffer, sizeof(buffer));
+		} while (ret > 0);
+
+		close(fd);
+
+		if (ret < 0) {
+			perror(list->data.file.location);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  The list is sorted with directories first, ordered by the length of
+  their names, so walking it backwards removes every entry before the
+  directory that contains it.
+ */
+static int remove_unpacked(int dirfd, image_entry_t *list)
+{
+	image_entry_t **array, *ent;
+	size_t i, count = 0;
+	int ret = 0;
+
+	for (ent = list; ent != NULL; ent = ent->next)
+		count += 1;
+
+	array = calloc(count ? count : 1, sizeof(array[0]));
+	if (array == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	for (i = 0, ent = list; ent != NULL; ent = ent->next)
+		array[i++] = ent;
+
+	while (i-- > 0) {
+		ent = array[i];
+
+		if (unlinkat(dirfd, ent->name,
+			     S_ISDIR(ent->mode) ? AT_REMOVEDIR : 0) != 0 &&
+		    errno != ENOENT) {
+			perror(ent->name);
+			ret = -1;
+		}
+	}
+
+	free(array);
+	return ret;
+}
+
+static int measure_unpack(const char *pkgpath, const char *tmpdir,
+			  image_entry_t *list, double *seconds)
+{
+	pkg_unpack_stats_t stats;
+	struct timespec start;
+	pkg_reader_t *rd;
+	int dirfd, ret;
+
+	if (mkdir(tmpdir, 0755) != 0 && errno != EEXIST) {
+		perror(tmpdir);
+		return -1;
+	}
+
+	dirfd = open(tmpdir, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		perror(tmpdir);
+		return -1;
+	}
+
+	rd = pkg_reader_open(pkgpath);
+	if (rd == NULL) {
+		close(dirfd);
+		return -1;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = pkg_unpack(dirfd, UNPACK_NO_CHOWN | UNPACK_NO_DEVICES, rd,
+			 NULL, &stats);
+
+	*seconds = elapsed(&start);
+	pkg_reader_close(rd);
+
+	if (remove_unpacked(dirfd, list))
+		ret = -1;
+
+	close(dirfd);
+
+	if (rmdir(tmpdir) != 0) {
+		perror(tmpdir);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int measure_order(pkg_desc_t *desc, image_entry_t *list,
+			 const char *pkgpath, const char *tmpdir,
+			 size_t num_jobs, DATA_ORDER order)
+{
+	double pack_time, unpack_time;
+	struct timespec start;
+	pkg_writer_t *wr;
+	struct stat sb;
+	int ret;
+
+	if (data_order_apply(list, order))
+		return -1;
+
+	if (desc->deduplicate && pack_dedup_files(list, num_jobs) < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	wr = pkg_writer_open(pkgpath, true);
+	if (wr == NULL)
+		return -1;
+
+	ret = write_package(wr, desc, list, NULL);
+	pkg_writer_close(wr);
+
+	pack_time = elapsed(&start);
+
+	if (ret != 0 || stat(pkgpath, &sb) != 0) {
+		if (ret == 0)
+			perror(pkgpath);
+		return -1;
+	}
+
+	if (measure_unpack(pkgpath, tmpdir, list, &unpack_time))
+		return -1;
+
+	printf("%-12s %12llu %9.3fs %9.3fs%s\n", data_order_name(order),
+	       (unsigned long long)sb.st_size, pack_time, unpack_time,
+	       order == desc->data_order ? "  (configured)" : "");
+	return 0;
+}
+
+int pack_order_report(const char *descfile, const char *filelist,
+		      const pack_options_t *opt)
+{
+	image_entry_t *list = NULL;
+	char *pkgpath, *tmpdir;
+	pkg_desc_t desc;
+	int i, ret = -1;
+
+	if (desc_read(descfile, &desc))
+		return -1;
+
+	if (filelist != NULL && pack_read_entries(filelist, opt, &list))
+		goto out;
+
+	if (mkdir_p(opt->repodir) || warm_up(list))
+		goto out;
+
+	pkgpath = alloca(strlen(opt->repodir) + strlen(desc.name) + 32);
+	sprintf(pkgpath, "%s/%s.pkg.order-report", opt->repodir, desc.name);
+
+	tmpdir = alloca(strlen(pkgpath) + 8);
+	sprintf(tmpdir, "%s.root", pkgpath);
+
+	printf("%-12s %12s %10s %10s\n", "data order", "size",
+	       "pack", "unpack");
+
+	for (i = 0; i < DATA_ORDER_COUNT; ++i) {
+		if (measure_order(&desc, list, pkgpath, tmpdir,
+				  opt->num_jobs, i))
+			break;
+	}
+
+	ret = i == DATA_ORDER_COUNT ? 0 : -1;
+
+	if (unlink(pkgpath) != 0 && errno != ENOENT) {
+		perror(pkgpath);
+		ret = -1;
+	}
+out:
+	image_entry_free_list(list);
+	desc_free(&desc);
+	return ret;
+}
@@ -6,33 +6,266 @@ static const struct option long_opts[] = {
 	{ "file-list", required_argument, NULL, 'l' },
 	{ "repo-dir", required_argument, NULL, 'r' },
 	{ "force", no_argument, NULL, 'f' },
+	{ "batch", required_argument, NULL, 'b' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "incremental", no_argument, NULL, 'i' },
+	{ "from-dir", required_argument, NULL, 'F' },
+	{ "owner-map", required_argument, NULL, 'O' },
+	{ "order-report", no_argument, NULL, 'R' },
+	{ "stats", no_argument, NULL, 's' },
+	{ "output", required_argument, NULL, 'o' },
 	{ NULL, 0, NULL, 0 },
 };
 
-static const char *short_opts = "l:r:d:f";
+static const char *short_opts = "l:r:d:fb:j:iF:O:Rso:";
 
-static pkg_writer_t *open_writer(pkg_desc_t *desc, const char *repodir,
-				 bool force)
+int pack_read_entries(const char *filelist, const pack_options_t *opt,
+		      image_entry_t **out)
 {
-	char *path;
+	struct stat sb;
 
-	if (mkdir_p(repodir))
-		return NULL;
+	if (stat(filelist, &sb) != 0) {
+		perror(filelist);
+		return -1;
+	}
 
-	path = alloca(strlen(repodir) + strlen(desc->name) + 16);
-	sprintf(path, "%s/%s.pkg", repodir, desc->name);
+	if (S_ISDIR(sb.st_mode))
+		return filelist_scan(filelist, opt->owners, opt->num_jobs, out);
 
-	return pkg_writer_open(path, force);
+	return filelist_read(filelist, out);
 }
 
-static int cmd_pack(int argc, char **argv)
+static int has_shared_files(image_entry_t *list)
+{
+	image_entry_t **index;
+	size_t i, count;
+	int ret = 0;
+
+	index = image_entry_file_index(list, &count);
+	if (index == NULL)
+		return -1;
+
+	for (i = 1; i < count; ++i) {
+		if (index[i]->data.file.id == index[i - 1]->data.file.id) {
+			ret = 1;
+			break;
+		}
+	}
+
+	free(index);
+	return ret;
+}
+
+int write_package(pkg_writer_t *wr, pkg_desc_t *desc, image_entry_t *list,
+		  read_stats_t *stats)
+{
+	int ret;
+
+	/*
+	  Older readers know neither padding entries in the data records nor
+	  files that share data, so the newer header magic is only used for
+	  packages that may contain either.
+	 */
+	ret = desc->data_alignment > 0 ? 1 : has_shared_files(list);
+	if (ret < 0)
+		return -1;
+
+	if (ret > 0)
+		pkg_writer_set_magic(wr, PKG_MAGIC_HEADER_V2);
+
+	if (write_header_data(wr, desc))
+		return -1;
+
+	if (list != NULL) {
+		if (write_toc(wr, list, desc->toccmp))
+			return -1;
+
+		if (write_files(wr, list, desc->datacmp,
+				desc->data_alignment, stats)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static double ns_to_s(uint64_t ns)
+{
+	return (double)ns / 1000000000.0;
+}
+
+static double to_mib(uint64_t bytes)
+{
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+static void print_stats(FILE *out, const char *name, const read_stats_t *rd,
+			const pkg_writer_stats_t *wr, uint64_t total_ns)
+{
+	fprintf(out, "%s: read: %zu files, %.1f MiB prefetched in %.3fs on "
+		"%zu threads, %.1f MiB read by the compressor in %.3fs, "
+		"%.1f MiB copied by the kernel\n",
+		name, rd->files, to_mib(rd->prefetch_bytes),
+		ns_to_s(rd->prefetch_ns), rd->num_readers,
+		to_mib(rd->inline_bytes), ns_to_s(rd->inline_read_ns),
+		to_mib(rd->copied_bytes));
+
+	fprintf(out, "%s: compress: %.1f MiB to %.1f MiB in %.3fs, waited "
+		"%.3fs for input and %.3fs for output\n", name,
+		to_mib(wr->bytes_in), to_mib(wr->bytes_written),
+		ns_to_s(wr->compress_ns), ns_to_s(rd->input_wait_ns),
+		ns_to_s(wr->output_wait_ns));
+
+	fprintf(out, "%s: write: %.1f MiB in %.3fs\n", name,
+		to_mib(wr->bytes_written), ns_to_s(wr->write_ns));
+
+	fprintf(out, "%s: total: %.3fs\n", name, ns_to_s(total_ns));
+}
+
+int pack_package(const char *descfile, const char *filelist,
+		 const pack_options_t *opt)
 {
-	const char *filelist = NULL, *repodir = NULL, *descfile = NULL;
 	image_entry_t *list = NULL;
-	bool force = false;
+	char *path, *manifest;
+	pack_inputs_t inputs;
+	pkg_writer_stats_t wrstats;
+	struct timespec start, end;
+	read_stats_t rdstats;
 	pkg_writer_t *wr;
+	bool to_stdout = false;
 	pkg_desc_t desc;
-	int i;
+	int ret = -1;
+
+	memset(&inputs, 0, sizeof(inputs));
+	memset(&rdstats, 0, sizeof(rdstats));
+
+	if (desc_read(descfile, &desc))
+		return -1;
+
+	if (filelist != NULL && pack_read_entries(filelist, opt, &list))
+		goto out;
+
+	if (opt->output != NULL) {
+		path = (char *)opt->output;
+		to_stdout = strcmp(path, "-") == 0;
+	} else {
+		if (mkdir_p(opt->repodir))
+			goto out;
+
+		path = alloca(strlen(opt->repodir) + strlen(desc.name) + 16);
+		sprintf(path, "%s/%s.pkg", opt->repodir, desc.name);
+	}
+
+	manifest = alloca(strlen(path) + 8);
+	sprintf(manifest, "%s.inputs", path);
+
+	if (opt->incremental) {
+		if (pack_inputs_init(&inputs, descfile, filelist, &desc, list))
+			goto out;
+
+		ret = pack_inputs_check(&inputs, manifest, path);
+		if (ret != 0)
+			goto out;
+
+		ret = -1;
+
+		/* a failed run must not leave a valid looking manifest */
+		if (unlink(manifest) != 0 && errno != ENOENT) {
+			perror(manifest);
+			goto out;
+		}
+	}
+
+	/*
+	  Both may read the input files, so they are only done once the
+	  package is known to be out of date. The manifest does not depend
+	  on the file IDs they assign.
+	 */
+	if (data_order_apply(list, desc.data_order))
+		goto out;
+
+	if (desc.deduplicate && pack_dedup_files(list, opt->num_jobs) < 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (to_stdout) {
+		wr = pkg_writer_open_stream(STDOUT_FILENO, "stdout");
+	} else {
+		wr = pkg_writer_open(path, opt->force || opt->incremental);
+	}
+
+	if (wr == NULL)
+		goto out;
+
+	if (write_package(wr, &desc, list, &rdstats)) {
+		pkg_writer_close(wr);
+		goto out;
+	}
+
+	pkg_writer_get_stats(wr, &wrstats);
+	pkg_writer_close(wr);
+
+	if (opt->stats) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		print_stats(to_stdout ? stderr : stdout, desc.name,
+			    &rdstats, &wrstats,
+			    (uint64_t)(end.tv_sec - start.tv_sec) *
+			    1000000000UL + end.tv_nsec - start.tv_nsec);
+	}
+
+	if (opt->incremental && pack_inputs_store(&inputs, manifest, path))
+		goto out;
+
+	ret = 0;
+out:
+	pack_inputs_cleanup(&inputs);
+	image_entry_free_list(list);
+	desc_free(&desc);
+	return ret;
+}
+
+/*
+  A file list belongs to the description file given right before it, unless
+  that one already has a list, in which case it is kept for the next one.
+  This way, "-d <desc> -l <list>" and "-l <list> -d <desc>" both work.
+ */
+static int set_file_list(pack_batch_t *batch, const char **pending,
+			 const char *filelist)
+{
+	pack_job_t *last = batch->count ? batch->jobs + batch->count - 1 : NULL;
+
+	if (*pending != NULL) {
+		fputs("multiple file lists for the same package\n", stderr);
+		return -1;
+	}
+
+	if (last != NULL && last->filelist == NULL) {
+		last->filelist = strdup(filelist);
+		if (last->filelist == NULL) {
+			fputs("out of memory\n", stderr);
+			return -1;
+		}
+	} else {
+		*pending = filelist;
+	}
+
+	return 0;
+}
+
+static int cmd_pack(int argc, char **argv)
+{
+	bool batch_mode = false, report = false;
+	const char *pending = NULL;
+	owner_rule_t *owners = NULL;
+	pack_options_t opt;
+	pack_batch_t batch;
+	int i, ret;
+	long cpus;
+
+	memset(&batch, 0, sizeof(batch));
+	memset(&opt, 0, sizeof(opt));
 
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
@@ -41,67 +274,118 @@ static int cmd_pack(int argc, char **argv)
 
 		switch (i) {
 		case 'l':
-			filelist = optarg;
+		case 'F':
+			if (set_file_list(&batch, &pending, optarg))
+				goto fail;
 			break;
 		case 'd':
-			descfile = optarg;
+			if (pack_batch_add(&batch, optarg, pending))
+				goto fail;
+			pending = NULL;
+			break;
+		case 'b':
+			if (pack_batch_read(&batch, optarg))
+				goto fail;
+			batch_mode = true;
+			break;
+		case 'O':
+			owner_map_free(owners);
+			if (owner_map_read(optarg, &owners))
+				goto fail;
+			opt.owners = owners;
+			break;
+		case 'j':
+			opt.num_jobs = strtoul(optarg, NULL, 10);
+			if (opt.num_jobs == 0) {
+				fprintf(stderr, "invalid number of jobs: %s\n",
+					optarg);
+				goto fail;
+			}
 			break;
 		case 'r':
-			repodir = optarg;
+			opt.repodir = optarg;
 			break;
 		case 'f':
-			force = true;
+			opt.force = true;
+			break;
+		case 'i':
+			opt.incremental = true;
+			break;
+		case 'R':
+			report = true;
+			break;
+		case 's':
+			opt.stats = true;
+			break;
+		case 'o':
+			opt.output = optarg;
 			break;
 		default:
 			tell_read_help(argv[0]);
-			return EXIT_FAILURE;
+			goto fail;
 		}
 	}
 
-	if (descfile == NULL) {
+	if (pending != NULL) {
+		fprintf(stderr, "%s: file list without package description\n",
+			pending);
+		tell_read_help(argv[0]);
+		goto fail;
+	}
+
+	if (batch.count == 0 && !batch_mode) {
 		fputs("missing argument: package description file\n", stderr);
 		tell_read_help(argv[0]);
-		return EXIT_FAILURE;
+		goto fail;
+	}
+
+	if (opt.repodir == NULL) {
+		opt.repodir = REPODIR;
 	}
 
-	if (repodir == NULL) {
-		repodir = REPODIR;
+	if (opt.num_jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opt.num_jobs = cpus > 0 ? cpus : 1;
 	}
 
 	if (optind < argc)
 		fputs("warning: ignoring extra arguments\n", stderr);
 
-	if (desc_read(descfile, &desc))
-		return EXIT_FAILURE;
-
-	if (filelist != NULL && filelist_read(filelist, &list))
-		goto fail_desc;
-
-	wr = open_writer(&desc, repodir, force);
-	if (wr == NULL)
-		goto fail_fp;
+	if (report && (batch.count != 1 || batch_mode)) {
+		fputs("the data order report needs exactly one package\n",
+		      stderr);
+		goto fail;
+	}
 
-	if (write_header_data(wr, &desc))
+	if (opt.output != NULL && (batch.count != 1 || batch_mode || report)) {
+		fputs("an output file can only be set for a single package\n",
+		      stderr);
 		goto fail;
+	}
 
-	if (list != NULL) {
-		if (write_toc(wr, list, desc.toccmp))
-			goto fail;
+	if (opt.output != NULL && opt.incremental &&
+	    strcmp(opt.output, "-") == 0) {
+		fputs("incremental mode needs an output file, not stdout\n",
+		      stderr);
+		goto fail;
+	}
 
-		if (write_files(wr, list, desc.datacmp))
-			goto fail;
+	if (report) {
+		ret = pack_order_report(batch.jobs[0].descfile,
+					batch.jobs[0].filelist, &opt);
+	} else if (batch.count == 1 && !batch_mode) {
+		ret = pack_package(batch.jobs[0].descfile,
+				   batch.jobs[0].filelist, &opt);
+	} else {
+		ret = pack_batch_run(&batch, &opt, opt.num_jobs, true);
 	}
 
-	pkg_writer_close(wr);
-	image_entry_free_list(list);
-	desc_free(&desc);
-	return EXIT_SUCCESS;
+	owner_map_free(owners);
+	pack_batch_cleanup(&batch);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 fail:
-	pkg_writer_close(wr);
-fail_fp:
-	image_entry_free_list(list);
-fail_desc:
-	desc_free(&desc);
+	owner_map_free(owners);
+	pack_batch_cleanup(&batch);
 	return EXIT_FAILURE;
 }
 
@@ -121,7 +405,49 @@ static command_t pack = {
 "                           dependencies, the actual package name, etc.\n"
 "  --force, -f              If a package with the same name already exists,\n"
 "                           overwrite it.\n"
-"\n",
+"  --from-dir, -F <path>    Instead of a file list, pack the contents of a\n"
+"                           staging directory. A directory given to -l or\n"
+"                           in a manifest is treated the same way.\n"
+"  --owner-map, -O <path>   Ownership of the files in a staging directory.\n"
+"                           Each line holds a shell wildcard pattern that\n"
+"                           is matched against the full path, a UID and a\n"
+"                           GID. The last matching line wins. Files that\n"
+"                           no line matches belong to 0:0.\n"
+"  --order-report, -R       Instead of storing the package, generate and\n"
+"                           unpack it with every data order and compare the\n"
+"                           package size and the time it took.\n"
+"  --output, -o <path>      Write the package to this file instead of the\n"
+"                           repository. With \"-\", the package is written\n"
+"                           to stdout, which may also be a pipe.\n"
+"  --stats, -s              Print how much time each stage of the packer\n"
+"                           (input, compression, output) spent working or\n"
+"                           waiting for the others.\n"
+"  --batch, -b <path>       Read a manifest with one package per line,\n"
+"                           consisting of the description file and an\n"
+"                           optional file list, separated by white space.\n"
+"  --incremental, -i        Record the inputs of a package in a manifest next\n"
+"                           to it. If the package and all inputs are still\n"
+"                           the same on the next run, keep the package,\n"
+"                           otherwise overwrite it.\n"
+"  --jobs, -j <count>       Number of packages to generate in parallel if\n"
+"                           more than one is packed, and of threads used to\n"
+"                           scan a staging directory. Defaults to the number\n"
+"                           of online CPUs.\n"
+"\n"
+"Multiple packages can also be generated by passing more than one\n"
+"description file, each followed by its file list. In that case, or with a\n"
+"manifest, the time spent on each package is printed once all are done.\n"
+"\n"
+"The order of the file data in a package can be set in the description\n"
+"with `data-order <order>`: \"size\" (default), \"directory\", \"type\"\n"
+"(by file name extension) or \"similarity\" (by kind of content).\n"
+"\n"
+"With `data-alignment <bytes>` and the data compressor `none`, the data of\n"
+"files at least that large starts at a multiple of it within the package,\n"
+"so unpacking can reflink it on file systems that support this.\n"
+"\n"
+"Files with identical content are stored only once, unless the description\n"
+"contains `deduplicate no`.\n",
 	.run_cmd = cmd_pack,
 };
 
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 #include <ctype.h>
 #include <fcntl.h>
 
@@ -33,13 +34,104 @@ typedef struct dependency_t {
 	char name[];
 } dependency_t;
 
+typedef enum {
+	DATA_ORDER_SIZE = 0,
+	DATA_ORDER_DIRECTORY,
+	DATA_ORDER_TYPE,
+	DATA_ORDER_SIMILARITY,
+
+	DATA_ORDER_COUNT,
+} DATA_ORDER;
+
 typedef struct {
 	compressor_t *datacmp;
 	compressor_t *toccmp;
 	dependency_t *deps;
+	DATA_ORDER data_order;
+
+	/* if not 0, the alignment of file data in the package */
+	size_t data_alignment;
+
+	/* store the content of identical files only once */
+	bool deduplicate;
+
 	char *name;
 } pkg_desc_t;
 
+typedef struct owner_rule_t {
+	struct owner_rule_t *next;
+	uid_t uid;
+	gid_t gid;
+	char pattern[];
+} owner_rule_t;
+
+typedef struct {
+	const char *repodir;
+
+	/* if set, the package file to write instead of one in repodir */
+	const char *output;
+	const owner_rule_t *owners;
+	size_t num_jobs;
+	bool force;
+	bool incremental;
+	bool stats;
+} pack_options_t;
+
+typedef struct {
+	size_t files;
+	size_t num_readers;
+
+	/* small files read entirely by the reader threads */
+	uint64_t prefetch_bytes;
+	uint64_t prefetch_ns;
+
+	/* large files, read by the compressor after the readers opened them */
+	uint64_t inline_bytes;
+	uint64_t inline_read_ns;
+
+	/* large files copied into uncompressed records by the kernel */
+	uint64_t copied_bytes;
+
+	/* nano seconds the compressor waited for the readers */
+	uint64_t input_wait_ns;
+} read_stats_t;
+
+typedef struct {
+	const char *path;
+	mode_t mode;
+	uint64_t size;
+	struct timespec mtime;
+	uint64_t hash;
+	bool hashed;
+
+	/* a staging directory, hashed by the entries generated from it */
+	bool listing;
+} input_stamp_t;
+
+typedef struct {
+	input_stamp_t *stamps;
+	size_t count;
+	unsigned int toccmp;
+	unsigned int datacmp;
+
+	/* set if an input was found unchanged by content, but not time */
+	bool touched;
+} pack_inputs_t;
+
+typedef struct {
+	char *descfile;
+	char *filelist;
+
+	int status;
+	double seconds;
+} pack_job_t;
+
+typedef struct {
+	pack_job_t *jobs;
+	size_t count;
+	size_t max;
+} pack_batch_t;
+
 int filelist_mkdir(char *line, const char *filename,
 		   size_t linenum, void *obj);
 
@@ -51,9 +143,35 @@ int filelist_mkfile(char *line, const char *filename,
 
 int filelist_read(const char *filename, image_entry_t **out);
 
+int filelist_alloc_file_ids(image_entry_t *list);
+
+/*
+  Generate the list of entries from the contents of a staging directory,
+  using a number of threads to read the directories. The ownership of the
+  entries is taken from a list of rules (see owner_map_read), everything
+  else from the files themselves.
+ */
+int filelist_scan(const char *root, const owner_rule_t *owners,
+		  size_t num_workers, image_entry_t **out);
+
+/*
+  Read "<pattern> <uid> <gid>" lines. The pattern is a shell wildcard
+  matched against the full path of an entry, the last matching rule wins.
+  Entries that no rule matches belong to root.
+ */
+int owner_map_read(const char *path, owner_rule_t **out);
+
+void owner_map_free(owner_rule_t *rules);
+
 int write_toc(pkg_writer_t *wr, image_entry_t *list, compressor_t *cmp);
 
-int write_files(pkg_writer_t *wr, image_entry_t *list, compressor_t *cmp);
+/*
+  If alignment is not 0, the data of files that are at least that large
+  starts at a multiple of it in the package file. If stats is not NULL, it
+  receives the counters of the input stage.
+ */
+int write_files(pkg_writer_t *wr, image_entry_t *list, compressor_t *cmp,
+		size_t alignment, read_stats_t *stats);
 
 int desc_read(const char *path, pkg_desc_t *desc);
 
@@ -61,4 +179,80 @@ void desc_free(pkg_desc_t *desc);
 
 int write_header_data(pkg_writer_t *wr, pkg_desc_t *desc);
 
+/*
+  Generate a package from a description and an optional file list. Returns
+  0 on success, -1 on failure and 1 if an incremental run found the package
+  up to date.
+ */
+int pack_package(const char *descfile, const char *filelist,
+		 const pack_options_t *opt);
+
+/* Read a file list, or scan a staging directory if given one instead. */
+int pack_read_entries(const char *filelist, const pack_options_t *opt,
+		      image_entry_t **out);
+
+int write_package(pkg_writer_t *wr, pkg_desc_t *desc, image_entry_t *list,
+		  read_stats_t *stats);
+
+/* Returns the DATA_ORDER for a name or -1 if there is none. */
+int data_order_from_name(const char *name);
+
+const char *data_order_name(DATA_ORDER order);
+
+/* Reassign the file IDs of a sorted list, according to a data order. */
+int data_order_apply(image_entry_t *list, DATA_ORDER order);
+
+/*
+  Pack a package once for every data order and print the package size and
+  the time it took to generate and to unpack it. The package itself is not
+  stored in the repository.
+ */
+int pack_order_report(const char *descfile, const char *filelist,
+		      const pack_options_t *opt);
+
+int pack_batch_add(pack_batch_t *batch, const char *descfile,
+		   const char *filelist);
+
+/* Add a job for each "<description> [<file list>]" line of a manifest. */
+int pack_batch_read(pack_batch_t *batch, const char *manifest);
+
+/*
+  Pack all jobs of a batch on a pool of worker threads. If report is set,
+  the time spent on each package is printed once all of them are done.
+  Returns -1 if any of the packages could not be generated.
+ */
+int pack_batch_run(pack_batch_t *batch, const pack_options_t *opt,
+		   size_t num_workers, bool report);
+
+void pack_batch_cleanup(pack_batch_t *batch);
+
+/* Stat the description, the file list and all regular input files. */
+int pack_inputs_init(pack_inputs_t *inputs, const char *descfile,
+		     const char *filelist, const pkg_desc_t *desc,
+		     image_entry_t *list);
+
+/*
+  Compare the inputs against the manifest stored with a package. Returns 1
+  if neither the inputs nor the package changed, 0 if the package has to be
+  generated again and -1 on failure.
+ */
+int pack_inputs_check(pack_inputs_t *inputs, const char *manifest,
+		      const char *pkgpath);
+
+int pack_inputs_store(pack_inputs_t *inputs, const char *manifest,
+		      const char *pkgpath);
+
+void pack_inputs_cleanup(pack_inputs_t *inputs);
+
+/* FNV-1a hash of the content of a file, as stored in the manifest. */
+int pack_hash_file(const char *path, uint64_t *out);
+
+/*
+  Give files with identical content the same ID, so their data is only
+  stored once, and renumber the IDs without gaps, keeping their order.
+  The files are hashed on a number of threads. Returns the number of
+  files that share the data of another one or -1 on failure.
+ */
+int pack_dedup_files(image_entry_t *list, size_t num_workers);
+
 #endif /* PACK_H */
@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: ISC */
+#include <pthread.h>
+#include <fnmatch.h>
+#include <dirent.h>
+
+#include "pack.h"
+
+/*
+  The staging tree is walked by a pool of workers sharing a queue of
+  directories that still have to be read. Each worker collects the entries
+  it creates in a list of its own, the lists are joined once the queue has
+  run dry. Since the resulting order depends on the scheduling, the entries
+  are sorted by name before they are handed to image_entry_sort, which
+  keeps entries that compare equal in their original order.
+ */
+typedef struct scan_dir_t {
+	struct scan_dir_t *next;
+	char path[];
+} scan_dir_t;
+
+typedef struct {
+	const char *root;
+	int rootfd;
+	const owner_rule_t *owners;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+
+	scan_dir_t *queue;
+	size_t busy;
+	bool failed;
+} scan_state_t;
+
+typedef struct {
+	scan_state_t *st;
+	image_entry_t *list;
+} scan_worker_t;
+
+static int owner_map_line(void *usr, const char *filename, size_t linenum,
+			  char *line)
+{
+	owner_rule_t ***tail = usr, *rule;
+	unsigned long uid, gid;
+	char *end;
+
+	if (*line == '#')
+		return 0;
+
+	for (end = line; *end != '\0' && !isspace(*end); ++end)
+		;
+
+	if (sscanf(end, "%lu %lu", &uid, &gid) != 2) {
+		input_file_complain(filename, linenum,
+				    "expected pattern, UID and GID");
+		return -1;
+	}
+
+	rule = calloc(1, sizeof(*rule) + (end - line) + 1);
+	if (rule == NULL) {
+		input_file_complain(filename, linenum, "out of memory");
+		return -1;
+	}
+
+	memcpy(rule->pattern, line, end - line);
+	rule->uid = uid;
+	rule->gid = gid;
+
+	**tail = rule;
+	*tail = &rule->next;
+	return 0;
+}
+
+int owner_map_read(const char *path, owner_rule_t **out)
+{
+	owner_rule_t **tail = out;
+
+	*out = NULL;
+
+	if (foreach_line_in_file(path, &tail, owner_map_line)) {
+		owner_map_free(*out);
+		*out = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void owner_map_free(owner_rule_t *rules)
+{
+	owner_rule_t *rule;
+
+	while (rules != NULL) {
+		rule = rules;
+		rules = rules->next;
+		free(rule);
+	}
+}
+
+static void apply_owner(const owner_rule_t *rule, image_entry_t *ent)
+{
+	/* everything belongs to root, unless a rule says otherwise */
+	ent->uid = 0;
+	ent->gid = 0;
+
+	for (; rule != NULL; rule = rule->next) {
+		if (fnmatch(rule->pattern, ent->name, 0) == 0) {
+			ent->uid = rule->uid;
+			ent->gid = rule->gid;
+		}
+	}
+}
+
+static int push_dir(scan_state_t *st, const char *path)
+{
+	scan_dir_t *dir = calloc(1, sizeof(*dir) + strlen(path) + 1);
+
+	if (dir == NULL) {
+		fputs("out of memory\n", stderr);
+		return -1;
+	}
+
+	strcpy(dir->path, path);
+
+	pthread_mutex_lock(&st->mtx);
+	dir->next = st->queue;
+	st->queue = dir;
+	st->busy += 1;
+	pthread_cond_signal(&st->cond);
+	pthread_mutex_unlock(&st->mtx);
+	return 0;
+}
+
+/*
+  Returns 0 on success, 1 if the entry is skipped and -1 on failure.
+ */
+static int mkentry(scan_state_t *st, int dfd, const char *name,
+		   const char *relpath, image_entry_t **out)
+{
+	image_entry_t *ent = NULL;
+	struct stat sb;
+	ssize_t ret;
+
+	if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+		fprintf(stderr, "%s/%s: %s\n", st->root, relpath,
+			strerror(errno));
+		return -1;
+	}
+
+	switch (sb.st_mode & S_IFMT) {
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFLNK:
+	case S_IFCHR:
+	case S_IFBLK:
+		break;
+	default:
+		fprintf(stderr, "%s/%s: ignoring unsupported file type\n",
+			st->root, relpath);
+		return 1;
+	}
+
+	if (strlen(relpath) > 0xFFFF) {
+		fprintf(stderr, "%s/%s: name too long\n", st->root, relpath);
+		return -1;
+	}
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent == NULL)
+		goto fail_oom;
+
+	ent->name = strdup(relpath);
+	if (ent->name == NULL)
+		goto fail_oom;
+
+	ent->mode = sb.st_mode;
+	apply_owner(st->owners, ent);
+
+	switch (sb.st_mode & S_IFMT) {
+	case S_IFREG:
+		ent->data.file.size = sb.st_size;
+		ent->data.file.location = malloc(strlen(st->root) +
+						 strlen(relpath) + 2);
+		if (ent->data.file.location == NULL)
+			goto fail_oom;
+
+		sprintf(ent->data.file.location, "%s/%s", st->root, relpath);
+		break;
+	case S_IFLNK:
+		if (sb.st_size > 0xFFFF) {
+			fprintf(stderr, "%s/%s: symlink target too long\n",
+				st->root, relpath);
+			goto fail;
+		}
+
+		ent->data.symlink.target = calloc(1, sb.st_size + 1);
+		if (ent->data.symlink.target == NULL)
+			goto fail_oom;
+
+		ret = readlinkat(dfd, name, ent->data.symlink.target,
+				 sb.st_size + 1);
+		if (ret < 0 || ret > sb.st_size) {
+			fprintf(stderr, "%s/%s: %s\n", st->root, relpath,
+				ret < 0 ? strerror(errno) :
+				"symlink changed while scanning");
+			goto fail;
+		}
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		ent->data.device.devno = sb.st_rdev;
+		break;
+	}
+
+	*out = ent;
+	return 0;
+fail_oom:
+	fputs("out of memory\n", stderr);
+fail:
+	if (ent != NULL)
+		image_entry_free(ent);
+	return -1;
+}
+
+static int scan_dir(scan_state_t *st, const scan_dir_t *dir,
+		    image_entry_t **list)
+{
+	size_t len, size = 0, plen = strlen(dir->path);
+	char *relpath = NULL, *new;
+	image_entry_t *ent;
+	struct dirent *de;
+	int fd, status, ret = -1;
+	DIR *dp;
+
+	fd = openat(st->rootfd, plen > 0 ? dir->path : ".",
+		    O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || (dp = fdopendir(fd)) == NULL) {
+		fprintf(stderr, "%s/%s: %s\n", st->root, dir->path,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	for (;;) {
+		errno = 0;
+		de = readdir(dp);
+
+		if (de == NULL) {
+			if (errno != 0) {
+				fprintf(stderr, "%s/%s: %s\n", st->root,
+					dir->path, strerror(errno));
+				goto out;
+			}
+			break;
+		}
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		/* one buffer for all entries, the callees copy the path */
+		len = plen + strlen(de->d_name) + 2;
+		if (len > size) {
+			new = realloc(relpath, len);
+			if (new == NULL) {
+				fputs("out of memory\n", stderr);
+				goto out;
+			}
+			relpath = new;
+			size = len;
+		}
+
+		if (plen > 0) {
+			sprintf(relpath, "%s/%s", dir->path, de->d_name);
+		} else {
+			strcpy(relpath, de->d_name);
+		}
+
+		status = mkentry(st, dirfd(dp), de->d_name, relpath, &ent);
+		if (status < 0)
+			goto out;
+		if (status > 0)
+			continue;
+
+		ent->next = *list;
+		*list = ent;
+
+		if (S_ISDIR(ent->mode) && push_dir(st, relpath))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	free(relpath);
+	closedir(dp);
+	return ret;
+}
+
+static void *scan_worker(void *arg)
+{
+	scan_worker_t *self = arg;
+	scan_state_t *st = self->st;
+	scan_dir_t *dir;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&st->mtx);
+		while (st->queue == NULL && st->busy > 0 && !st->failed)
+			pthread_cond_wait(&st->cond, &st->mtx);
+
+		if (st->queue == NULL || st->failed) {
+			pthread_mutex_unlock(&st->mtx);
+			break;
+		}
+
+		dir = st->queue;
+		st->queue = dir->next;
+		pthread_mutex_unlock(&st->mtx);
+
+		ret = scan_dir(st, dir, &self->list);
+		free(dir);
+
+		pthread_mutex_lock(&st->mtx);
+		st->busy -= 1;
+		if (ret != 0)
+			st->failed = true;
+		if (st->busy == 0 || st->failed)
+			pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->mtx);
+	}
+
+	return NULL;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp((*(image_entry_t *const *)a)->name,
+		      (*(image_entry_t *const *)b)->name);
+}
+
+static image_entry_t *sort_by_name(image_entry_t *list)
+{
+	image_entry_t **array, *ent;
+	size_t i, count = 0;
+
+	for (ent = list; ent != NULL; ent = ent->next)
+		count += 1;
+
+	if (count < 2)
+		return list;
+
+	array = malloc(count * sizeof(array[0]));
+	if (array == NULL) {
+		fputs("out of memory\n", stderr);
+		image_entry_free_list(list);
+		return NULL;
+	}
+
+	for (i = 0, ent = list; ent != NULL; ent = ent->next)
+		array[i++] = ent;
+
+	qsort(array, count, sizeof(array[0]), compare_names);
+
+	for (i = 0; i + 1 < count; ++i)
+		array[i]->next = array[i + 1];
+
+	array[count - 1]->next = NULL;
+	list = array[0];
+	free(array);
+	return list;
+}
+
+int filelist_scan(const char *root, const owner_rule_t *owners,
+		  size_t num_workers, image_entry_t **out)
+{
+	scan_worker_t *workers = NULL;
+	pthread_t *threads = NULL;
+	image_entry_t *list = NULL, *ent;
+	size_t i, started = 0;
+	scan_dir_t *dir;
+	scan_state_t st;
+	int ret = -1;
+
+	*out = NULL;
+
+	if (num_workers == 0)
+		num_workers = 1;
+
+	memset(&st, 0, sizeof(st));
+	st.root = root;
+	st.owners = owners;
+	pthread_mutex_init(&st.mtx, NULL);
+	pthread_cond_init(&st.cond, NULL);
+
+	st.rootfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (st.rootfd < 0) {
+		perror(root);
+		goto out;
+	}
+
+	workers = calloc(num_workers, sizeof(workers[0]));
+	threads = calloc(num_workers, sizeof(threads[0]));
+	if (workers == NULL || threads == NULL) {
+		fputs("out of memory\n", stderr);
+		goto out;
+	}
+
+	if (push_dir(&st, ""))
+		goto out;
+
+	for (i = 0; i < num_workers; ++i) {
+		workers[i].st = &st;
+
+		if (pthread_create(threads + i, NULL, scan_worker,
+				   workers + i)) {
+			if (started > 0)
+				break;
+
+			fputs("failed to create directory scanning thread\n",
+			      stderr);
+			goto out;
+		}
+
+		started += 1;
+	}
+
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	if (!st.failed) {
+		for (i = 0; i < started; ++i) {
+			while (workers[i].list != NULL) {
+				ent = workers[i].list;
+				workers[i].list = ent->next;
+				ent->next = list;
+				list = ent;
+			}
+		}
+
+		if (list != NULL) {
+			list = sort_by_name(list);
+			if (list == NULL)
+				goto out;
+
+			list = image_entry_sort(list);
+
+			if (filelist_alloc_file_ids(list)) {
+				image_entry_free_list(list);
+				goto out;
+			}
+		}
+
+		*out = list;
+		ret = 0;
+	}
+out:
+	while (st.queue != NULL) {
+		dir = st.queue;
+		st.queue = dir->next;
+		free(dir);
+	}
+
+	if (workers != NULL) {
+		for (i = 0; i < num_workers; ++i)
+			image_entry_free_list(workers[i].list);
+	}
+
+	if (st.rootfd >= 0)
+		close(st.rootfd);
+
+	free(threads);
+	free(workers);
+	pthread_cond_destroy(&st.cond);
+	pthread_mutex_destroy(&st.mtx);
+	return ret;
+}
@@ -1,13 +1,196 @@
 /* SPDX-License-Identifier: ISC */
+#include <pthread.h>
+
 #include "pack.h"
 
-static int write_file(pkg_writer_t *wr, image_entry_t *ent)
+#define NUM_READERS 4
+#define READ_AHEAD 16
+#define SMALL_FILE_SIZE (256 * 1024)
+#define CHUNK_SIZE (1024 * 1024)
+
+/*
+  The file data is packed by a pipeline: reader threads open the next few
+  files ahead of the compressor, read small files into memory entirely and
+  ask the kernel to start reading larger ones, which the compressor then
+  reads in large chunks. The compressor runs on the calling thread and the
+  package writer has a thread of its own for the output.
+
+  For uncompressed data, the large files are not read at all. Instead, the
+  kernel copies them straight from the input file into the package.
+
+  With an aligned data layout, files of at least one alignment unit in
+  size are preceded by a padding entry, so their data starts at a multiple
+  of it in the package file.
+
+  Files are claimed by the readers in the order of their IDs and handed to
+  the compressor in the same order, through a ring of slots, so at most
+  READ_AHEAD files are in flight at any time.
+ */
+typedef struct {
+	int fd;
+	uint8_t *data;
+	size_t size;
+	bool ready;
+	int status;
+} input_slot_t;
+
+typedef struct {
+	image_entry_t **files;
+	size_t count;
+
+	size_t alignment;
+
+	input_slot_t slots[READ_AHEAD];
+	size_t next;
+	size_t consumed;
+	bool terminate;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t claim_cond;
+	pthread_cond_t ready_cond;
+
+	read_stats_t *stats;
+} read_queue_t;
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int load_file(input_slot_t *slot, image_entry_t *ent)
+{
+	const char *path = ent->data.file.location;
+	uint64_t size = ent->data.file.size;
+	ssize_t ret;
+
+	slot->fd = open(path, O_RDONLY);
+	if (slot->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (size > SMALL_FILE_SIZE) {
+		posix_fadvise(slot->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(slot->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return 0;
+	}
+
+	if (size > 0) {
+		slot->data = malloc(size);
+		if (slot->data == NULL) {
+			fputs("out of memory\n", stderr);
+			return -1;
+		}
+
+		ret = read_retry(slot->fd, slot->data, size);
+		if (ret < 0) {
+			perror(path);
+			return -1;
+		}
+
+		slot->size = ret;
+	}
+
+	close(slot->fd);
+	slot->fd = -1;
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	read_queue_t *queue = arg;
+	input_slot_t *slot;
+	uint64_t start;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&queue->mtx);
+
+	for (;;) {
+		while (!queue->terminate && queue->next < queue->count &&
+		       queue->next >= queue->consumed + READ_AHEAD) {
+			pthread_cond_wait(&queue->claim_cond, &queue->mtx);
+		}
+
+		if (queue->terminate || queue->next >= queue->count)
+			break;
+
+		i = queue->next++;
+		slot = queue->slots + (i % READ_AHEAD);
+		pthread_mutex_unlock(&queue->mtx);
+
+		start = time_ns();
+		ret = load_file(slot, queue->files[i]);
+
+		pthread_mutex_lock(&queue->mtx);
+		queue->stats->prefetch_ns += time_ns() - start;
+		queue->stats->prefetch_bytes += slot->size;
+		slot->status = ret;
+		slot->ready = true;
+		pthread_cond_broadcast(&queue->ready_cond);
+	}
+
+	pthread_mutex_unlock(&queue->mtx);
+	return NULL;
+}
+
+static void release_slot(input_slot_t *slot)
+{
+	if (slot->fd >= 0)
+		close(slot->fd);
+
+	free(slot->data);
+	memset(slot, 0, sizeof(*slot));
+	slot->fd = -1;
+}
+
+static int write_padding(pkg_writer_t *wr, size_t alignment)
 {
-	uint64_t offset = 0;
-	uint8_t buffer[1024];
+	static uint8_t zero[4096];
+	file_padding_t pad;
+	uint64_t offset;
+	size_t size, diff;
+
+	offset = pkg_writer_payload_offset(wr) + sizeof(file_data_t);
+	if (offset % alignment == 0)
+		return 0;
+
+	size = alignment - (offset + sizeof(pad)) % alignment;
+	if (size == alignment)
+		size = 0;
+
+	pad.id = htole32(PKG_FILE_ID_PADDING);
+	pad.size = htole32(size);
+
+	if (pkg_writer_write_payload(wr, &pad, sizeof(pad)))
+		return -1;
+
+	for (; size > 0; size -= diff) {
+		diff = size < sizeof(zero) ? size : sizeof(zero);
+
+		if (pkg_writer_write_payload(wr, zero, diff))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int write_file(pkg_writer_t *wr, read_queue_t *queue,
+		      input_slot_t *slot, image_entry_t *ent,
+		      uint8_t *buffer)
+{
+	uint64_t offset = 0, start;
 	file_data_t fdata;
+	size_t diff;
 	ssize_t ret;
-	int fd;
+
+	if (queue->alignment > 0 && ent->data.file.size >= queue->alignment) {
+		if (write_padding(wr, queue->alignment))
+			return -1;
+	}
 
 	memset(&fdata, 0, sizeof(fdata));
 
@@ -16,50 +199,170 @@ static int write_file(pkg_writer_t *wr, image_entry_t *ent)
 	if (pkg_writer_write_payload(wr, &fdata, sizeof(fdata)))
 		return -1;
 
-	fd = open(ent->data.file.location, O_RDONLY);
+	if (slot->fd < 0)
+		return pkg_writer_write_payload(wr, slot->data, slot->size);
 
-	if (fd < 0) {
-		perror(ent->data.file.location);
+	/* uncompressed records get the data copied over by the kernel */
+	ret = pkg_writer_copy_payload(wr, slot->fd, ent->data.file.size);
+	if (ret < 0)
 		return -1;
-	}
+
+	queue->stats->copied_bytes += (uint64_t)ret;
+	offset = (uint64_t)ret;
 
 	while (offset < ent->data.file.size) {
-		ret = read_retry(fd, buffer, sizeof(buffer));
+		diff = CHUNK_SIZE;
+		if (ent->data.file.size - offset < (uint64_t)diff)
+			diff = ent->data.file.size - offset;
+
+		start = time_ns();
+		ret = read_retry(slot->fd, buffer, diff);
+		queue->stats->inline_read_ns += time_ns() - start;
 
 		if (ret < 0) {
 			perror(ent->data.file.location);
-			goto fail_fd;
+			return -1;
 		}
 
 		if (ret == 0)
 			break;
 
+		queue->stats->inline_bytes += (uint64_t)ret;
+
 		if (pkg_writer_write_payload(wr, buffer, ret))
-			goto fail_fd;
+			return -1;
 
 		offset += (uint64_t)ret;
 	}
 
-	close(fd);
 	return 0;
-fail_fd:
-	close(fd);
+}
+
+static int run_pipeline(pkg_writer_t *wr, read_queue_t *queue)
+{
+	uint8_t *buffer = NULL;
+	input_slot_t *slot;
+	uint64_t start;
+	size_t i;
+
+	for (i = 0; i < queue->count; ++i) {
+		slot = queue->slots + (i % READ_AHEAD);
+
+		start = time_ns();
+		pthread_mutex_lock(&queue->mtx);
+		while (!slot->ready)
+			pthread_cond_wait(&queue->ready_cond, &queue->mtx);
+		pthread_mutex_unlock(&queue->mtx);
+		queue->stats->input_wait_ns += time_ns() - start;
+
+		if (slot->status != 0)
+			goto fail;
+
+		if (slot->fd >= 0 && buffer == NULL) {
+			buffer = malloc(CHUNK_SIZE);
+			if (buffer == NULL) {
+				fputs("out of memory\n", stderr);
+				goto fail;
+			}
+		}
+
+		if (write_file(wr, queue, slot, queue->files[i], buffer))
+			goto fail;
+
+		pthread_mutex_lock(&queue->mtx);
+		release_slot(slot);
+		queue->consumed += 1;
+		pthread_cond_broadcast(&queue->claim_cond);
+		pthread_mutex_unlock(&queue->mtx);
+	}
+
+	free(buffer);
+	return 0;
+fail:
+	free(buffer);
 	return -1;
 }
 
-int write_files(pkg_writer_t *wr, image_entry_t *list, compressor_t *cmp)
+int write_files(pkg_writer_t *wr, image_entry_t *list, compressor_t *cmp,
+		size_t alignment, read_stats_t *stats)
 {
-	if (pkg_writer_start_record(wr, PKG_MAGIC_DATA, cmp))
+	pthread_t readers[NUM_READERS];
+	size_t i, j, num_readers = 0;
+	read_stats_t dummy;
+	read_queue_t queue;
+	int ret = -1;
+
+	if (stats == NULL)
+		stats = &dummy;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&queue, 0, sizeof(queue));
+	queue.stats = stats;
+	queue.alignment = alignment;
+
+	for (i = 0; i < READ_AHEAD; ++i)
+		queue.slots[i].fd = -1;
+
+	/*
+	  The data is written in the order of the file IDs, which the
+	  data-order setting of the package description may have changed from
+	  the order of the list.
+	 */
+	queue.files = image_entry_file_index(list, &queue.count);
+	if (queue.files == NULL)
 		return -1;
 
-	while (list != NULL) {
-		if (S_ISREG(list->mode)) {
-			if (write_file(wr, list))
-				return -1;
+	/* deduplicated files share an ID and their data is only stored once */
+	for (i = 0, j = 0; i < queue.count; ++i) {
+		if (j > 0 && queue.files[j - 1]->data.file.id ==
+		    queue.files[i]->data.file.id) {
+			continue;
 		}
 
-		list = list->next;
+		queue.files[j++] = queue.files[i];
 	}
 
-	return pkg_writer_end_record(wr);
+	queue.count = j;
+	stats->files = queue.count;
+
+	pthread_mutex_init(&queue.mtx, NULL);
+	pthread_cond_init(&queue.claim_cond, NULL);
+	pthread_cond_init(&queue.ready_cond, NULL);
+
+	if (pkg_writer_start_record(wr, PKG_MAGIC_DATA, cmp))
+		goto out;
+
+	for (i = 0; i < NUM_READERS && i < queue.count; ++i) {
+		if (pthread_create(readers + i, NULL, reader_thread, &queue)) {
+			if (num_readers > 0)
+				break;
+
+			fputs("failed to create input reader thread\n", stderr);
+			goto out;
+		}
+
+		num_readers += 1;
+	}
+
+	stats->num_readers = num_readers;
+
+	if (run_pipeline(wr, &queue) == 0)
+		ret = pkg_writer_end_record(wr);
+out:
+	pthread_mutex_lock(&queue.mtx);
+	queue.terminate = true;
+	pthread_cond_broadcast(&queue.claim_cond);
+	pthread_mutex_unlock(&queue.mtx);
+
+	for (i = 0; i < num_readers; ++i)
+		pthread_join(readers[i], NULL);
+
+	for (i = 0; i < READ_AHEAD; ++i)
+		release_slot(queue.slots + i);
+
+	pthread_cond_destroy(&queue.ready_cond);
+	pthread_cond_destroy(&queue.claim_cond);
+	pthread_mutex_destroy(&queue.mtx);
+	free(queue.files);
+	return ret;
 }
@@ -2,6 +2,7 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
 
@@ -17,17 +18,26 @@ static const struct option long_opts[] = {
 	{ "no-chmod", no_argument, NULL, 'm' },
 	{ "no-symlinks", no_argument, NULL, 'L' },
 	{ "no-devices", no_argument, NULL, 'D' },
+	{ "sync", required_argument, NULL, 's' },
+	{ "hardlink", no_argument, NULL, 'H' },
+	{ "cache-dir", required_argument, NULL, 'C' },
+	{ "cache-size", required_argument, NULL, 'M' },
 	{ NULL, 0, NULL, 0 },
 };
 
-static const char *short_opts = "r:omLD";
+static const char *short_opts = "r:omLDs:HC:M:";
 
 static int cmd_unpack(int argc, char **argv)
 {
-	const char *root = NULL, *filename;
+	const char *root = NULL, *filename, *cache_dir = NULL;
+	uint64_t cache_size = PKG_CACHE_DEFAULT_SIZE;
+	pkg_cache_t *cache = NULL;
+	pkg_unpack_stats_t stats;
 	int i, rootfd, flags = 0;
 	pkg_reader_t *rd;
 
+	memset(&stats, 0, sizeof(stats));
+
 	for (;;) {
 		i = getopt_long(argc, argv, short_opts, long_opts, NULL);
 		if (i == -1)
@@ -49,6 +59,21 @@ static int cmd_unpack(int argc, char **argv)
 		case 'm':
 			flags |= UNPACK_NO_CHMOD;
 			break;
+		case 's':
+			if (pkg_unpack_parse_sync_mode(optarg, &flags)) {
+				tell_read_help(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			flags |= UNPACK_HARDLINK;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'M':
+			cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
 		default:
 			tell_read_help(argv[0]);
 			return EXIT_FAILURE;
@@ -78,19 +103,36 @@ static int cmd_unpack(int argc, char **argv)
 		}
 	}
 
+	if (cache_dir != NULL) {
+		cache = pkg_cache_open(cache_dir, cache_size);
+		if (cache == NULL)
+			goto fail_rootfd;
+	}
+
 	rd = pkg_reader_open(filename);
 	if (rd == NULL)
-		goto fail_rootfd;
+		goto fail_cache;
 
-	if (pkg_unpack(rootfd, flags, rd))
+	if (pkg_unpack(rootfd, flags, rd, cache, &stats))
 		goto fail;
 
+	if (flags & (UNPACK_SYNC_PACKAGE | UNPACK_SYNC_STRICT)) {
+		printf("time spent syncing: %lu.%03lu s\n",
+		       (unsigned long)(stats.sync_time / 1000000000UL),
+		       (unsigned long)(stats.sync_time / 1000000UL) % 1000);
+	}
+
 	pkg_reader_close(rd);
+	if (cache != NULL)
+		pkg_cache_close(cache);
 	if (rootfd != AT_FDCWD)
 		close(rootfd);
 	return EXIT_SUCCESS;
 fail:
 	pkg_reader_close(rd);
+fail_cache:
+	if (cache != NULL)
+		pkg_cache_close(cache);
 fail_rootfd:
 	if (rootfd != AT_FDCWD)
 		close(rootfd);
@@ -112,7 +154,24 @@ static command_t unpack = {
 "                          Keep the uid/gid of the user who runs the program.\n"
 "  --no-chmod, -m          Do not change permission flags of the extarcted\n"
 "                          data. Use 0644 for all files and 0755 for all\n"
-"                          directories.\n",
+"                          directories.\n"
+"  --no-symlinks, -L       Do not create symlinks.\n"
+"  --no-devices, -D        Do not create device files.\n"
+"  --sync, -s <mode>       Either \"none\" (default), \"package\" or \"strict\".\n"
+"                          See `help install' for details.\n"
+"  --cache-dir, -C <path>  Keep the extracted files of unpacked packages in\n"
+"                          a cache directory. Packages are identified by a\n"
+"                          hash of the package file. If a package is found\n"
+"                          in the cache, its files are reflinked (or copied\n"
+"                          if the file system does not support that) from\n"
+"                          the cache instead of decompressing the package.\n"
+"  --cache-size, -M <MiB>  Once done, evict the least recently used cache\n"
+"                          entries until the cache fits into the specified\n"
+"                          size. Defaults to 1024, 0 disables eviction.\n"
+"  --hardlink, -H          Hard link files from the cache instead of\n"
+"                          reflinking them. The cache and the unpacked\n"
+"                          files then share the same inodes, so the\n"
+"                          unpacked files must be treated as read-only.\n",
 	.run_cmd = cmd_unpack,
 };
 